@@ -3,10 +3,13 @@
 // found in the LICENSE file.
 
 #include "../sommelier.h"            // NOLINT(build/include_directory)
+#include "../sommelier-counters.h"   // NOLINT(build/include_directory)
+#include "../sommelier-recording.h"  // NOLINT(build/include_directory)
 #include "../sommelier-timing.h"     // NOLINT(build/include_directory)
 #include "../sommelier-tracing.h"    // NOLINT(build/include_directory)
 #include "../sommelier-transform.h"  // NOLINT(build/include_directory)
 #include "../sommelier-xshape.h"     // NOLINT(build/include_directory)
+#include "sommelier-copy.h"          // NOLINT(build/include_directory)
 
 #include <assert.h>
 #include <errno.h>
@@ -15,11 +18,18 @@
 #include <pixman.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "drm-server-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-explicit-synchronization-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
@@ -36,6 +46,20 @@ struct dma_buf_sync_file {
   __s32 fd;
 };
 
+// Maximum number of damage rects copied individually per commit; regions
+// with more rects collapse to their extents.
+#define MAX_DAMAGE_RECTS 64
+
+// Maximum number of idle output buffers retained in the per-context pool.
+// Oldest entries are evicted first.
+#define MAX_POOLED_OUTPUT_BUFFERS 8
+
+// Adaptive staging: how many commits between re-evaluations of a surface's
+// buffer type, and the size at which the heuristic seed prefers dmabuf
+// before any measurements exist.
+#define STAGING_EVAL_PERIOD 64
+#define STAGING_DMABUF_MIN_PIXELS (256 * 256)
+
 #define DMA_BUF_BASE 'b'
 #define DMA_BUF_IOCTL_SYNC _IOW(DMA_BUF_BASE, 0, struct dma_buf_sync)
 // TODO(b/189505947): DMA_BUF_IOCTL_EXPORT_SYNC_FILE might not exist, and
@@ -49,6 +73,8 @@ struct sl_host_compositor {
   struct wl_compositor* proxy;
 };
 
+static void sl_render_sync(struct sl_host_surface* host);
+
 struct sl_output_buffer {
   struct wl_list link;
   uint32_t width;
@@ -59,6 +85,19 @@ struct sl_output_buffer {
   struct pixman_region32 surface_damage;
   struct pixman_region32 buffer_damage;
   pixman_image_t* shape_image;
+  // Generation of the window shape shape_image was last stamped out with;
+  // a mismatch against the surface's shape generation forces a full
+  // regeneration instead of a damage-driven incremental one.
+  uint64_t shape_generation;
+  // Non-dmabuf buffers keep the wl_shm_pool wrapping their channel
+  // allocation alive for the buffer's lifetime, so the buffer can be
+  // rebound to new dimensions within alloc_size without a new channel
+  // allocation or host mapping.  NULL for dmabuf buffers.
+  struct wl_shm_pool* shm_pool;
+  size_t alloc_size;
+  // When the buffer last became idle (released by the host or parked in a
+  // pool); the idle reclaim timer destroys buffers past the quiet period.
+  uint64_t idle_since_ns;
   struct sl_host_surface* surface;
 };
 
@@ -79,6 +118,8 @@ static void sl_virtwl_dmabuf_end_write(int fd, struct sl_context* ctx) {
 
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
   wl_buffer_destroy(buffer->internal);
+  if (buffer->shm_pool)
+    wl_shm_pool_destroy(buffer->shm_pool);
   sl_mmap_unref(buffer->mmap);
   pixman_region32_fini(&buffer->surface_damage);
   pixman_region32_fini(&buffer->buffer_damage);
@@ -94,6 +135,26 @@ static uint32_t try_wl_resource_get_id(wl_resource* resource) {
   return resource ? wl_resource_get_id(resource) : -1;
 }
 
+// Moves an idle output buffer into the per-context pool instead of
+// destroying it, so surfaces that bounce between sizes (interactive resize)
+// or get recreated can skip the synchronous channel allocation.  The pool
+// is kept in MRU order and capped at MAX_POOLED_OUTPUT_BUFFERS.
+static void sl_output_buffer_pool_insert(struct sl_context* ctx,
+                                         struct sl_output_buffer* buffer) {
+  wl_list_remove(&buffer->link);
+  buffer->surface = NULL;
+  buffer->idle_since_ns = sl_counters_now_ns();
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  ctx->output_buffer_pool_size++;
+
+  while (ctx->output_buffer_pool_size > MAX_POOLED_OUTPUT_BUFFERS) {
+    struct sl_output_buffer* oldest = wl_container_of(
+        ctx->output_buffer_pool.prev, oldest, link);
+    sl_output_buffer_destroy(oldest);
+    ctx->output_buffer_pool_size--;
+  }
+}
+
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer =
       static_cast<sl_output_buffer*>(wl_buffer_get_user_data(buffer));
@@ -102,12 +163,432 @@ static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_host_surface* host_surface = output_buffer->surface;
 
   wl_list_remove(&output_buffer->link);
+  output_buffer->idle_since_ns = sl_counters_now_ns();
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+// Rebinds a pooled non-dmabuf buffer to new dimensions.  The channel
+// allocation is over-sized to a power of two, so as long as the new
+// contents fit, only a fresh wl_buffer needs to be carved out of the
+// retained pool; the channel allocation and the host's mapping of it
+// are reused as-is.
+static void sl_output_buffer_rebind(struct sl_output_buffer* buffer,
+                                    struct sl_host_surface* host,
+                                    uint32_t width,
+                                    uint32_t height,
+                                    uint32_t shm_format,
+                                    bool needs_shape_image) {
+  struct sl_mmap* contents = host->contents_shm_mmap;
+
+  wl_buffer_destroy(buffer->internal);
+  buffer->internal = wl_shm_pool_create_buffer(
+      buffer->shm_pool, 0, width, height, contents->stride[0], shm_format);
+  wl_buffer_add_listener(buffer->internal, &sl_output_buffer_listener, buffer);
+
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = shm_format;
+
+  // The mmap spans the whole allocation at offset zero, so only the
+  // layout fields need to track the new contents.
+  buffer->mmap->bpp = sl_shm_bpp_for_shm_format(shm_format);
+  buffer->mmap->num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+  buffer->mmap->stride[0] = contents->stride[0];
+  buffer->mmap->offset[1] = contents->offset[1] - contents->offset[0];
+  buffer->mmap->stride[1] = contents->stride[1];
+  buffer->mmap->y_ss[0] = contents->y_ss[0];
+  buffer->mmap->y_ss[1] = contents->y_ss[1];
+
+  if (buffer->shape_image)
+    pixman_image_unref(buffer->shape_image);
+  if (needs_shape_image) {
+    buffer->shape_image = pixman_image_create_bits_no_clear(
+        PIXMAN_a8r8g8b8, width, height, NULL, 0);
+    assert(buffer->shape_image);
+  } else {
+    buffer->shape_image = NULL;
+  }
+  buffer->shape_generation = 0;
+}
+
+// Takes a matching buffer from the pool, if any, and hands it to |host|.
+// A buffer of the exact size and format is preferred; failing that, any
+// non-dmabuf buffer whose retained channel allocation is large enough is
+// rebound to the new dimensions.  The buffer contents are stale either
+// way, so its damage is reset to the full buffer.
+static struct sl_output_buffer* sl_output_buffer_pool_take(
+    struct sl_host_surface* host,
+    uint32_t width,
+    uint32_t height,
+    uint32_t shm_format,
+    bool needs_shape_image) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* found = NULL;
+
+  wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+    if ((buffer->shm_pool == NULL) == host->staging_dmabuf &&
+        buffer->width == width && buffer->height == height &&
+        ((needs_shape_image && buffer->shape_image &&
+          buffer->format == WL_SHM_FORMAT_ARGB8888) ||
+         (!needs_shape_image && buffer->format == shm_format))) {
+      found = buffer;
+      break;
+    }
+  }
+
+  if (!found && !host->staging_dmabuf && host->contents_shm_mmap) {
+    wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+      if (buffer->shm_pool &&
+          buffer->alloc_size >= host->contents_shm_mmap->size) {
+        found = buffer;
+        break;
+      }
+    }
+    if (found) {
+      sl_output_buffer_rebind(found, host, width, height, shm_format,
+                              needs_shape_image);
+    }
+  }
+
+  if (!found)
+    return NULL;
+
+  wl_list_remove(&found->link);
+  ctx->output_buffer_pool_size--;
+
+  found->surface = host;
+  pixman_region32_fini(&found->surface_damage);
+  pixman_region32_fini(&found->buffer_damage);
+  pixman_region32_init_rect(&found->surface_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+  pixman_region32_init_rect(&found->buffer_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+  wl_list_insert(&host->released_buffers, &found->link);
+  return found;
+}
+
+// Destroys retained output buffers that have been idle for the configured
+// quiet period: the released buffers of surfaces that stopped committing
+// (a maximized 4K window that got minimized pins tens of megabytes of
+// guest and host memory otherwise) and aged entries in the context-wide
+// pool.  The next attach simply reallocates.
+static int sl_handle_reclaim_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  uint64_t now_ns = sl_counters_now_ns();
+  uint64_t delay_ns = (uint64_t)ctx->idle_reclaim_delay * 1000000000ull;
+  struct sl_host_surface* surface;
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* tmp;
+
+  wl_list_for_each(surface, &ctx->reclaim_surfaces, reclaim_link) {
+    if (now_ns - surface->last_commit_ns < delay_ns)
+      continue;
+
+    wl_list_for_each_safe(buffer, tmp, &surface->released_buffers, link) {
+      // The current buffer may be attached but not yet committed.
+      if (buffer == surface->current_buffer)
+        continue;
+      if (now_ns - buffer->idle_since_ns >= delay_ns) {
+        sl_output_buffer_destroy(buffer);
+        ctx->counters->surface.buffer_pool_reclaims++;
+      }
+    }
+  }
+
+  wl_list_for_each_safe(buffer, tmp, &ctx->output_buffer_pool, link) {
+    if (now_ns - buffer->idle_since_ns >= delay_ns) {
+      sl_output_buffer_destroy(buffer);
+      ctx->output_buffer_pool_size--;
+      ctx->counters->surface.buffer_pool_reclaims++;
+    }
+  }
+
+  wl_event_source_timer_update(ctx->reclaim_timer_event_source.get(),
+                               ctx->idle_reclaim_delay * 1000);
+  return 1;
+}
+
+// Adaptive staging: picks between dmabuf and shm output buffers per
+// surface.  Small, frequently damaged surfaces (cursors, tooltips) are
+// cheaper through shm, which skips the dma-buf sync round trip; large
+// surfaces win on dmabuf scanout.  Rather than guessing from a global
+// capability bit, each surface measures its actual per-commit copy+sync
+// cost and keeps whichever type is cheaper.
+//
+// A size change resets the measurements and re-seeds the choice from a
+// size heuristic; the heuristic only matters until real numbers arrive.
+static void sl_surface_staging_size_check(struct sl_host_surface* host,
+                                          uint32_t width,
+                                          uint32_t height) {
+  if (width == host->staging_width && height == host->staging_height)
+    return;
+
+  host->staging_width = width;
+  host->staging_height = height;
+  host->staging_cost_ns[0] = 0;
+  host->staging_cost_ns[1] = 0;
+  host->staging_commits = 0;
+  host->staging_dmabuf = host->ctx->channel->supports_dmabuf() &&
+                         width * height >= STAGING_DMABUF_MIN_PIXELS;
+}
+
+// Folds one commit's measured copy+sync cost into the EWMA for the
+// surface's current buffer type, and every STAGING_EVAL_PERIOD commits
+// re-picks the type.  The first evaluation switches unconditionally so
+// both types get measured at this size; after that, switching requires
+// the other type to be ahead by ~12% so noise doesn't ping-pong the
+// buffer type and its allocations.
+static void sl_surface_staging_update(struct sl_host_surface* host,
+                                      int64_t cost_ns) {
+  int current = host->staging_dmabuf ? 1 : 0;
+  int64_t* ewma = &host->staging_cost_ns[current];
+
+  *ewma = *ewma ? *ewma - *ewma / 8 + cost_ns / 8 : cost_ns;
+
+  if (!host->ctx->channel->supports_dmabuf())
+    return;
+  if (++host->staging_commits < STAGING_EVAL_PERIOD)
+    return;
+  host->staging_commits = 0;
+
+  int other = current ^ 1;
+  if (host->staging_cost_ns[other] == 0 ||
+      host->staging_cost_ns[other] <
+          host->staging_cost_ns[current] - host->staging_cost_ns[current] / 8) {
+    host->staging_dmabuf = !host->staging_dmabuf;
+  }
+}
+
+// Everything needed to finish constructing an output buffer once its
+// backing allocation completes.  Captured up front so asynchronous
+// allocations do not depend on the surface (or its contents mmap) still
+// being alive when the completion arrives.
+struct sl_output_buffer_params {
+  struct sl_context* ctx;
+  uint32_t width;
+  uint32_t height;
+  uint32_t shm_format;
+  bool needs_shape_image;
+  size_t bpp;
+  size_t num_planes;
+  size_t stride[2];
+  size_t offset1;  // Second plane offset relative to the first.
+  size_t y_ss[2];
+  struct WaylandBufferCreateInfo create_info;
+};
+
+static void sl_output_buffer_params_init(struct sl_output_buffer_params* params,
+                                         struct sl_host_surface* host,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         uint32_t shm_format,
+                                         bool needs_shape_image) {
+  params->ctx = host->ctx;
+  params->width = width;
+  params->height = height;
+  params->shm_format = shm_format;
+  params->needs_shape_image = needs_shape_image;
+  params->bpp = sl_shm_bpp_for_shm_format(shm_format);
+  params->num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+  params->stride[0] = host->contents_shm_mmap->stride[0];
+  params->stride[1] = host->contents_shm_mmap->stride[1];
+  params->offset1 =
+      host->contents_shm_mmap->offset[1] - host->contents_shm_mmap->offset[0];
+  params->y_ss[0] = host->contents_shm_mmap->y_ss[0];
+  params->y_ss[1] = host->contents_shm_mmap->y_ss[1];
+
+  memset(&params->create_info, 0, sizeof(params->create_info));
+  if (host->staging_dmabuf) {
+    params->create_info.dmabuf = true;
+    params->create_info.width = static_cast<__u32>(width);
+    params->create_info.height = static_cast<__u32>(height);
+    params->create_info.drm_format = sl_drm_format_for_shm_format(shm_format);
+  } else {
+    size_t size = host->contents_shm_mmap->size;
+    // Round the allocation up to the next power of two.  The wl_shm_pool
+    // created over it is kept for the buffer's lifetime, so a pooled
+    // buffer can later be rebound to any contents that still fit without
+    // a new channel allocation or host mapping.
+    size_t alloc_size = 4096;
+    while (alloc_size < size)
+      alloc_size *= 2;
+
+    params->create_info.drm_format = DRM_FORMAT_R8;
+    params->create_info.height = 1;
+    params->create_info.width = alloc_size;
+    params->create_info.size = static_cast<__u32>(alloc_size);
+  }
+}
+
+// Builds an output buffer around a completed channel allocation.  The
+// buffer is not placed on any surface's buffer list.
+static struct sl_output_buffer* sl_output_buffer_build(
+    struct sl_output_buffer_params* params,
+    struct WaylandBufferCreateOutput* create_output) {
+  uint32_t width = params->width;
+  uint32_t height = params->height;
+  struct sl_output_buffer* buffer = new sl_output_buffer();
+
+  wl_list_init(&buffer->link);
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = params->shm_format;
+  buffer->shape_generation = 0;
+  buffer->shm_pool = NULL;
+  buffer->alloc_size = 0;
+  buffer->idle_since_ns = sl_counters_now_ns();
+  buffer->surface = NULL;
+  pixman_region32_init_rect(&buffer->surface_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+  pixman_region32_init_rect(&buffer->buffer_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+
+  if (params->needs_shape_image) {
+    buffer->shape_image = pixman_image_create_bits_no_clear(
+        PIXMAN_a8r8g8b8, width, height, NULL, 0);
+
+    assert(buffer->shape_image);
+  } else {
+    buffer->shape_image = NULL;
+  }
+
+  if (params->create_info.dmabuf) {
+    size_t size = create_output->host_size;
+    struct zwp_linux_buffer_params_v1* buffer_params;
+
+    buffer_params =
+        zwp_linux_dmabuf_v1_create_params(params->ctx->linux_dmabuf->internal);
+    zwp_linux_buffer_params_v1_add(buffer_params, create_output->fd, 0,
+                                   create_output->offsets[0],
+                                   create_output->strides[0], 0, 0);
+    if (params->num_planes > 1) {
+      zwp_linux_buffer_params_v1_add(buffer_params, create_output->fd, 1,
+                                     create_output->offsets[1],
+                                     create_output->strides[1], 0, 0);
+      size = MAX(size, create_output->offsets[1] +
+                           create_output->offsets[1] * height /
+                               params->y_ss[1]);
+    }
+    buffer->internal = zwp_linux_buffer_params_v1_create_immed(
+        buffer_params, width, height, params->create_info.drm_format, 0);
+    zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+    buffer->mmap = sl_mmap_create(
+        create_output->fd, size, params->bpp, params->num_planes,
+        create_output->offsets[0], create_output->strides[0],
+        create_output->offsets[1], create_output->strides[1], params->y_ss[0],
+        params->y_ss[1]);
+    buffer->mmap->begin_write = sl_virtwl_dmabuf_begin_write;
+    buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
+  } else {
+    // The pool stays alive with the buffer instead of being destroyed as
+    // soon as the wl_buffer is carved out, so rebinding the buffer to new
+    // dimensions later does not tear down the host's mapping.
+    buffer->shm_pool = wl_shm_create_pool(
+        params->ctx->shm->internal, create_output->fd,
+        create_output->host_size);
+    buffer->alloc_size = create_output->host_size;
+
+    buffer->internal = wl_shm_pool_create_buffer(
+        buffer->shm_pool, 0, width, height, params->stride[0],
+        params->shm_format);
+
+    buffer->mmap = sl_mmap_create(create_output->fd, create_output->host_size,
+                                  params->bpp, params->num_planes, 0,
+                                  params->stride[0], params->offset1,
+                                  params->stride[1], params->y_ss[0],
+                                  params->y_ss[1]);
+  }
+
+  assert(buffer->internal);
+  assert(buffer->mmap);
+
+  wl_buffer_add_listener(buffer->internal, &sl_output_buffer_listener, buffer);
+
+  return buffer;
+}
+
+// All channel allocations funnel through the allocator thread when one
+// exists, so synchronous calls here never race with asynchronous ones
+// inside the channel implementation.
+static int32_t sl_channel_allocate(
+    struct sl_context* ctx,
+    const struct WaylandBufferCreateInfo& create_info,
+    struct WaylandBufferCreateOutput& create_output) {
+  if (ctx->channel_allocator)
+    return ctx->channel_allocator->allocate_sync(create_info, create_output);
+  return ctx->channel->allocate(create_info, create_output);
+}
+
+// Allocates a new output buffer of the given size through the wayland
+// channel and inserts it into |host|'s released buffer list.  A shaped
+// buffer with a non-ARGB source additionally carries the ARGB shape
+// staging image; ARGB sources are shaped in place by the fused copy path.
+static struct sl_output_buffer* sl_output_buffer_create(
+    struct sl_host_surface* host,
+    uint32_t width,
+    uint32_t height,
+    uint32_t shm_format,
+    bool needs_shape_image) {
+  struct sl_output_buffer_params params;
+  struct WaylandBufferCreateOutput create_output = {0};
+  struct sl_output_buffer* buffer;
+  int rv;
+
+  sl_output_buffer_params_init(&params, host, width, height, shm_format,
+                               needs_shape_image);
+
+  rv = sl_channel_allocate(host->ctx, params.create_info, create_output);
+  if (params.create_info.dmabuf && rv) {
+    fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
+            strerror(-rv));
+    _exit(EXIT_FAILURE);
+  }
+  UNUSED(rv);
+
+  buffer = sl_output_buffer_build(&params, &create_output);
+  buffer->surface = host;
+  wl_list_insert(&host->released_buffers, &buffer->link);
+
+  return buffer;
+}
+
+static void sl_output_buffer_create_async_done(
+    int rv,
+    struct WaylandBufferCreateOutput* create_output,
+    void* data) {
+  struct sl_output_buffer_params* params =
+      static_cast<sl_output_buffer_params*>(data);
+
+  if (rv) {
+    // The buffer was speculative; losing it only costs a synchronous
+    // allocation later.
+    fprintf(stderr, "warning: async buffer allocation failed: %s\n",
+            strerror(-rv));
+  } else {
+    sl_output_buffer_pool_insert(params->ctx,
+                                 sl_output_buffer_build(params, create_output));
+  }
+
+  delete params;
+}
+
+// Starts an output buffer allocation on the allocator thread.  The finished
+// buffer lands in the context-wide pool, from where the next attach of a
+// matching size picks it up.
+static void sl_output_buffer_create_async(struct sl_host_surface* host,
+                                          uint32_t width,
+                                          uint32_t height,
+                                          uint32_t shm_format,
+                                          bool needs_shape_image) {
+  struct sl_output_buffer_params* params = new sl_output_buffer_params();
+
+  sl_output_buffer_params_init(params, host, width, height, shm_format,
+                               needs_shape_image);
+  host->ctx->channel_allocator->allocate(
+      params->create_info, sl_output_buffer_create_async_done, params);
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   TRACE_EVENT("surface", "sl_host_surface_destroy", "resource_id",
@@ -115,6 +596,50 @@ static void sl_host_surface_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+// Forwards an attach (and any commit held behind it) that was staged until
+// the buffer's acquire fence signaled.
+static void sl_surface_fence_complete(struct sl_host_surface* host) {
+  wl_event_source_remove(host->fence_event_source);
+  host->fence_event_source = NULL;
+  if (host->fence_fd >= 0) {
+    close(host->fence_fd);
+    host->fence_fd = -1;
+  }
+
+  wl_surface_attach(host->proxy, host->fence_attach_buffer,
+                    host->fence_attach_x, host->fence_attach_y);
+  host->fence_attach_buffer = NULL;
+  if (host->fence_commit_pending) {
+    host->fence_commit_pending = false;
+    wl_surface_commit(host->proxy);
+  }
+}
+
+static int sl_handle_acquire_fence_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("surface", "sl_handle_acquire_fence_event");
+  sl_surface_fence_complete(static_cast<sl_host_surface*>(data));
+  return 1;
+}
+
+// Stages the attach of |buffer_proxy| until |fence_fd| signals readable.
+// |fence_fd| is either an exported sync file (|owned|, closed on
+// completion) or the dmabuf itself, whose poll readiness tracks its
+// implicit read fences.
+static void sl_surface_fence_defer_attach(struct sl_host_surface* host,
+                                          int fence_fd,
+                                          bool owned,
+                                          struct wl_buffer* buffer_proxy,
+                                          int32_t x,
+                                          int32_t y) {
+  host->fence_event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(host->ctx->host_display), fence_fd,
+      WL_EVENT_READABLE, sl_handle_acquire_fence_event, host);
+  host->fence_fd = owned ? fence_fd : -1;
+  host->fence_attach_buffer = buffer_proxy;
+  host->fence_attach_x = x;
+  host->fence_attach_y = y;
+}
+
 static void sl_host_surface_attach(struct wl_client* client,
                                    struct wl_resource* resource,
                                    struct wl_resource* buffer_resource,
@@ -130,6 +655,22 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (host->ctx->timing != NULL) {
     host->ctx->timing->UpdateLastAttach(resource_id, buffer_id);
   }
+  if (host->ctx->recording_file && buffer_resource) {
+    sl_recording_attach(host->ctx, resource_id,
+                        static_cast<sl_host_buffer*>(
+                            wl_resource_get_user_data(buffer_resource)));
+  }
+
+  // Finish any commit still staged on the render thread; it copies into the
+  // buffer state this attach is about to replace.
+  sl_render_sync(host);
+
+  // A previous attach may still be staged behind its acquire fence.  It has
+  // to reach the host before this one replaces it, or its buffer is never
+  // attached host-side and never released back to the guest.
+  if (host->fence_event_source)
+    sl_surface_fence_complete(host);
+
   struct sl_host_buffer* host_buffer =
       buffer_resource ? static_cast<sl_host_buffer*>(
                             wl_resource_get_user_data(buffer_resource))
@@ -146,11 +687,26 @@ static void sl_host_surface_attach(struct wl_client* client,
 
   host->current_buffer = NULL;
   if (host->contents_shm_mmap) {
+    // A buffer still held here was superseded before its commit went out --
+    // the client attached twice without committing, or commits were
+    // suppressed while hidden.  Release it back to the client.
+    if (host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
 
+  // Remember the previous contents size so we can detect an in-progress
+  // resize below.
+  uint32_t prev_contents_width = host->contents_width;
+  uint32_t prev_contents_height = host->contents_height;
+
   if (host_buffer) {
+    // For zero-copy buffers a nonzero attach time means the host has not
+    // yet released the buffer from a previous commit, so its pages may
+    // still be on screen.
+    bool release_outstanding = host_buffer->attach_time_ns != 0;
+    host_buffer->attach_time_ns = sl_counters_now_ns();
     host->contents_width = host_buffer->width;
     host->contents_height = host_buffer->height;
     host->contents_shm_format = host_buffer->shm_format;
@@ -163,6 +719,13 @@ static void sl_host_surface_attach(struct wl_client* client,
     } else {
       if (window_shaped && host_buffer->shm_mmap) {
         host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
+      } else if (host_buffer->zero_copy && host_buffer->shm_mmap &&
+                 release_outstanding) {
+        // The client is reusing the buffer before the host released it, so
+        // a zero-copy attach would let it draw into the pages being
+        // presented.  Fall back to the staging copy for this frame; the
+        // buffer returns to zero copy once the host's release arrives.
+        host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
       } else {
         // A fallback if for some reason the DRM PRIME mmap container was
         // not created (or if this is not a shaped window)
@@ -177,6 +740,7 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (window_shaped) {
     host->contents_shaped = true;
     pixman_region32_copy(&host->contents_shape, &window->shape_rectangles);
+    host->contents_shape_generation = window->shape_generation;
   } else {
     host->contents_shaped = false;
     pixman_region32_clear(&host->contents_shape);
@@ -188,136 +752,76 @@ static void sl_host_surface_attach(struct wl_client* client,
   // An output_surface that is shaped will have its format
   // forced to ARGB8888 (hence the changes below)
   if (host->contents_shm_mmap) {
+    uint32_t shm_format =
+        window_shaped ? WL_SHM_FORMAT_ARGB8888 : host_buffer->shm_format;
+
+    // ARGB sources are shaped in place by the fused copy path in commit;
+    // only other formats need the intermediate pixman stamp out image.
+    bool needs_shape_image =
+        window_shaped && host_buffer->shm_format != WL_SHM_FORMAT_ARGB8888;
+
+    sl_surface_staging_size_check(host, host_buffer->width,
+                                  host_buffer->height);
+
     while (!wl_list_empty(&host->released_buffers)) {
       host->current_buffer = wl_container_of(host->released_buffers.next,
                                              host->current_buffer, link);
 
-      if (host->current_buffer->width == host_buffer->width &&
+      if ((host->current_buffer->shm_pool == NULL) == host->staging_dmabuf &&
+          host->current_buffer->width == host_buffer->width &&
           host->current_buffer->height == host_buffer->height &&
-          ((window_shaped && host->current_buffer->shape_image &&
+          ((needs_shape_image && host->current_buffer->shape_image &&
             host->current_buffer->format == WL_SHM_FORMAT_ARGB8888) ||
-           (!window_shaped &&
-            host->current_buffer->format == host_buffer->shm_format))) {
+           (!needs_shape_image &&
+            host->current_buffer->format == shm_format))) {
         break;
       }
 
-      sl_output_buffer_destroy(host->current_buffer);
+      // Park mismatched buffers in the context-wide pool instead of
+      // destroying them; the client may well come back to this size.
+      sl_output_buffer_pool_insert(host->ctx, host->current_buffer);
       host->current_buffer = NULL;
     }
 
-    // Allocate new output buffer.
     if (!host->current_buffer) {
-      TRACE_EVENT("surface", "sl_host_surface_attach: allocate_buffer",
-                  "dmabuf_enabled", host->ctx->channel->supports_dmabuf());
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
-      uint32_t shm_format =
-          window_shaped ? WL_SHM_FORMAT_ARGB8888 : host_buffer->shm_format;
-      size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
-      size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
-
-      host->current_buffer = new sl_output_buffer();
-      wl_list_insert(&host->released_buffers, &host->current_buffer->link);
-      host->current_buffer->width = width;
-      host->current_buffer->height = height;
-      host->current_buffer->format = shm_format;
-      host->current_buffer->surface = host;
-      pixman_region32_init_rect(&host->current_buffer->surface_damage, 0, 0,
-                                MAX_SIZE, MAX_SIZE);
-      pixman_region32_init_rect(&host->current_buffer->buffer_damage, 0, 0,
-                                MAX_SIZE, MAX_SIZE);
-
-      if (window_shaped) {
-        host->current_buffer->shape_image = pixman_image_create_bits_no_clear(
-            PIXMAN_a8r8g8b8, width, height, NULL, 0);
-
-        assert(host->current_buffer->shape_image);
-      } else {
-        host->current_buffer->shape_image = NULL;
-      }
+      host->current_buffer =
+          sl_output_buffer_pool_take(host, host_buffer->width,
+                                     host_buffer->height, shm_format,
+                                     needs_shape_image);
+    }
 
-      if (host->ctx->channel->supports_dmabuf()) {
-        int rv;
-        size_t size;
-        struct zwp_linux_buffer_params_v1* buffer_params;
-        struct WaylandBufferCreateInfo create_info = {0};
-        struct WaylandBufferCreateOutput create_output = {0};
-        create_info.dmabuf = true;
-
-        create_info.width = static_cast<__u32>(width);
-        create_info.height = static_cast<__u32>(height);
-        create_info.drm_format = sl_drm_format_for_shm_format(shm_format);
-
-        rv = host->ctx->channel->allocate(create_info, create_output);
-        if (rv) {
-          fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
-                  strerror(-rv));
-          _exit(EXIT_FAILURE);
-        }
+    if (host->current_buffer)
+      host->ctx->counters->surface.buffer_pool_hits++;
 
-        size = create_output.host_size;
-        buffer_params = zwp_linux_dmabuf_v1_create_params(
-            host->ctx->linux_dmabuf->internal);
-        zwp_linux_buffer_params_v1_add(buffer_params, create_output.fd, 0,
-                                       create_output.offsets[0],
-                                       create_output.strides[0], 0, 0);
-        if (num_planes > 1) {
-          zwp_linux_buffer_params_v1_add(buffer_params, create_output.fd, 1,
-                                         create_output.offsets[1],
-                                         create_output.strides[1], 0, 0);
-          size = MAX(size, create_output.offsets[1] +
-                               create_output.offsets[1] * height /
-                                   host->contents_shm_mmap->y_ss[1]);
-        }
-        host->current_buffer->internal =
-            zwp_linux_buffer_params_v1_create_immed(
-                buffer_params, width, height, create_info.drm_format, 0);
-        zwp_linux_buffer_params_v1_destroy(buffer_params);
-
-        host->current_buffer->mmap = sl_mmap_create(
-            create_output.fd, size, bpp, num_planes, create_output.offsets[0],
-            create_output.strides[0], create_output.offsets[1],
-            create_output.strides[1], host->contents_shm_mmap->y_ss[0],
-            host->contents_shm_mmap->y_ss[1]);
-        host->current_buffer->mmap->begin_write = sl_virtwl_dmabuf_begin_write;
-        host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
-      } else {
-        size_t size = host->contents_shm_mmap->size;
-        struct WaylandBufferCreateInfo create_info = {0};
-        struct WaylandBufferCreateOutput create_output = {0};
-        struct wl_shm_pool* pool;
-        int rv;
-
-        create_info.drm_format = DRM_FORMAT_R8;
-        create_info.height = 1;
-        create_info.width = size;
-        create_info.size = static_cast<__u32>(size);
-
-        rv = host->ctx->channel->allocate(create_info, create_output);
-        UNUSED(rv);
-
-        pool = wl_shm_create_pool(host->ctx->shm->internal, create_output.fd,
-                                  create_output.host_size);
-
-        host->current_buffer->internal = wl_shm_pool_create_buffer(
-            pool, 0, width, height, host->contents_shm_mmap->stride[0],
-            shm_format);
-        wl_shm_pool_destroy(pool);
-
-        host->current_buffer->mmap = sl_mmap_create(
-            create_output.fd, create_output.host_size, bpp, num_planes, 0,
-            host->contents_shm_mmap->stride[0],
-            host->contents_shm_mmap->offset[1] -
-                host->contents_shm_mmap->offset[0],
-            host->contents_shm_mmap->stride[1],
-            host->contents_shm_mmap->y_ss[0], host->contents_shm_mmap->y_ss[1]);
+    // Allocate new output buffer.
+    if (!host->current_buffer) {
+      host->ctx->counters->surface.buffer_pool_misses++;
+      TRACE_EVENT("surface", "sl_host_surface_attach: allocate_buffer",
+                  "dmabuf", host->staging_dmabuf);
+      host->current_buffer =
+          sl_output_buffer_create(host, host_buffer->width,
+                                  host_buffer->height, shm_format,
+                                  needs_shape_image);
+
+      // During an interactive resize nearly every frame arrives with a new
+      // size, and double-buffered clients will need a second buffer of that
+      // size one frame later.  Pre-warm it now so the next attach doesn't
+      // also hit a synchronous channel allocation mid-drag.  The allocation
+      // overlaps with the rest of this frame on the allocator thread.
+      bool resizing = prev_contents_width && prev_contents_height &&
+                      (host_buffer->width != prev_contents_width ||
+                       host_buffer->height != prev_contents_height);
+      if (resizing && host->ctx->channel_allocator) {
+        sl_output_buffer_create_async(host, host_buffer->width,
+                                      host_buffer->height, shm_format,
+                                      needs_shape_image);
+      } else if (resizing) {
+        sl_output_buffer_pool_insert(
+            host->ctx,
+            sl_output_buffer_create(host, host_buffer->width,
+                                    host_buffer->height, shm_format,
+                                    needs_shape_image));
       }
-
-      assert(host->current_buffer->internal);
-      assert(host->current_buffer->mmap);
-
-      wl_buffer_add_listener(host->current_buffer->internal,
-                             &sl_output_buffer_listener, host->current_buffer);
     }
   }
 
@@ -328,6 +832,8 @@ static void sl_host_surface_attach(struct wl_client* client,
   host->contents_x_offset = x;
   host->contents_y_offset = y;
 
+  bool defer_attach = false;
+
   if (host_buffer && host_buffer->sync_point) {
     TRACE_EVENT("surface", "sl_host_surface_attach: sync_point");
     dma_buf_sync_file sync_file;
@@ -363,24 +869,54 @@ static void sl_host_surface_attach(struct wl_client* client,
     }
 
     if (needs_sync) {
-      host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+      if (host->contents_shm_mmap) {
+        // The copy path reads the buffer contents on the CPU, so there is
+        // no choice but to wait for the GPU here.
+        host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+      } else {
+        // Instead of blocking the event thread until the GPU finishes
+        // (sync_point->sync), stage the attach behind the buffer's fence
+        // and keep dispatching other surfaces and input.  Prefer an
+        // exported sync file; fall back to polling the dmabuf itself,
+        // which becomes readable once its write fences signal.
+        int fence_fd;
+        bool fence_owned;
+        int ret;
+
+        sync_file.flags = DMA_BUF_SYNC_READ;
+        do {
+          ret = ioctl(host_buffer->sync_point->fd,
+                      DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &sync_file);
+        } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+        if (!ret) {
+          fence_fd = sync_file.fd;
+          fence_owned = true;
+        } else {
+          fence_fd = host_buffer->sync_point->fd;
+          fence_owned = false;
+        }
+        sl_surface_fence_defer_attach(host, fence_fd, fence_owned,
+                                      buffer_proxy, x, y);
+        defer_attach = true;
+      }
     }
   }
 
-  if (host->current_buffer) {
+  if (defer_attach) {
+    // Forwarded by sl_surface_fence_complete() when the fence signals.
+  } else if (host->current_buffer) {
     assert(host->current_buffer->internal);
     wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
   } else {
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
   }
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-      while (sl_process_pending_configure_acks(window, host))
-        continue;
-
-      break;
-    }
+  window = sl_context_lookup_window_for_surface_id(
+      host->ctx, try_wl_resource_get_id(resource));
+  if (window) {
+    while (sl_process_pending_configure_acks(window, host))
+      continue;
   }
 }  // NOLINT(whitespace/indent)
 
@@ -432,11 +968,15 @@ static void sl_host_surface_damage(struct wl_client* client,
                                    int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
 
   struct sl_output_buffer* buffer;
-  int64_t x1, y1, x2, y2;
+
+  if (host->ctx->recording_file) {
+    sl_recording_damage(host->ctx, try_wl_resource_get_id(resource), x, y,
+                        width, height);
+  }
 
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->surface_damage, &buffer->surface_damage,
@@ -447,13 +987,10 @@ static void sl_host_surface_damage(struct wl_client* client,
                                x, y, width, height);
   }
 
-  x1 = x;
-  y1 = y;
-  x2 = x1 + width;
-  y2 = y1 + height;
-
-  sl_transform_damage_coord(host->ctx, host, 1.0, 1.0, &x1, &y1, &x2, &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  // Accumulate for a single batched transform and forward at commit time.
+  pixman_region32_union_rect(&host->pending_damage_surface,
+                             &host->pending_damage_surface, x, y, width,
+                             height);
 }
 
 static void sl_host_surface_damage_buffer(struct wl_client* client,
@@ -464,10 +1001,17 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
                                           int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage_buffer", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
   struct sl_output_buffer* buffer;
 
+  // Buffer and surface coordinates agree at scale 1, which is all the
+  // replayer reproduces.
+  if (host->ctx->recording_file) {
+    sl_recording_damage(host->ctx, try_wl_resource_get_id(resource), x, y,
+                        width, height);
+  }
+
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->buffer_damage, &buffer->buffer_damage,
                                x, y, width, height);
@@ -477,53 +1021,152 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
                                x, y, width, height);
   }
 
-  // Forward wl_surface_damage() call to the host. Since the damage region is
-  // given in buffer pixel coordinates, convert to surface coordinates first.
-  // If the host supports wl_surface_damage_buffer one day, we can avoid this
-  // conversion.
-  double scale_x, scale_y;
-  wl_fixed_t offset_x, offset_y;
-  struct sl_viewport* viewport = NULL;
-  if (!wl_list_empty(&host->contents_viewport))
-    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
-
-  compute_buffer_scale_and_offset(host, viewport, &scale_x, &scale_y, &offset_x,
-                                  &offset_y);
-
-  int64_t x1 = x - wl_fixed_to_int(offset_x);
-  int64_t y1 = y - wl_fixed_to_int(offset_y);
-  int64_t x2 = x1 + width;
-  int64_t y2 = y1 + height;
-
-  sl_transform_damage_coord(host->ctx, host, scale_x, scale_y, &x1, &y1, &x2,
-                            &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  // Accumulate in buffer pixel coordinates; the conversion to surface
+  // coordinates happens in one batch at commit time, against the viewport
+  // state that commit actually applies.
+  pixman_region32_union_rect(&host->pending_damage_buffer,
+                             &host->pending_damage_buffer, x, y, width,
+                             height);
 }
 
-static void sl_frame_callback_done(void* data,
-                                   struct wl_callback* callback,
-                                   uint32_t time) {
-  TRACE_EVENT("surface", "sl_frame_callback_done");
-  struct sl_host_callback* host =
-      static_cast<sl_host_callback*>(wl_callback_get_user_data(callback));
+// Forwards the damage accumulated since the last commit to the host,
+// resolving the scale factors once per region instead of once per rect.
+static void sl_surface_flush_damage(struct sl_host_surface* host) {
+  pixman_box32_t* rects;
+  int count, i;
+
+  if (pixman_region32_not_empty(&host->pending_damage_surface)) {
+    rects = pixman_region32_rectangles(&host->pending_damage_surface, &count);
+    // The region is cleared below, so transforming its rects in place is
+    // safe.
+    sl_transform_damage_rects(host->ctx, host, 1.0, 1.0, rects, count);
+    for (i = 0; i < count; i++) {
+      wl_surface_damage(host->proxy, rects[i].x1, rects[i].y1,
+                        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    }
+    pixman_region32_clear(&host->pending_damage_surface);
+  }
 
-  wl_callback_send_done(host->resource, time);
-  wl_resource_destroy(host->resource);
+  if (pixman_region32_not_empty(&host->pending_damage_buffer)) {
+    // Convert buffer pixel coordinates to surface coordinates using the
+    // viewport state this commit applies. If the host supports
+    // wl_surface_damage_buffer one day, we can avoid this conversion.
+    double scale_x, scale_y;
+    wl_fixed_t offset_x, offset_y;
+    struct sl_viewport* viewport = NULL;
+
+    if (!wl_list_empty(&host->contents_viewport))
+      viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+
+    compute_buffer_scale_and_offset(host, viewport, &scale_x, &scale_y,
+                                    &offset_x, &offset_y);
+
+    rects = pixman_region32_rectangles(&host->pending_damage_buffer, &count);
+    for (i = 0; i < count; i++) {
+      rects[i].x1 -= wl_fixed_to_int(offset_x);
+      rects[i].y1 -= wl_fixed_to_int(offset_y);
+      rects[i].x2 -= wl_fixed_to_int(offset_x);
+      rects[i].y2 -= wl_fixed_to_int(offset_y);
+    }
+    sl_transform_damage_rects(host->ctx, host, scale_x, scale_y, rects, count);
+    for (i = 0; i < count; i++) {
+      wl_surface_damage(host->proxy, rects[i].x1, rects[i].y1,
+                        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    }
+    pixman_region32_clear(&host->pending_damage_buffer);
+  }
 }
 
-static const struct wl_callback_listener sl_frame_callback_listener = {
-    sl_frame_callback_done};
-
 static void sl_host_callback_destroy(struct wl_resource* resource) {
   TRACE_EVENT("surface", "sl_host_callback_destroy");
   struct sl_host_callback* host =
       static_cast<sl_host_callback*>(wl_resource_get_user_data(resource));
 
-  wl_callback_destroy(host->proxy);
+  wl_list_remove(&host->link);
+  if (host->proxy)
+    wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  delete host;
+  sl_host_callback_free(host);
+}
+
+// Guest frame callbacks fired per host frame confirmation before the pacer
+// holds further ones back.  Two keeps a double-buffered client rendering
+// while the surface is visible but stops it within two frames once the host
+// throttles an occluded surface.
+#define FRAME_PACER_MAX_CREDIT 2
+
+// Fires every queued guest frame callback on |host|.
+static void sl_frame_pacer_release(struct sl_host_surface* host) {
+  TRACE_EVENT("surface", "sl_frame_pacer_release", "resource_id",
+              try_wl_resource_get_id(host->resource));
+  int64_t now_us = sl_counters_now_ns() / 1000;
+
+  struct sl_host_callback* callback;
+  while (!wl_list_empty(&host->frame_callbacks)) {
+    callback = wl_container_of(host->frame_callbacks.next, callback, link);
+
+    wl_callback_send_done(callback->resource,
+                          static_cast<uint32_t>(now_us / 1000));
+    wl_resource_destroy(callback->resource);
+  }
+  host->last_guest_frame_us = now_us;
 }
 
+// Arms the pacing timer for the next predicted host frame, unless the
+// surface has already run FRAME_PACER_MAX_CREDIT frames ahead of the host;
+// in that case the queued callbacks wait for the host's own callback.
+static void sl_frame_pacer_schedule(struct sl_host_surface* host) {
+  if (wl_list_empty(&host->frame_callbacks))
+    return;
+  if (host->frame_credit_used >= FRAME_PACER_MAX_CREDIT)
+    return;
+
+  int64_t now_us = sl_counters_now_ns() / 1000;
+  int64_t base_us = MAX(host->last_guest_frame_us, host->last_host_frame_us);
+  int64_t target_us = base_us + host->frame_period_us;
+  int64_t delay_ms = target_us <= now_us ? 1 : (target_us - now_us + 999) / 1000;
+
+  wl_event_source_timer_update(host->frame_timer, delay_ms);
+}
+
+static int sl_frame_pacer_timer_fire(void* data) {
+  struct sl_host_surface* host = static_cast<sl_host_surface*>(data);
+
+  host->frame_credit_used++;
+  sl_frame_pacer_release(host);
+  return 1;
+}
+
+static void sl_frame_tracking_done(void* data,
+                                   struct wl_callback* callback,
+                                   uint32_t time) {
+  TRACE_EVENT("surface", "sl_frame_tracking_done");
+  struct sl_host_surface* host = static_cast<sl_host_surface*>(data);
+  int64_t now_us = sl_counters_now_ns() / 1000;
+
+  if (host->last_host_frame_us) {
+    int64_t sample_us = now_us - host->last_host_frame_us;
+
+    // Ignore gaps where the host wasn't showing frames at all; they say
+    // nothing about its refresh rate.
+    if (sample_us >= 1000 && sample_us <= 100000)
+      host->frame_period_us = (host->frame_period_us * 3 + sample_us) / 4;
+  }
+  host->last_host_frame_us = now_us;
+
+  wl_callback_destroy(callback);
+  host->frame_tracking_proxy = NULL;
+
+  // The host confirmed a frame: restore the pacer's credit and release
+  // anything the throttle held back in one catch-up burst.
+  host->frame_credit_used = 0;
+  if (!wl_list_empty(&host->frame_callbacks))
+    sl_frame_pacer_release(host);
+}
+
+static const struct wl_callback_listener sl_frame_tracking_listener = {
+    sl_frame_tracking_done};
+
 static void sl_host_surface_frame(struct wl_client* client,
                                   struct wl_resource* resource,
                                   uint32_t callback) {
@@ -531,24 +1174,38 @@ static void sl_host_surface_frame(struct wl_client* client,
               try_wl_resource_get_id(resource));
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
-  struct sl_host_callback* host_callback = new sl_host_callback();
+  struct sl_host_callback* host_callback = sl_host_callback_alloc(host->ctx);
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
                                  sl_host_callback_destroy);
-  host_callback->proxy = wl_surface_frame(host->proxy);
-  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
-                           host_callback);
+  // The pacer fires the callback locally; there is no per-callback host
+  // proxy, only the surface-wide tracking callback below.
+  host_callback->proxy = NULL;
+  wl_list_insert(host->frame_callbacks.prev, &host_callback->link);
+
+  if (!host->frame_tracking_proxy) {
+    host->frame_tracking_proxy = wl_surface_frame(host->proxy);
+    wl_callback_add_listener(host->frame_tracking_proxy,
+                             &sl_frame_tracking_listener, host);
+  }
+  if (!host->frame_timer) {
+    host->frame_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->ctx->host_display),
+        sl_frame_pacer_timer_fire, host);
+  }
+  sl_frame_pacer_schedule(host);
 }
 
+// Clips |rect| (in buffer pixel coordinates) against the surface contents
+// and appends one copy task per plane to |tasks|.  The tasks are executed in
+// bulk by the caller, so damage rects from a single commit can be spread
+// across the copy worker pool.
 static void copy_damaged_rect(sl_host_surface* host,
                               pixman_box32_t* rect,
                               bool shaped,
-                              double scale_x,
-                              double scale_y,
-                              double offset_x,
-                              double offset_y) {
+                              std::vector<struct sl_copy_task>* tasks) {
   uint8_t* src_addr = static_cast<uint8_t*>(host->contents_shm_mmap->addr);
   uint8_t* dst_addr = static_cast<uint8_t*>(host->current_buffer->mmap->addr);
   size_t* src_offset = host->contents_shm_mmap->offset;
@@ -575,11 +1232,10 @@ static void copy_damaged_rect(sl_host_surface* host,
         pixman_image_get_stride(host->current_buffer->shape_image);
   }
 
-  // Enclosing rect after applying scale and offset.
-  x1 = rect->x1 * scale_x + offset_x;
-  y1 = rect->y1 * scale_y + offset_y;
-  x2 = rect->x2 * scale_x + offset_x + 0.5;
-  y2 = rect->y2 * scale_y + offset_y + 0.5;
+  x1 = rect->x1;
+  y1 = rect->y1;
+  x2 = rect->x2;
+  y2 = rect->y2;
 
   x1 = MAX(0, x1);
   y1 = MAX(0, y1);
@@ -589,6 +1245,14 @@ static void copy_damaged_rect(sl_host_surface* host,
   if (x1 < x2 && y1 < y2) {
     size_t i;
 
+    // Full-frame damage is written with non-temporal stores.  A 4K frame is
+    // far larger than the LLC and its staging copy is never read back by the
+    // CPU, so letting it pass through the cache only evicts useful lines.
+    bool non_temporal =
+        x1 == 0 && y1 == 0 &&
+        x2 == static_cast<int32_t>(host->contents_width) &&
+        y2 == static_cast<int32_t>(host->contents_height);
+
     for (i = 0; i < num_planes; ++i) {
       uint8_t* src_base = src_addr + src_offset[i];
       uint8_t* dst_base = dst_addr + dst_offset[i];
@@ -598,13 +1262,205 @@ static void copy_damaged_rect(sl_host_surface* host,
       int32_t height = (y2 - y1) / y_ss[i];
       size_t bytes = width * bpp;
 
-      while (height--) {
-        memcpy(dst, src, bytes);
-        dst += dst_stride[i];
-        src += src_stride[i];
+      tasks->push_back({dst, src, bytes, dst_stride[i], src_stride[i], height,
+                        non_temporal});
+      host->ctx->counters->surface.damage_bytes += bytes * height;
+    }
+    host->ctx->counters->surface.damage_rects++;
+  }
+}
+
+// Clips |rect| (in buffer pixel coordinates) against the surface contents
+// and appends a zero-fill task for the output buffer.  Used by the fused
+// shape path for damage that falls outside the window shape, which must be
+// transparent.
+static void clear_damaged_rect(sl_host_surface* host,
+                               pixman_box32_t* rect,
+                               std::vector<struct sl_copy_task>* tasks) {
+  struct sl_mmap* dst_mmap = host->current_buffer->mmap;
+  int32_t x1, y1, x2, y2;
+
+  x1 = MAX(0, rect->x1);
+  y1 = MAX(0, rect->y1);
+  x2 = MIN(static_cast<int32_t>(host->contents_width), rect->x2);
+  y2 = MIN(static_cast<int32_t>(host->contents_height), rect->y2);
+
+  if (x1 < x2 && y1 < y2) {
+    uint8_t* dst = static_cast<uint8_t*>(dst_mmap->addr) + dst_mmap->offset[0] +
+                   y1 * dst_mmap->stride[0] + x1 * dst_mmap->bpp;
+
+    tasks->push_back({dst, NULL, (x2 - x1) * dst_mmap->bpp, dst_mmap->stride[0],
+                      0, y2 - y1, false});
+  }
+}
+
+/*
+ * Copy/convert/shape work for one commit, staged on the render thread so the
+ * event loop keeps servicing input and X11 events while the multi-millisecond
+ * pixel copies run.  The job snapshots everything the copy needs -- the task
+ * list, an extra reference on the client buffer mapping and copies of the
+ * shape/damage regions -- so it has no dependency on surface state that the
+ * event loop might mutate.  The surface itself is still guarded: every entry
+ * point that touches buffer state waits for the in-flight job first.
+ */
+struct sl_render_job {
+  struct sl_host_surface* host;
+  struct sl_mmap* contents_mmap;
+  std::vector<struct sl_copy_task> tasks;
+  // Non-fused shaped commits restamp shape_image before the copies run.
+  bool generate_shape;
+  pixman_image_t* shape_image;
+  uint32_t shm_format;
+  pixman_region32_t shape;
+  pixman_region32_t shape_damage;
+  // Time the copy/shape work took on the render thread; folded into the
+  // surface's adaptive staging cost when the job completes.
+  int64_t exec_ns;
+  bool done;
+};
+
+static std::mutex render_mutex;
+static std::condition_variable render_cond;
+static std::deque<struct sl_render_job*> render_pending;
+static std::deque<struct sl_render_job*> render_completed;
+static int render_eventfd = -1;
+
+static void sl_host_surface_commit_finish(struct sl_host_surface* host);
+
+static void sl_render_thread_run() {
+  for (;;) {
+    struct sl_render_job* job;
+
+    {
+      std::unique_lock<std::mutex> lock(render_mutex);
+      render_cond.wait(lock, [] { return !render_pending.empty(); });
+      job = render_pending.front();
+      render_pending.pop_front();
+    }
+
+    {
+      TRACE_EVENT("surface", "sl_render_thread_run: job");
+      int64_t start_ns = sl_counters_now_ns();
+      if (job->generate_shape) {
+        sl_xshape_generate_argb_image(job->host->ctx, &job->shape,
+                                      &job->shape_damage, job->contents_mmap,
+                                      job->shape_image, job->shm_format);
       }
+      sl_copy_rows_parallel(job->tasks.data(), job->tasks.size());
+      job->exec_ns = sl_counters_now_ns() - start_ns;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(render_mutex);
+      job->done = true;
+      render_completed.push_back(job);
     }
+    render_cond.notify_all();
+
+    uint64_t value = 1;
+    ssize_t bytes = write(render_eventfd, &value, sizeof(value));
+    assert(bytes == sizeof(value));
+    UNUSED(bytes);
+  }
+}
+
+static void sl_render_job_destroy(struct sl_render_job* job) {
+  pixman_region32_fini(&job->shape);
+  pixman_region32_fini(&job->shape_damage);
+  sl_mmap_unref(job->contents_mmap);
+  delete job;
+}
+
+static int sl_handle_render_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("surface", "sl_handle_render_event");
+  uint64_t count;
+  ssize_t bytes = read(fd, &count, sizeof(count));
+  assert(bytes == sizeof(count));
+  UNUSED(bytes);
+
+  for (;;) {
+    struct sl_render_job* job;
+
+    {
+      std::unique_lock<std::mutex> lock(render_mutex);
+      if (render_completed.empty())
+        break;
+      job = render_completed.front();
+      render_completed.pop_front();
+    }
+
+    struct sl_host_surface* host = job->host;
+    host->render_job = NULL;
+    host->staging_frame_ns += job->exec_ns;
+    sl_render_job_destroy(job);
+    sl_host_surface_commit_finish(host);
   }
+
+  return 1;
+}
+
+// Waits for |host|'s in-flight render job, if any, and runs the deferred
+// part of its commit.  Called before anything that mutates the surface's
+// buffer state, so a staged commit always completes against the state it
+// was staged with.
+static void sl_render_sync(struct sl_host_surface* host) {
+  struct sl_render_job* job = host->render_job;
+  if (!job)
+    return;
+
+  TRACE_EVENT("surface", "sl_render_sync");
+  {
+    std::unique_lock<std::mutex> lock(render_mutex);
+    render_cond.wait(lock, [job] { return job->done; });
+    // Claim the job here so the eventfd handler won't dispatch it again;
+    // the stray eventfd count is harmless.
+    for (auto it = render_completed.begin(); it != render_completed.end();
+         ++it) {
+      if (*it == job) {
+        render_completed.erase(it);
+        break;
+      }
+    }
+  }
+
+  host->render_job = NULL;
+  host->staging_frame_ns += job->exec_ns;
+  sl_render_job_destroy(job);
+  sl_host_surface_commit_finish(host);
+}
+
+void sl_host_surface_render_sync(struct sl_host_surface* host) {
+  sl_render_sync(host);
+}
+
+// Starts the render thread and registers its completion eventfd with the
+// event loop on first use.  Like the channel and its allocator thread, both
+// live for the lifetime of the process.
+static void sl_render_thread_ensure(struct sl_context* ctx) {
+  if (render_eventfd >= 0)
+    return;
+
+  render_eventfd = eventfd(0, EFD_CLOEXEC);
+  errno_assert(render_eventfd >= 0);
+
+  std::thread(sl_render_thread_run).detach();
+
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  ctx->render_event_source.reset(wl_event_loop_add_fd(
+      event_loop, render_eventfd, WL_EVENT_READABLE, sl_handle_render_event,
+      ctx));
+}
+
+// Forwards the commit to the host, unless the last attach is still staged
+// behind its acquire fence; then the commit is held and forwarded with the
+// attach when the fence signals.
+static void sl_surface_commit_to_host(struct sl_host_surface* host) {
+  if (host->fence_event_source) {
+    host->fence_commit_pending = true;
+    return;
+  }
+  wl_surface_commit(host->proxy);
 }
 
 static void sl_host_surface_commit(struct wl_client* client,
@@ -618,6 +1474,47 @@ static void sl_host_surface_commit(struct wl_client* client,
   if (host->ctx->timing != NULL) {
     host->ctx->timing->UpdateLastCommit(resource_id);
   }
+  if (host->ctx->recording_file) {
+    sl_recording_commit(host->ctx, resource_id);
+  }
+  host->ctx->counters->surface.commits++;
+  host->last_commit_ns = sl_counters_now_ns();
+
+  sl_surface_flush_damage(host);
+
+  // Finish any commit still staged on the render thread before touching the
+  // surface's buffer state.
+  sl_render_sync(host);
+
+  // A synchronized subsurface's state only becomes visible when its parent
+  // commits, so its staged copy can stay on the render thread until then.
+  if (host->sub_parent && host->sub_sync)
+    host->sub_commit_pending = true;
+
+  // Collect a synchronized subsurface tree: drain the children's staged
+  // jobs so their host commits have gone out before this one, and the host
+  // applies the whole tree as one atomic frame behind a single flush.  The
+  // child copies overlapped with dispatching the sibling commits.
+  struct sl_host_surface* child;
+  wl_list_for_each(child, &host->sub_surfaces, sub_link) {
+    if (child->sub_sync && child->sub_commit_pending) {
+      sl_render_sync(child);
+      child->sub_commit_pending = false;
+      host->sub_flush_pending = true;
+    }
+  }
+
+  // Frames for a hidden window can't be seen: skip the staging copy and
+  // the host commit.  Every pooled output buffer keeps accumulating the
+  // client's damage, so the re-expose commit performs one consolidated
+  // copy.  The client buffer is held as that copy's source; a newer attach
+  // releases it.
+  if (host->hidden && host->contents_shm_mmap && host->current_buffer) {
+    host->hidden_commit_pending = true;
+    host->ctx->counters->surface.commits_suppressed++;
+    return;
+  }
+
   struct sl_viewport* viewport = NULL;
 
   if (!wl_list_empty(&host->contents_viewport))
@@ -655,14 +1552,9 @@ static void sl_host_surface_commit(struct wl_client* client,
         // clues within error logs that may result from hitting this point.
         assert(mmap_ensured);
       }
-    } else {
-      // In this case, perform the image manipulation if we are dealing
-      // with a shaped surface.
-      if (host->contents_shaped)
-        sl_xshape_generate_argb_image(
-            host->ctx, &host->contents_shape, host->contents_shm_mmap,
-            host->current_buffer->shape_image, host->contents_shm_format);
     }
+    // The shape stamp out itself happens below, once the commit's damage
+    // region is known, so that it can be done incrementally.
   }
 
   if (host->contents_shm_mmap) {
@@ -672,48 +1564,172 @@ static void sl_host_surface_commit(struct wl_client* client,
                                     &contents_scale_y, &contents_offset_x,
                                     &contents_offset_y);
 
+    // The frame's staging cost starts with the dma-buf write acquisition
+    // (a no-op for shm buffers); the copy and the release sync are added
+    // as they happen.
+    int64_t sync_start_ns = sl_counters_now_ns();
     if (host->current_buffer->mmap->begin_write)
       host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd,
                                               host->ctx);
-
-    // Copy damaged regions (surface-relative coordinates).
+    host->staging_frame_ns = sl_counters_now_ns() - sync_start_ns;
+
+    // Stage the copy/convert/shape work into a job that can run on the
+    // render thread while the event loop keeps servicing input.
+    struct sl_render_job* job = new sl_render_job();
+    job->host = host;
+    job->contents_mmap = sl_mmap_ref(host->contents_shm_mmap);
+    job->generate_shape = false;
+    job->shape_image = NULL;
+    job->shm_format = host->contents_shm_format;
+    job->exec_ns = 0;
+    job->done = false;
+    pixman_region32_init(&job->shape);
+    pixman_region32_init(&job->shape_damage);
+
+    std::vector<struct sl_copy_task>& copy_tasks = job->tasks;
+
+    // Transform surface damage into buffer pixel coordinates and union it
+    // with buffer damage, so apps that emit both in the same frame (GTK
+    // does) never copy the same pixel twice.  The union also merges abutting
+    // rects, bounding the number of copy calls for clients that submit many
+    // tiny damage rects.
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    pixman_region32_copy(&damage, &host->current_buffer->buffer_damage);
+
+    double contents_offset_x_d = wl_fixed_to_double(contents_offset_x);
+    double contents_offset_y_d = wl_fixed_to_double(contents_offset_y);
     int n;
     pixman_box32_t* rect =
         pixman_region32_rectangles(&host->current_buffer->surface_damage, &n);
     while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (surface damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, contents_scale_x,
-                        contents_scale_y, wl_fixed_to_double(contents_offset_x),
-                        wl_fixed_to_double(contents_offset_y));
+      // Enclosing rect after applying scale and offset.
+      int32_t x1 = rect->x1 * contents_scale_x + contents_offset_x_d;
+      int32_t y1 = rect->y1 * contents_scale_y + contents_offset_y_d;
+      int32_t x2 = rect->x2 * contents_scale_x + contents_offset_x_d + 0.5;
+      int32_t y2 = rect->y2 * contents_scale_y + contents_offset_y_d + 0.5;
+
+      pixman_region32_union_rect(&damage, &damage, x1, y1, x2 - x1, y2 - y1);
       ++rect;
     }
 
-    // Copy damaged regions (buffer-relative coordinates).
-    //
-    // In theory, if we've accumulated both surface damage and buffer damage,
-    // it might be more efficient to first transform and union the regions, so
-    // that we won't ever copy the same pixel twice.
-    // In practice, wl_surface::damage_buffer obsoletes wl_surface::damage, and
-    // it doesn't seem worthwhile to optimize for the edge case in which an app
-    // uses both in the same frame.
-    rect = pixman_region32_rectangles(&host->current_buffer->buffer_damage, &n);
-    while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (buffer damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, 1.0, 1.0, 0.0, 0.0);
-      ++rect;
+    // If the window shape changed since this buffer's shape_image was last
+    // stamped out, pixels outside the client's damage may have flipped
+    // between opaque and transparent, so the whole buffer is effectively
+    // damaged.  Steady-state commits (cursor blink in a shaped overlay)
+    // keep their small damage region and only restamp those rects.
+    if (host->contents_shaped &&
+        host->current_buffer->shape_generation !=
+            host->contents_shape_generation) {
+      pixman_region32_union_rect(&damage, &damage, 0, 0, host->contents_width,
+                                 host->contents_height);
+      host->current_buffer->shape_generation = host->contents_shape_generation;
     }
 
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd,
-                                            host->ctx);
+    // A pathological region can still contain hundreds of disjoint rects
+    // after the union.  Past this point per-rect overhead exceeds the cost
+    // of copying the undamaged gaps, so fall back to the enclosing rect.
+    rect = pixman_region32_rectangles(&damage, &n);
+    if (n > MAX_DAMAGE_RECTS) {
+      pixman_box32_t extents = *pixman_region32_extents(&damage);
+      pixman_region32_fini(&damage);
+      pixman_region32_init_rect(&damage, extents.x1, extents.y1,
+                                extents.x2 - extents.x1,
+                                extents.y2 - extents.y1);
+    }
+
+    // ARGB sources need no pixel format conversion, so the shape region can
+    // be applied as a mask while copying straight from the client buffer:
+    // damage inside the shape is copied, damage outside it is cleared to
+    // transparent.  This skips the intermediate shape_image entirely, which
+    // halves the memory traffic of a shaped commit.  Other formats still go
+    // through the pixman stamp out for conversion, restamping only the
+    // damaged part of shape_image.
+    bool fused_shape = host->contents_shaped &&
+                       host->contents_shm_format == WL_SHM_FORMAT_ARGB8888;
+
+    if (host->contents_shaped && !fused_shape) {
+      // Restamped on the render thread, before the job's copies run.
+      job->generate_shape = true;
+      job->shape_image = host->current_buffer->shape_image;
+      pixman_region32_copy(&job->shape, &host->contents_shape);
+      pixman_region32_copy(&job->shape_damage, &damage);
+    }
+
+    if (fused_shape) {
+      pixman_region32_t masked;
+      pixman_region32_init(&masked);
+
+      pixman_region32_subtract(&masked, &damage, &host->contents_shape);
+      rect = pixman_region32_rectangles(&masked, &n);
+      while (n--) {
+        clear_damaged_rect(host, rect, &copy_tasks);
+        ++rect;
+      }
+
+      pixman_region32_intersect(&masked, &damage, &host->contents_shape);
+      rect = pixman_region32_rectangles(&masked, &n);
+      while (n--) {
+        copy_damaged_rect(host, rect, /*shaped=*/false, &copy_tasks);
+        ++rect;
+      }
+      pixman_region32_fini(&masked);
+    } else {
+      rect = pixman_region32_rectangles(&damage, &n);
+      while (n--) {
+        copy_damaged_rect(host, rect, host->contents_shaped, &copy_tasks);
+        ++rect;
+      }
+    }
+    pixman_region32_fini(&damage);
 
+    // The damage has been consumed into the job's task list, so the buffer
+    // bookkeeping happens now; new damage arriving while the job runs is
+    // correctly attributed to the next frame.
     pixman_region32_clear(&host->current_buffer->surface_damage);
     pixman_region32_clear(&host->current_buffer->buffer_damage);
 
     wl_list_remove(&host->current_buffer->link);
     wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+
+    if (!copy_tasks.empty() || job->generate_shape) {
+      sl_render_thread_ensure(host->ctx);
+      host->render_job = job;
+      {
+        std::unique_lock<std::mutex> lock(render_mutex);
+        render_pending.push_back(job);
+      }
+      render_cond.notify_all();
+      // The rest of the commit -- end_write, the host wl_surface_commit and
+      // the client-side buffer release -- runs from the completion handler.
+      return;
+    }
+
+    sl_render_job_destroy(job);
+  }
+
+  sl_host_surface_commit_finish(host);
+}
+
+// The part of a commit that must wait for the staged pixel work: it ends the
+// dma-buf write access, updates viewport/scale state, commits the host
+// surface and releases the client buffer.  Runs inline for commits with no
+// copy work, and from the render completion path otherwise.
+static void sl_host_surface_commit_finish(struct sl_host_surface* host) {
+  auto resource_id = try_wl_resource_get_id(host->resource);
+  struct sl_viewport* viewport = NULL;
+
+  if (!wl_list_empty(&host->contents_viewport))
+    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+
+  if (host->contents_shm_mmap && host->current_buffer) {
+    int64_t sync_start_ns = sl_counters_now_ns();
+    if (host->current_buffer->mmap->end_write)
+      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd,
+                                            host->ctx);
+    host->staging_frame_ns += sl_counters_now_ns() - sync_start_ns;
+    sl_surface_staging_update(host, host->staging_frame_ns);
+    host->staging_frame_ns = 0;
   }
 
   if (host->contents_width && host->contents_height) {
@@ -765,7 +1781,7 @@ static void sl_host_surface_commit(struct wl_client* client,
   if (host->has_role) {
     TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
                 "resource_id", resource_id, "has_role", host->has_role);
-    wl_surface_commit(host->proxy);
+    sl_surface_commit_to_host(host);
 
     // GTK determines the scale based on the output the surface has entered.
     // If the surface has not entered any output, then have it enter the
@@ -787,16 +1803,12 @@ static void sl_host_surface_commit(struct wl_client* client,
                 "resource_id", resource_id, "has_role", host->has_role);
     // Commit if surface is associated with a window. Otherwise, defer
     // commit until window is created.
-    struct sl_window* window;
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
-      }
+    struct sl_window* window =
+        sl_context_lookup_window_for_surface_id(host->ctx, resource_id);
+    if (window && window->xdg_surface) {
+      sl_surface_commit_to_host(host);
+      if (host->contents_width && host->contents_height)
+        window->realized = 1;
     }
   }
 
@@ -808,6 +1820,27 @@ static void sl_host_surface_commit(struct wl_client* client,
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
+
+  // End of a batched subsurface-tree commit: the child commits and this one
+  // went out in order above, push them to the host in one flush.
+  if (host->sub_flush_pending) {
+    host->sub_flush_pending = false;
+    wl_display_flush(host->ctx->display);
+  }
+}
+
+void sl_host_surface_set_hidden(struct sl_host_surface* host, bool hidden) {
+  if (host->hidden == hidden)
+    return;
+
+  host->hidden = hidden;
+  if (!hidden && host->hidden_commit_pending) {
+    host->hidden_commit_pending = false;
+    // Consolidated copy-and-commit of everything skipped while hidden,
+    // sourced from the held client buffer and the damage accumulated on
+    // the output buffer it was attached with.
+    sl_host_surface_commit(NULL, host->resource);
+  }
 }
 
 static void sl_host_surface_set_buffer_scale(struct wl_client* client,
@@ -836,15 +1869,14 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
               try_wl_resource_get_id(resource));
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
-  struct sl_window *window, *surface_window = NULL;
+  struct sl_window* surface_window;
   struct sl_output_buffer* buffer;
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
+  // A staged commit still references the surface and its buffers.
+  sl_render_sync(host);
+
+  surface_window = sl_context_lookup_window_for_surface_id(
+      host->ctx, try_wl_resource_get_id(resource));
 
   if (surface_window) {
     surface_window->host_surface_id = 0;
@@ -854,9 +1886,11 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   if (host->contents_shm_mmap)
     sl_mmap_unref(host->contents_shm_mmap);
 
+  // Idle buffers survive the surface in the context-wide pool; busy ones
+  // are still attached host-side and must go.
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_pool_insert(host->ctx, buffer);
   }
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
@@ -865,6 +1899,22 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   while (!wl_list_empty(&host->contents_viewport))
     wl_list_remove(host->contents_viewport.next);
 
+  // Queued frame callbacks will never fire once the surface is gone.
+  struct sl_host_callback* callback;
+  while (!wl_list_empty(&host->frame_callbacks)) {
+    callback = wl_container_of(host->frame_callbacks.next, callback, link);
+    wl_resource_destroy(callback->resource);
+  }
+  if (host->frame_tracking_proxy)
+    wl_callback_destroy(host->frame_tracking_proxy);
+  if (host->frame_timer)
+    wl_event_source_remove(host->frame_timer);
+  if (host->fence_event_source) {
+    wl_event_source_remove(host->fence_event_source);
+    if (host->fence_fd >= 0)
+      close(host->fence_fd);
+  }
+
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
   wl_surface_destroy(host->proxy);
@@ -874,7 +1924,21 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
     host->surface_sync = NULL;
   }
 
+  // Drop subsurface-tree links in both directions; the wl_subsurface
+  // resources outliving this surface are inert.
+  struct sl_host_surface* child;
+  while (!wl_list_empty(&host->sub_surfaces)) {
+    child = wl_container_of(host->sub_surfaces.next, child, sub_link);
+    child->sub_parent = NULL;
+    wl_list_remove(&child->sub_link);
+  }
+  if (host->sub_parent)
+    wl_list_remove(&host->sub_link);
+
   pixman_region32_fini(&host->contents_shape);
+  pixman_region32_fini(&host->pending_damage_surface);
+  pixman_region32_fini(&host->pending_damage_buffer);
+  wl_list_remove(&host->reclaim_link);
   delete host;
 }
 
@@ -1007,12 +2071,54 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->scale_round_on_y = false;
   host_surface->last_event_serial = 0;
   host_surface->current_buffer = NULL;
+  host_surface->render_job = NULL;
   host_surface->proxy_buffer = NULL;
   host_surface->contents_shaped = false;
   host_surface->output = NULL;
   pixman_region32_init(&host_surface->contents_shape);
+  pixman_region32_init(&host_surface->pending_damage_surface);
+  pixman_region32_init(&host_surface->pending_damage_buffer);
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  wl_list_init(&host_surface->sub_surfaces);
+  host_surface->sub_parent = NULL;
+  host_surface->sub_sync = false;
+  host_surface->sub_commit_pending = false;
+  host_surface->sub_flush_pending = false;
+  host_surface->hidden = false;
+  host_surface->hidden_commit_pending = false;
+  // Seeded properly on the first attach, when the contents size is known.
+  host_surface->staging_dmabuf = false;
+  host_surface->staging_width = 0;
+  host_surface->staging_height = 0;
+  host_surface->staging_cost_ns[0] = 0;
+  host_surface->staging_cost_ns[1] = 0;
+  host_surface->staging_commits = 0;
+  host_surface->staging_frame_ns = 0;
+  struct sl_context* ctx = host_surface->ctx;
+  host_surface->last_commit_ns = sl_counters_now_ns();
+  wl_list_insert(&ctx->reclaim_surfaces, &host_surface->reclaim_link);
+  if (ctx->idle_reclaim_delay > 0 && !ctx->reclaim_timer_event_source) {
+    ctx->reclaim_timer_event_source.reset(
+        wl_event_loop_add_timer(wl_display_get_event_loop(ctx->host_display),
+                                sl_handle_reclaim_timer, ctx));
+    wl_event_source_timer_update(ctx->reclaim_timer_event_source.get(),
+                                 ctx->idle_reclaim_delay * 1000);
+  }
+  wl_list_init(&host_surface->frame_callbacks);
+  host_surface->fence_event_source = NULL;
+  host_surface->fence_fd = -1;
+  host_surface->fence_attach_buffer = NULL;
+  host_surface->fence_attach_x = 0;
+  host_surface->fence_attach_y = 0;
+  host_surface->fence_commit_pending = false;
+  host_surface->frame_tracking_proxy = NULL;
+  host_surface->frame_timer = NULL;
+  // 60Hz until the host's frame callbacks teach us otherwise.
+  host_surface->frame_period_us = 16667;
+  host_surface->last_host_frame_us = 0;
+  host_surface->last_guest_frame_us = 0;
+  host_surface->frame_credit_used = 0;
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
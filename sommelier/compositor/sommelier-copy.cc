@@ -0,0 +1,354 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+
+#include <string.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_DISPATCH 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Row copy kernel.  |bytes| is the row length, |non_temporal| requests
+// streaming stores where available.
+typedef void (*sl_copy_row_func_t)(uint8_t* dst,
+                                   const uint8_t* src,
+                                   size_t bytes,
+                                   bool non_temporal);
+
+static void sl_copy_row_memcpy(uint8_t* dst,
+                               const uint8_t* src,
+                               size_t bytes,
+                               bool non_temporal) {
+  memcpy(dst, src, bytes);
+}
+
+#ifdef HAVE_X86_DISPATCH
+
+__attribute__((target("sse2"))) static void sl_copy_row_sse2(
+    uint8_t* dst, const uint8_t* src, size_t bytes, bool non_temporal) {
+  // Scalar head until the destination is 16-byte aligned.  Streaming stores
+  // require alignment; aligned regular stores are also faster.
+  while (bytes && ((uintptr_t)dst & 15)) {
+    *dst++ = *src++;
+    bytes--;
+  }
+
+  if (non_temporal) {
+    while (bytes >= 64) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)(src + 0));
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+      __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+      __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+      _mm_stream_si128((__m128i*)(dst + 0), v0);
+      _mm_stream_si128((__m128i*)(dst + 16), v1);
+      _mm_stream_si128((__m128i*)(dst + 32), v2);
+      _mm_stream_si128((__m128i*)(dst + 48), v3);
+      src += 64;
+      dst += 64;
+      bytes -= 64;
+    }
+  } else {
+    while (bytes >= 64) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)(src + 0));
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+      __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+      __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+      _mm_store_si128((__m128i*)(dst + 0), v0);
+      _mm_store_si128((__m128i*)(dst + 16), v1);
+      _mm_store_si128((__m128i*)(dst + 32), v2);
+      _mm_store_si128((__m128i*)(dst + 48), v3);
+      src += 64;
+      dst += 64;
+      bytes -= 64;
+    }
+  }
+
+  if (bytes)
+    memcpy(dst, src, bytes);
+}
+
+__attribute__((target("avx2"))) static void sl_copy_row_avx2(
+    uint8_t* dst, const uint8_t* src, size_t bytes, bool non_temporal) {
+  while (bytes && ((uintptr_t)dst & 31)) {
+    *dst++ = *src++;
+    bytes--;
+  }
+
+  if (non_temporal) {
+    while (bytes >= 128) {
+      __m256i v0 = _mm256_loadu_si256((const __m256i*)(src + 0));
+      __m256i v1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+      __m256i v2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+      __m256i v3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+      _mm256_stream_si256((__m256i*)(dst + 0), v0);
+      _mm256_stream_si256((__m256i*)(dst + 32), v1);
+      _mm256_stream_si256((__m256i*)(dst + 64), v2);
+      _mm256_stream_si256((__m256i*)(dst + 96), v3);
+      src += 128;
+      dst += 128;
+      bytes -= 128;
+    }
+    while (bytes >= 32) {
+      _mm256_stream_si256((__m256i*)dst,
+                          _mm256_loadu_si256((const __m256i*)src));
+      src += 32;
+      dst += 32;
+      bytes -= 32;
+    }
+  } else {
+    while (bytes >= 128) {
+      __m256i v0 = _mm256_loadu_si256((const __m256i*)(src + 0));
+      __m256i v1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+      __m256i v2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+      __m256i v3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+      _mm256_store_si256((__m256i*)(dst + 0), v0);
+      _mm256_store_si256((__m256i*)(dst + 32), v1);
+      _mm256_store_si256((__m256i*)(dst + 64), v2);
+      _mm256_store_si256((__m256i*)(dst + 96), v3);
+      src += 128;
+      dst += 128;
+      bytes -= 128;
+    }
+    while (bytes >= 32) {
+      _mm256_store_si256((__m256i*)dst,
+                         _mm256_loadu_si256((const __m256i*)src));
+      src += 32;
+      dst += 32;
+      bytes -= 32;
+    }
+  }
+
+  if (bytes)
+    memcpy(dst, src, bytes);
+}
+
+static sl_copy_row_func_t sl_copy_row_resolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return sl_copy_row_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return sl_copy_row_sse2;
+  return sl_copy_row_memcpy;
+}
+
+#elif defined(__ARM_NEON)
+
+static void sl_copy_row_neon(uint8_t* dst,
+                             const uint8_t* src,
+                             size_t bytes,
+                             bool non_temporal) {
+  // NEON has no non-temporal stores; ignore the hint.
+  while (bytes >= 64) {
+    uint8x16_t v0 = vld1q_u8(src + 0);
+    uint8x16_t v1 = vld1q_u8(src + 16);
+    uint8x16_t v2 = vld1q_u8(src + 32);
+    uint8x16_t v3 = vld1q_u8(src + 48);
+    vst1q_u8(dst + 0, v0);
+    vst1q_u8(dst + 16, v1);
+    vst1q_u8(dst + 32, v2);
+    vst1q_u8(dst + 48, v3);
+    src += 64;
+    dst += 64;
+    bytes -= 64;
+  }
+
+  if (bytes)
+    memcpy(dst, src, bytes);
+}
+
+static sl_copy_row_func_t sl_copy_row_resolve(void) {
+  return sl_copy_row_neon;
+}
+
+#else
+
+static sl_copy_row_func_t sl_copy_row_resolve(void) {
+  return sl_copy_row_memcpy;
+}
+
+#endif
+
+void sl_copy_rows(uint8_t* dst,
+                  const uint8_t* src,
+                  size_t bytes,
+                  size_t dst_stride,
+                  size_t src_stride,
+                  int32_t height,
+                  bool non_temporal) {
+  // Resolved once; Sommelier performs all copies from the one event loop
+  // thread, but a racing second resolve would be harmless anyway.
+  static sl_copy_row_func_t copy_row = sl_copy_row_resolve();
+
+  // A NULL source zero-fills the rows (transparent pixels).  The fused
+  // shape path uses this to clear damage that falls outside the window
+  // shape.
+  if (!src) {
+    if (dst_stride == bytes) {
+      bytes *= height;
+      height = 1;
+    }
+    while (height-- > 0) {
+      memset(dst, 0, bytes);
+      dst += dst_stride;
+    }
+    return;
+  }
+
+  // When both sides are tightly packed the rows form one contiguous block
+  // and a single call avoids per-row fixed costs.
+  if (src_stride == bytes && dst_stride == bytes) {
+    bytes *= height;
+    height = 1;
+  }
+
+  while (height-- > 0) {
+    copy_row(dst, src, bytes, non_temporal);
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+#ifdef HAVE_X86_DISPATCH
+  // Streaming stores are weakly ordered; make them visible before the
+  // host is told to read the buffer.
+  if (non_temporal)
+    _mm_sfence();
+#endif
+}
+
+// Batches smaller than this are copied inline; the latency of waking the
+// pool exceeds the copy itself.
+#define PARALLEL_COPY_THRESHOLD (256 * 1024)
+
+// Target band size when subdividing a task across workers.
+#define COPY_BAND_BYTES (1024 * 1024)
+
+// Upper bound on copy threads (including the caller).  Damage copies are
+// memory bound, more threads than this just contend for bandwidth.
+#define MAX_COPY_THREADS 8
+
+namespace {
+
+// Shared state for the copy worker pool.  The event loop thread publishes a
+// band list, workers and the caller race to claim bands by index, and the
+// caller blocks until every band has been executed.
+struct CopyPool {
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+  const struct sl_copy_task* bands = nullptr;
+  size_t num_bands = 0;
+  size_t next_band = 0;
+  size_t pending = 0;
+};
+
+CopyPool* copy_pool = nullptr;
+
+void sl_copy_execute_bands(CopyPool* pool, std::unique_lock<std::mutex>& lock) {
+  while (pool->next_band < pool->num_bands) {
+    const struct sl_copy_task* band = &pool->bands[pool->next_band++];
+
+    lock.unlock();
+    sl_copy_rows(band->dst, band->src, band->bytes, band->dst_stride,
+                 band->src_stride, band->height, band->non_temporal);
+    lock.lock();
+
+    if (--pool->pending == 0)
+      pool->done_cv.notify_one();
+  }
+}
+
+void sl_copy_worker(CopyPool* pool) {
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  while (true) {
+    pool->work_cv.wait(
+        lock, [pool] { return pool->next_band < pool->num_bands; });
+    sl_copy_execute_bands(pool, lock);
+  }
+}
+
+CopyPool* sl_copy_pool_get(void) {
+  // Created on first use and intentionally never destroyed; sommelier has no
+  // shutdown path (see sl_context::channel).
+  if (!copy_pool) {
+    copy_pool = new CopyPool();
+
+    unsigned num_threads = std::thread::hardware_concurrency();
+    if (num_threads > MAX_COPY_THREADS)
+      num_threads = MAX_COPY_THREADS;
+
+    // The calling thread participates, so spawn one fewer worker.
+    for (unsigned i = 1; i < num_threads; ++i) {
+      std::thread worker(sl_copy_worker, copy_pool);
+      worker.detach();
+    }
+  }
+
+  return copy_pool;
+}
+
+}  // namespace
+
+void sl_copy_rows_parallel(const struct sl_copy_task* tasks,
+                           size_t num_tasks) {
+  size_t total_bytes = 0;
+
+  for (size_t i = 0; i < num_tasks; ++i)
+    total_bytes += tasks[i].bytes * tasks[i].height;
+
+  if (total_bytes < PARALLEL_COPY_THRESHOLD) {
+    for (size_t i = 0; i < num_tasks; ++i) {
+      sl_copy_rows(tasks[i].dst, tasks[i].src, tasks[i].bytes,
+                   tasks[i].dst_stride, tasks[i].src_stride, tasks[i].height,
+                   tasks[i].non_temporal);
+    }
+    return;
+  }
+
+  // Split tall tasks into row bands so a single full-frame rect is spread
+  // across all workers instead of pinning one.
+  std::vector<struct sl_copy_task> bands;
+  for (size_t i = 0; i < num_tasks; ++i) {
+    struct sl_copy_task task = tasks[i];
+    int32_t band_height = task.bytes ? COPY_BAND_BYTES / task.bytes : 0;
+    if (band_height < 1)
+      band_height = 1;
+
+    while (task.height > band_height) {
+      struct sl_copy_task band = task;
+      band.height = band_height;
+      bands.push_back(band);
+
+      task.dst += band_height * task.dst_stride;
+      if (task.src)
+        task.src += band_height * task.src_stride;
+      task.height -= band_height;
+    }
+    if (task.height > 0)
+      bands.push_back(task);
+  }
+
+  CopyPool* pool = sl_copy_pool_get();
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->bands = bands.data();
+  pool->num_bands = bands.size();
+  pool->next_band = 0;
+  pool->pending = bands.size();
+  pool->work_cv.notify_all();
+
+  // Work alongside the pool, then wait for stragglers.
+  sl_copy_execute_bands(pool, lock);
+  pool->done_cv.wait(lock, [pool] { return pool->pending == 0; });
+
+  pool->bands = nullptr;
+  pool->num_bands = 0;
+}
@@ -0,0 +1,54 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
+#define VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Copies |height| rows of |bytes| bytes each from |src| to |dst|, advancing
+// the pointers by |src_stride| and |dst_stride| after each row.  The copy is
+// performed with the widest vector kernel supported by the CPU this process
+// is running on (AVX2/SSE2 on x86, NEON on ARM), falling back to memcpy
+// elsewhere.
+//
+// If |non_temporal| is true, rows are written with non-temporal (streaming)
+// stores where the instruction set provides them.  This is profitable for
+// full-frame damage, where the destination is much larger than the last
+// level cache and will not be read back by the CPU.
+//
+// A NULL |src| zero-fills the destination rows instead (|src_stride| is
+// ignored).
+void sl_copy_rows(uint8_t* dst,
+                  const uint8_t* src,
+                  size_t bytes,
+                  size_t dst_stride,
+                  size_t src_stride,
+                  int32_t height,
+                  bool non_temporal);
+
+// A single rectangular copy, expressed with the same parameters as
+// sl_copy_rows().
+struct sl_copy_task {
+  uint8_t* dst;
+  const uint8_t* src;
+  size_t bytes;
+  size_t dst_stride;
+  size_t src_stride;
+  int32_t height;
+  bool non_temporal;
+};
+
+// Executes |num_tasks| copy tasks, splitting the work in row bands across a
+// small pool of worker threads.  Large tasks are subdivided so that a
+// full-frame copy keeps every worker busy.  The function only returns once
+// all copies have completed, so callers may treat it exactly like a serial
+// loop over sl_copy_rows().  Small batches are run inline, without touching
+// the pool.
+//
+// The pool is created on first use and kept for the lifetime of the process.
+void sl_copy_rows_parallel(const struct sl_copy_task* tasks, size_t num_tasks);
+
+#endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
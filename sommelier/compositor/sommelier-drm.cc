@@ -8,8 +8,10 @@
 #include <assert.h>
 #include <gbm.h>
 #include <libdrm/drm_fourcc.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -18,14 +20,104 @@
 #include "drm-server-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
 
+// The host's advertised format list is stable for a given host compositor
+// and DRM device, but rediscovering it costs a host round trip on every
+// sommelier launch.  A small cache persisted across instances lets a fresh
+// bind advertise formats, device and capabilities immediately; the host's
+// real list is still collected per bind and the cache rewritten when it
+// differs, so a stale entry corrects itself on the next launch.
+#define DRM_FORMAT_CACHE_MAX 16
+
+static uint32_t drm_cached_formats[DRM_FORMAT_CACHE_MAX];
+static size_t drm_cached_format_count = 0;
+static bool drm_format_cache_valid = false;
+
 struct sl_host_drm {
   struct sl_context* ctx;
   uint32_t version;
   struct wl_resource* resource;
   struct zwp_linux_dmabuf_v1* linux_dmabuf_proxy;
   struct wl_callback* callback;
+  // Formats the host advertised on this bind, used to validate (and if
+  // necessary rewrite) the persisted format cache.
+  uint32_t seen_formats[DRM_FORMAT_CACHE_MAX];
+  size_t seen_format_count;
+  // Formats/device/capabilities were already sent from the cache at bind
+  // time; the host round trip only validates.
+  bool sent_from_cache;
 };
 
+static char* sl_drm_format_cache_path(void) {
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir && dir[0])
+    return sl_xasprintf("%s/sommelier-drm-formats", dir);
+
+  const char* home = getenv("HOME");
+  if (home && home[0])
+    return sl_xasprintf("%s/.cache/sommelier-drm-formats", home);
+
+  return NULL;
+}
+
+static char* sl_drm_format_cache_key(struct sl_context* ctx) {
+  return sl_xasprintf(
+      "%s %s\n",
+      ctx->host_display_name ? ctx->host_display_name : "unknown",
+      ctx->drm_device ? ctx->drm_device : "none");
+}
+
+static void sl_drm_format_cache_load(struct sl_context* ctx) {
+  char* path = sl_drm_format_cache_path();
+  if (!path)
+    return;
+
+  FILE* file = fopen(path, "r");
+  free(path);
+  if (!file)
+    return;
+
+  // The first line keys the cache to the host compositor and DRM device;
+  // an entry written against a different pairing is simply ignored.
+  char key[256];
+  char* expected_key = sl_drm_format_cache_key(ctx);
+  if (fgets(key, sizeof(key), file) && strcmp(key, expected_key) == 0) {
+    uint32_t format;
+    while (drm_cached_format_count < DRM_FORMAT_CACHE_MAX &&
+           fscanf(file, "%x", &format) == 1) {
+      drm_cached_formats[drm_cached_format_count++] = format;
+    }
+    drm_format_cache_valid = drm_cached_format_count > 0;
+  }
+  free(expected_key);
+  fclose(file);
+}
+
+static void sl_drm_format_cache_store(struct sl_context* ctx,
+                                      const uint32_t* formats,
+                                      size_t count) {
+  memcpy(drm_cached_formats, formats, count * sizeof(formats[0]));
+  drm_cached_format_count = count;
+  drm_format_cache_valid = count > 0;
+
+  char* path = sl_drm_format_cache_path();
+  if (!path)
+    return;
+
+  // Best effort: a cache that fails to persist only costs the next launch
+  // the round trip it would have paid anyway.
+  FILE* file = fopen(path, "w");
+  free(path);
+  if (!file)
+    return;
+
+  char* key = sl_drm_format_cache_key(ctx);
+  fputs(key, file);
+  free(key);
+  for (size_t i = 0; i < count; ++i)
+    fprintf(file, "%x\n", formats[i]);
+  fclose(file);
+}
+
 static void sl_drm_authenticate(struct wl_client* client,
                                 struct wl_resource* resource,
                                 uint32_t id) {
@@ -223,7 +315,10 @@ static void sl_drm_format(void* data,
     case WL_DRM_FORMAT_ABGR8888:
     case WL_DRM_FORMAT_XRGB8888:
     case WL_DRM_FORMAT_XBGR8888:
-      wl_drm_send_format(host->resource, format);
+      if (host->seen_format_count < DRM_FORMAT_CACHE_MAX)
+        host->seen_formats[host->seen_format_count++] = format;
+      if (!host->sent_from_cache)
+        wl_drm_send_format(host->resource, format);
       break;
     default:
       break;
@@ -245,10 +340,24 @@ static void sl_drm_callback_done(void* data,
   struct sl_host_drm* host =
       static_cast<sl_host_drm*>(wl_callback_get_user_data(callback));
 
-  if (host->ctx->drm_device)
-    wl_drm_send_device(host->resource, host->ctx->drm_device);
-  if (host->version >= WL_DRM_CREATE_PRIME_BUFFER_SINCE_VERSION)
-    wl_drm_send_capabilities(host->resource, WL_DRM_CAPABILITY_PRIME);
+  if (!host->sent_from_cache) {
+    if (host->ctx->drm_device)
+      wl_drm_send_device(host->resource, host->ctx->drm_device);
+    if (host->version >= WL_DRM_CREATE_PRIME_BUFFER_SINCE_VERSION)
+      wl_drm_send_capabilities(host->resource, WL_DRM_CAPABILITY_PRIME);
+  }
+
+  // The host's full format list has arrived by now; rewrite the cache if
+  // it disagrees.  Clients that already got the stale list keep it - the
+  // formats sommelier relays are a fixed conservative subset, so the worst
+  // case is a format that fails at buffer creation, same as today when a
+  // host revokes one mid-session.
+  if (host->seen_format_count != drm_cached_format_count ||
+      memcmp(host->seen_formats, drm_cached_formats,
+             host->seen_format_count * sizeof(host->seen_formats[0])) != 0) {
+    sl_drm_format_cache_store(host->ctx, host->seen_formats,
+                              host->seen_format_count);
+  }
 }
 
 static const struct wl_callback_listener sl_drm_callback_listener = {
@@ -262,11 +371,26 @@ static void sl_bind_host_drm(struct wl_client* client,
   struct sl_host_drm* host = new sl_host_drm();
   host->ctx = ctx;
   host->version = MIN(version, 2);
+  host->seen_format_count = 0;
+  host->sent_from_cache = false;
   host->resource =
       wl_resource_create(client, &wl_drm_interface, host->version, id);
   wl_resource_set_implementation(host->resource, &sl_drm_implementation, host,
                                  sl_destroy_host_drm);
 
+  // With a valid cache the client hears about formats, device and
+  // capabilities right away instead of after a host round trip; the bind
+  // and sync below still run so the cache gets validated.
+  if (drm_format_cache_valid) {
+    for (size_t i = 0; i < drm_cached_format_count; ++i)
+      wl_drm_send_format(host->resource, drm_cached_formats[i]);
+    if (ctx->drm_device)
+      wl_drm_send_device(host->resource, ctx->drm_device);
+    if (host->version >= WL_DRM_CREATE_PRIME_BUFFER_SINCE_VERSION)
+      wl_drm_send_capabilities(host->resource, WL_DRM_CAPABILITY_PRIME);
+    host->sent_from_cache = true;
+  }
+
   host->linux_dmabuf_proxy = static_cast<zwp_linux_dmabuf_v1*>(wl_registry_bind(
       wl_display_get_registry(ctx->display), ctx->linux_dmabuf->id,
       &zwp_linux_dmabuf_v1_interface, ctx->linux_dmabuf->version));
@@ -284,5 +408,7 @@ struct sl_global* sl_drm_global_create(struct sl_context* ctx) {
   if (ctx->linux_dmabuf->version < 2)
     return NULL;
 
+  sl_drm_format_cache_load(ctx);
+
   return sl_global_create(ctx, &wl_drm_interface, 2, ctx, sl_bind_host_drm);
 }
@@ -56,9 +56,17 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t y_ss0,
                                size_t y_ss1);
 
+// Bracket CPU access to a DRM PRIME mmap.  The GBM import and mapping are
+// created on the first begin_access and then kept alive across frames with
+// explicit dma-buf coherency syncs; they are evicted when the buffer is
+// released.  No-ops for other mmap types.
 bool sl_mmap_begin_access(struct sl_mmap* map);
 void sl_mmap_end_access(struct sl_mmap* map);
 
+// When enabled, shm mappings of at least 2 MB created by sl_mmap_create()
+// are advised MADV_HUGEPAGE.  Set from --hugepage-buffers.
+void sl_mmap_set_hugepages_enabled(bool enabled);
+
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
 void sl_mmap_unref(struct sl_mmap* map);
 
@@ -143,6 +143,37 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
     return;
   }
 
+  if (host->shm->ctx->enable_udmabuf) {
+    // Try exporting the client's pool pages as a dma-buf so the host can
+    // scan out from them directly, skipping the staging copy. On any
+    // failure, quietly fall through to the copy path below.
+    struct wl_buffer* proxy = sl_udmabuf_create_buffer(
+        host->shm->ctx, host->fd, offset, width, height, stride, format);
+    if (proxy) {
+      struct sl_host_buffer* host_buffer =
+          sl_create_host_buffer(host->shm->ctx, client, id, proxy, width,
+                                height, /*is_drm=*/true);
+
+      // Zero copy is only safe while the client respects the release
+      // protocol: once the host scans out of the pool pages, a commit that
+      // damages the buffer again before the host releases it would draw
+      // into the frame being presented.  Keep a mapping of the pool so the
+      // attach path can route such commits through the staging copy.
+      host_buffer->zero_copy = true;
+      host_buffer->shm_format = format;
+      host_buffer->shm_mmap = sl_mmap_create(
+          host->fd, sl_size_for_shm_format(format, height, stride),
+          sl_shm_bpp_for_shm_format(format),
+          sl_shm_num_planes_for_shm_format(format), offset, stride,
+          offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
+          stride, sl_y_subsampling_for_shm_format_plane(format, 0),
+          sl_y_subsampling_for_shm_format_plane(format, 1));
+      host_buffer->shm_mmap->fd = -1;
+      host_buffer->shm_mmap->buffer_resource = host_buffer->resource;
+      return;
+    }
+  }
+
   struct sl_host_buffer* host_buffer = sl_create_host_buffer(
       host->shm->ctx, client, id, NULL, width, height, /*is_drm=*/false);
 
@@ -0,0 +1,111 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "../sommelier.h"          // NOLINT(build/include_directory)
+#include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
+
+#define UDMABUF_DEVICE "/dev/udmabuf"
+
+// TODO(b/189505947): Pull these from <linux/udmabuf.h> once we can rely on
+// it being present in all our sysroots.
+#define UDMABUF_FLAGS_CLOEXEC 0x01
+
+struct udmabuf_create {
+  __u32 memfd;
+  __u32 flags;
+  __u64 offset;
+  __u64 size;
+};
+
+#define UDMABUF_CREATE _IOW('u', 0x42, struct udmabuf_create)
+
+// Lazily opened udmabuf device; -1 while unprobed, -2 when unavailable.
+static int udmabuf_fd = -1;
+
+bool sl_udmabuf_supported(void) {
+  if (udmabuf_fd == -1) {
+    udmabuf_fd = open(UDMABUF_DEVICE, O_RDWR | O_CLOEXEC);
+    if (udmabuf_fd < 0)
+      udmabuf_fd = -2;
+  }
+
+  return udmabuf_fd >= 0;
+}
+
+// Wraps the pages of a client shm pool in a dma-buf and creates a wl_buffer
+// for them through the host's zwp_linux_dmabuf_v1 global, avoiding the
+// guest staging copy entirely.  Returns NULL if the fd isn't a sealable
+// memfd (udmabuf requires F_SEAL_SHRINK), the wrap fails, or the format
+// has no single-plane DRM equivalent; callers fall back to the copy path.
+struct wl_buffer* sl_udmabuf_create_buffer(struct sl_context* ctx,
+                                           int shm_fd,
+                                           uint32_t offset,
+                                           uint32_t width,
+                                           uint32_t height,
+                                           uint32_t stride,
+                                           uint32_t shm_format) {
+  TRACE_EVENT("shm", "sl_udmabuf_create_buffer");
+  struct zwp_linux_buffer_params_v1* buffer_params;
+  struct wl_buffer* buffer;
+  struct udmabuf_create create = {0};
+  long page_size = sysconf(_SC_PAGESIZE);
+  int seals;
+  int dmabuf_fd;
+
+  if (!sl_udmabuf_supported() || !ctx->linux_dmabuf)
+    return NULL;
+
+  // Multi-planar formats would need one udmabuf per plane; not worth it for
+  // the shm clients this path targets.
+  if (sl_shm_num_planes_for_shm_format(shm_format) != 1)
+    return NULL;
+
+  seals = fcntl(shm_fd, F_GET_SEALS);
+  if (seals < 0)
+    return NULL;
+
+  if (!(seals & F_SEAL_SHRINK)) {
+    if (fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+      return NULL;
+  }
+
+  // udmabuf offsets and sizes must be page aligned; the sub-page remainder
+  // is carried in the dmabuf plane offset instead.
+  uint64_t aligned_offset = offset & ~(page_size - 1);
+  uint64_t end = offset + static_cast<uint64_t>(stride) * height;
+  uint64_t aligned_size =
+      (end - aligned_offset + page_size - 1) & ~(page_size - 1);
+
+  create.memfd = shm_fd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = aligned_offset;
+  create.size = aligned_size;
+
+  dmabuf_fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+  if (dmabuf_fd < 0)
+    return NULL;
+
+  buffer_params =
+      zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf->internal);
+  zwp_linux_buffer_params_v1_add(buffer_params, dmabuf_fd, 0,
+                                 offset - aligned_offset, stride, 0, 0);
+  buffer = zwp_linux_buffer_params_v1_create_immed(
+      buffer_params, width, height, sl_drm_format_for_shm_format(shm_format),
+      0);
+  zwp_linux_buffer_params_v1_destroy(buffer_params);
+  close(dmabuf_fd);
+
+  return buffer;
+}
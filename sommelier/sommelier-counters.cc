@@ -0,0 +1,112 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-counters.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sommelier-ctx.h"      // NOLINT(build/include_directory)
+#include "sommelier-tracing.h"  // NOLINT(build/include_directory)
+
+#define NSEC_PER_SEC 1000000000
+#define NSEC_PER_USEC 1000
+
+int64_t sl_counters_now_ns() {
+  timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (int64_t)tp.tv_sec * NSEC_PER_SEC + tp.tv_nsec;
+}
+
+void sl_counters_record_release_latency(struct sl_counters* counters,
+                                        int64_t latency_ns) {
+  int64_t us = latency_ns / NSEC_PER_USEC;
+  int bucket = 0;
+
+  while (us > 1 && bucket < sl_counters::kNumLatencyBuckets - 1) {
+    us >>= 1;
+    bucket++;
+  }
+
+  counters->release.released++;
+  counters->release.latency_buckets[bucket]++;
+}
+
+void sl_counters_dump(struct sl_counters* counters, int fd) {
+  dprintf(fd, "surface_commits %lu\n",
+          static_cast<unsigned long>(counters->surface.commits));
+  dprintf(fd, "surface_damage_rects %lu\n",
+          static_cast<unsigned long>(counters->surface.damage_rects));
+  dprintf(fd, "surface_damage_bytes %lu\n",
+          static_cast<unsigned long>(counters->surface.damage_bytes));
+  dprintf(fd, "buffer_pool_hits %lu\n",
+          static_cast<unsigned long>(counters->surface.buffer_pool_hits));
+  dprintf(fd, "buffer_pool_misses %lu\n",
+          static_cast<unsigned long>(counters->surface.buffer_pool_misses));
+  dprintf(fd, "buffer_pool_reclaims %lu\n",
+          static_cast<unsigned long>(counters->surface.buffer_pool_reclaims));
+  dprintf(fd, "surface_commits_suppressed %lu\n",
+          static_cast<unsigned long>(counters->surface.commits_suppressed));
+  dprintf(fd, "channel_sends %lu\n",
+          static_cast<unsigned long>(counters->channel.channel_sends));
+  dprintf(fd, "channel_send_bytes %lu\n",
+          static_cast<unsigned long>(counters->channel.channel_send_bytes));
+  dprintf(fd, "buffers_released %lu\n",
+          static_cast<unsigned long>(counters->release.released));
+  for (int i = 0; i < sl_counters::kNumLatencyBuckets; ++i) {
+    dprintf(fd, "release_latency_us_ge_%lu %lu\n", i ? 1UL << i : 0UL,
+            static_cast<unsigned long>(counters->release.latency_buckets[i]));
+  }
+  // Aggregates of unsampled trace spans ride along in the same dump.
+  sl_trace_stats_dump(fd);
+}
+
+static int sl_handle_counters_socket_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int client_fd = accept(fd, NULL, NULL);
+
+  if (client_fd < 0)
+    return 1;
+
+  sl_counters_dump(ctx->counters, client_fd);
+  close(client_fd);
+  return 1;
+}
+
+int sl_counters_listen(struct sl_context* ctx, const char* path) {
+  struct sockaddr_un addr = {0};
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: stats socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "error: stats socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  // A stale socket from a previous instance would make bind fail.
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    fprintf(stderr, "error: stats socket %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  ctx->counters_socket_event_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), fd, WL_EVENT_READABLE,
+      sl_handle_counters_socket_event, ctx));
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_COUNTERS_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_COUNTERS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct sl_context;
+
+// Always-on performance counters.  Unlike perfetto tracing these are cheap
+// enough to leave enabled in production: every hot path cost is a plain
+// 64-bit increment of a counter owned by the incrementing thread, with each
+// group kept on its own cacheline so threads never share one.  Counters are
+// read racily by the dump path; a torn read of a monotonically increasing
+// count is harmless.
+struct sl_counters {
+  // Surface forwarding.  Event loop thread.
+  struct alignas(64) {
+    // Commits forwarded to the host compositor.
+    uint64_t commits;
+    // Damage rects copied into output buffers and the bytes they covered.
+    uint64_t damage_rects;
+    uint64_t damage_bytes;
+    // Output buffer reuse in sl_host_surface_attach(): hits found a buffer
+    // in the per-surface released list or the context-wide pool, misses had
+    // to allocate through the channel.
+    uint64_t buffer_pool_hits;
+    uint64_t buffer_pool_misses;
+    // Retained buffers destroyed by the idle reclaim timer.
+    uint64_t buffer_pool_reclaims;
+    // Commits whose staging copy was skipped because the surface was
+    // hidden or fully occluded.
+    uint64_t commits_suppressed;
+  } surface;
+
+  // Guest-bound channel traffic.  Event loop thread.
+  struct alignas(64) {
+    uint64_t channel_sends;
+    uint64_t channel_send_bytes;
+  } channel;
+
+  // Buffer turnaround, measured from attach to the host's release and
+  // bucketed as a log2 histogram of microseconds: bucket n counts latencies
+  // in [2^n, 2^(n+1)) us (bucket 0 starts at zero), with the last bucket
+  // absorbing everything longer.
+  // Event loop thread.
+  static const int kNumLatencyBuckets = 20;
+  struct alignas(64) {
+    uint64_t released;
+    uint64_t latency_buckets[kNumLatencyBuckets];
+  } release;
+};
+
+// Returns CLOCK_MONOTONIC in nanoseconds, for stamping buffer attach times.
+int64_t sl_counters_now_ns();
+
+// Adds a released buffer's attach-to-release latency to the histogram.
+void sl_counters_record_release_latency(struct sl_counters* counters,
+                                        int64_t latency_ns);
+
+// Writes all counters to |fd| as "name value" lines.
+void sl_counters_dump(struct sl_counters* counters, int fd);
+
+// Creates a listening UNIX socket at |path| and registers it with the event
+// loop; each connection receives a counter dump and is closed.  Returns 0 on
+// success, -1 on failure (with the error already logged).
+int sl_counters_listen(struct sl_context* ctx, const char* path);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_COUNTERS_H_
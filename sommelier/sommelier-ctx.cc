@@ -13,6 +13,7 @@
 
 #include "aura-shell-client-protocol.h"  // NOLINT(build/include_directory)
 #include "sommelier.h"                   // NOLINT(build/include_directory)
+#include "sommelier-counters.h"          // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"           // NOLINT(build/include_directory)
 
 // TODO(b/173147612): Use container_token rather than this name.
@@ -126,14 +127,29 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->virtwl_display_fd = -1;
   ctx->wayland_channel_event_source = NULL;
   ctx->virtwl_socket_event_source = NULL;
+  ctx->channel_allocator_event_source = NULL;
+  ctx->render_event_source = NULL;
+  ctx->input_event_loop = NULL;
+  ctx->input_event_loop_source = NULL;
+  ctx->bulk_channel = NULL;
+  ctx->channel_allocator = NULL;
   ctx->vm_id = DEFAULT_VM_NAME;
   ctx->drm_device = NULL;
+  ctx->host_display_name = NULL;
   ctx->gbm = NULL;
   ctx->xwayland = 0;
   ctx->xwayland_pid = -1;
+  ctx->xwayland_listen_fds[0] = -1;
+  ctx->xwayland_listen_fds[1] = -1;
+  ctx->xwayland_listen_event_source[0] = NULL;
+  ctx->xwayland_listen_event_source[1] = NULL;
   ctx->child_pid = -1;
   ctx->peer_pid = -1;
   ctx->xkb_context = NULL;
+  ctx->keymap_cache = NULL;
+  ctx->keymap_cache_fd = -1;
+  ctx->keymap_cache_size = 0;
+  ctx->keymap_cache_data = NULL;
   ctx->next_global_id = 1;
   ctx->connection = NULL;
   ctx->connection_event_source = NULL;
@@ -171,19 +187,29 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->selection_send_event_source = NULL;
   ctx->selection_property_reply = NULL;
   ctx->selection_property_offset = 0;
+  ctx->selection_property_next_reply = NULL;
+  ctx->selection_property_notify_pending = 0;
+  ctx->selection_property_eof_pending = 0;
   ctx->selection_event_source = NULL;
   ctx->selection_data_offer_receive_fd = -1;
   ctx->selection_data_ack_pending = 0;
+  ctx->selection_incr_chunk_size = 64 * 1024;
   for (unsigned i = 0; i < ARRAY_SIZE(ctx->atoms); i++) {
     const char* name = sl_context_atom_name(i);
     assert(name != NULL);
     ctx->atoms[i].name = name;
   }
   ctx->timing = NULL;
+  ctx->counters = new sl_counters{};
+  ctx->recording_file = NULL;
+  ctx->data_transfer_pipe_size = 1024 * 1024;
+  ctx->relative_pointer_rate = 0;
   ctx->trace_filename = NULL;
   ctx->enable_xshape = false;
   ctx->trace_system = false;
   ctx->use_direct_scale = false;
+  ctx->enable_udmabuf = false;
+  ctx->lazy_init = false;
 
   wl_list_init(&ctx->accelerators);
   wl_list_init(&ctx->windowed_accelerators);
@@ -193,7 +219,14 @@ void sl_context_init_default(struct sl_context* ctx) {
   wl_list_init(&ctx->seats);
   wl_list_init(&ctx->windows);
   wl_list_init(&ctx->unpaired_windows);
+  wl_list_init(&ctx->pending_xcb_replies);
   wl_list_init(&ctx->host_outputs);
+  wl_list_init(&ctx->output_buffer_pool);
+  ctx->output_buffer_pool_size = 0;
+  wl_list_init(&ctx->callback_pool);
+  wl_list_init(&ctx->reclaim_surfaces);
+  ctx->idle_reclaim_delay = 30;
+  ctx->reclaim_timer_event_source = NULL;
   wl_list_init(&ctx->selection_data_source_send_pending);
 #ifdef GAMEPAD_SUPPORT
   wl_list_init(&ctx->gamepads);
@@ -225,6 +258,15 @@ static int sl_handle_clipboard_event(int fd, uint32_t mask, void* data) {
   return 1;
 }
 
+static int sl_handle_channel_allocator_event(int fd,
+                                             uint32_t mask,
+                                             void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  ctx->channel_allocator->dispatch();
+  return 1;
+}
+
 static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_wayland_channel_event");
   struct sl_context* ctx = (struct sl_context*)data;
@@ -293,8 +335,10 @@ static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
   while (receive.num_fds--)
     close(receive.fds[receive.num_fds]);
 
-  if (receive.data)
-    free(receive.data);
+  // The payload went straight from the channel's storage into the sendmsg
+  // iovec; with it on the socket, the channel may reuse the storage.
+  rv = ctx->channel->receive_done();
+  errno_assert(!rv);
 
   return 1;
 }
@@ -302,13 +346,8 @@ static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
 static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_virtwl_socket_event");
   struct sl_context* ctx = (struct sl_context*)data;
-  struct WaylandSendReceive send = {0};
   char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
-  uint8_t data_buffer[DEFAULT_BUFFER_SIZE];
-
-  struct iovec buffer_iov;
-  struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
+  uint8_t data_buffer[MAX_BUFFER_SIZE];
   ssize_t bytes;
   int rv;
 
@@ -320,49 +359,97 @@ static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
     exit(EXIT_SUCCESS);
   }
 
-  buffer_iov.iov_base = data_buffer;
-  buffer_iov.iov_len = ctx->channel->max_send_size();
+  // Receive directly into the channel's staging area when it provides one,
+  // so the payload doesn't get copied again on its way into the send
+  // transaction.
+  uint8_t* channel_buffer = ctx->channel->send_buffer();
+
+  // Drain the socket completely before flushing the channel, so a burst of
+  // outbound messages (input events, a frame's worth of requests) can be
+  // coalesced into fewer host submissions.
+  for (bool first = true;; first = false) {
+    struct WaylandSendReceive send = {0};
+    struct iovec buffer_iov;
+    struct msghdr msg = {0};
+    struct cmsghdr* cmsg;
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+    buffer_iov.iov_base = channel_buffer ? channel_buffer : data_buffer;
+    buffer_iov.iov_len = ctx->channel->max_send_size();
+
+    msg.msg_iov = &buffer_iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = sizeof(fd_buffer);
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+    bytes = recvmsg(ctx->virtwl_socket_fd, &msg,
+                    first ? 0 : MSG_DONTWAIT);
+    if (!first && bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    errno_assert(bytes > 0);
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+    // If there were any FDs recv'd by recvmsg, there will be some data in the
+    // msg_control buffer. To get the FDs out we iterate all cmsghdr's within
+    // and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+    for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      size_t cmsg_fd_count;
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
 
-    // fd_count will never exceed WAYLAND_MAX_FDs because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&send.fds[send.num_fds], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    send.num_fds += cmsg_fd_count;
-  }
+      // fd_count will never exceed WAYLAND_MAX_FDs because the
+      // control message buffer only allocates enough space for that many FDs.
+      memcpy(&send.fds[send.num_fds], CMSG_DATA(cmsg),
+             cmsg_fd_count * sizeof(int));
+      send.num_fds += cmsg_fd_count;
+    }
 
-  send.channel_fd = ctx->wayland_channel_fd;
-  send.data = data_buffer;
-  send.data_size = bytes;
+    send.channel_fd = ctx->wayland_channel_fd;
+    send.data = channel_buffer ? channel_buffer : data_buffer;
+    send.data_size = bytes;
+
+    rv = ctx->channel->send(send);
+    errno_assert(!rv);
+
+    ctx->counters->channel.channel_sends++;
+    ctx->counters->channel.channel_send_bytes += send.data_size;
+
+    while (send.num_fds--)
+      close(send.fds[send.num_fds]);
+  }
 
-  rv = ctx->channel->send(send);
+  rv = ctx->channel->flush();
   errno_assert(!rv);
 
-  while (send.num_fds--)
-    close(send.fds[send.num_fds]);
+  return 1;
+}
+
+static int sl_handle_input_event_loop_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
 
+  wl_event_loop_dispatch(ctx->input_event_loop, 0);
   return 1;
 }
 
+struct wl_event_loop* sl_context_input_event_loop(struct sl_context* ctx) {
+  if (!ctx->input_event_loop) {
+    struct wl_event_loop* event_loop =
+        wl_display_get_event_loop(ctx->host_display);
+
+    ctx->input_event_loop = wl_event_loop_create();
+    if (!ctx->input_event_loop)
+      return event_loop;
+
+    ctx->input_event_loop_source.reset(wl_event_loop_add_fd(
+        event_loop, wl_event_loop_get_fd(ctx->input_event_loop),
+        WL_EVENT_READABLE, sl_handle_input_event_loop_event, ctx));
+  }
+
+  return ctx->input_event_loop;
+}
+
 bool sl_context_init_wayland_channel(struct sl_context* ctx,
                                      struct wl_event_loop* event_loop,
                                      bool display) {
@@ -376,6 +463,30 @@ bool sl_context_init_wayland_channel(struct sl_context* ctx,
             strerror(-rv));
     return false;
   }
+
+  // Bring up the bulk channel instance, best effort: allocations fall back
+  // to the main channel when it fails.  The main channel is also driven by
+  // the event loop's protocol traffic, so in that configuration the
+  // allocator must not use its helper thread and performs allocations
+  // synchronously on the event loop thread instead.
+  if (ctx->bulk_channel) {
+    rv = ctx->bulk_channel->init();
+    if (!rv)
+      rv = ctx->bulk_channel->create_allocation_context();
+    if (rv) {
+      fprintf(stderr, "warning: could not initialize bulk channel: %s\n",
+              strerror(-rv));
+      delete ctx->bulk_channel;
+      ctx->bulk_channel = NULL;
+    }
+  }
+
+  ctx->channel_allocator = new ChannelAllocator(
+      ctx->bulk_channel ? ctx->bulk_channel : ctx->channel,
+      ctx->bulk_channel != NULL);
+  ctx->channel_allocator_event_source.reset(wl_event_loop_add_fd(
+      event_loop, ctx->channel_allocator->completion_fd(), WL_EVENT_READABLE,
+      sl_handle_channel_allocator_event, ctx));
   if (!display) {
     // We use a wayland virtual context unless display was explicitly specified.
     // WARNING: It's critical that we never call wl_display_roundtrip
@@ -397,11 +508,14 @@ bool sl_context_init_wayland_channel(struct sl_context* ctx,
       return false;
     }
 
+    // Both directions of the protocol stream carry input events; keep them
+    // on the input loop so they dispatch ahead of bulk work.
+    struct wl_event_loop* input_loop = sl_context_input_event_loop(ctx);
     ctx->virtwl_socket_event_source.reset(wl_event_loop_add_fd(
-        event_loop, ctx->virtwl_socket_fd, WL_EVENT_READABLE,
+        input_loop, ctx->virtwl_socket_fd, WL_EVENT_READABLE,
         sl_handle_virtwl_socket_event, ctx));
     ctx->wayland_channel_event_source.reset(wl_event_loop_add_fd(
-        event_loop, ctx->wayland_channel_fd, WL_EVENT_READABLE,
+        input_loop, ctx->wayland_channel_fd, WL_EVENT_READABLE,
         sl_handle_wayland_channel_event, ctx));
   }
   return true;
@@ -409,15 +523,12 @@ bool sl_context_init_wayland_channel(struct sl_context* ctx,
 
 sl_window* sl_context_lookup_window_for_surface(struct sl_context* ctx,
                                                 wl_resource* resource) {
-  sl_window* surface_window = NULL;
-  sl_window* window;
-
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
+  return sl_context_lookup_window_for_surface_id(ctx,
+                                                 wl_resource_get_id(resource));
+}
 
-  return surface_window;
+sl_window* sl_context_lookup_window_for_surface_id(struct sl_context* ctx,
+                                                   uint32_t surface_id) {
+  auto it = ctx->surface_window_index.find(surface_id);
+  return it != ctx->surface_window_index.end() ? it->second : NULL;
 }
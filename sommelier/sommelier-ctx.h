@@ -7,10 +7,12 @@
 
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <xcb/xcb.h>
 #include <limits.h>
+#include <stdio.h>
 
 #include "sommelier-timing.h"  // NOLINT(build/include_directory)
 #include "sommelier-util.h"    // NOLINT(build/include_directory)
@@ -88,8 +90,18 @@ struct sl_context {
   struct wl_list seats;
   std::unique_ptr<struct wl_event_source> display_event_source;
   std::unique_ptr<struct wl_event_source> display_ready_event_source;
+  // Nested event loop reserved for latency critical, input bearing fds
+  // (host display, wayland channel, guest socket, X11 connection).  Its fd
+  // is registered in the main loop, and the main loop in real_main() also
+  // drains it ahead of each blocking dispatch, so pending input is handled
+  // before bulk work (selection transfers, output updates) no matter how
+  // full the main epoll set is.  Created lazily by
+  // sl_context_input_event_loop().
+  struct wl_event_loop* input_event_loop;
+  std::unique_ptr<struct wl_event_source> input_event_loop_source;
   std::unique_ptr<struct wl_event_source> sigchld_event_source;
   std::unique_ptr<struct wl_event_source> sigusr1_event_source;
+  std::unique_ptr<struct wl_event_source> counters_socket_event_source;
   std::unique_ptr<struct wl_event_source> clipboard_event_source;
   struct wl_array dpi;
   int wm_fd;
@@ -98,16 +110,38 @@ struct sl_context {
   int virtwl_display_fd;
   std::unique_ptr<struct wl_event_source> wayland_channel_event_source;
   std::unique_ptr<struct wl_event_source> virtwl_socket_event_source;
+  std::unique_ptr<struct wl_event_source> channel_allocator_event_source;
+  // Completion notifications from the render thread; registered lazily by
+  // the compositor on the first staged commit.
+  std::unique_ptr<struct wl_event_source> render_event_source;
   const char* drm_device;
+  // Name of the host compositor socket sommelier connected to, or "virtwl"
+  // when the connection runs over a wayland channel.  Used to key persisted
+  // capability caches to the host identity.
+  const char* host_display_name;
   struct gbm_device* gbm;
   int xwayland;
   pid_t xwayland_pid;
+  // X11 sockets sommelier listens on while the Xwayland spawn is deferred
+  // by --lazy-init.  Handed to Xwayland via -listenfd on the first
+  // connection attempt; -1 when unused.
+  int xwayland_listen_fds[2];
+  std::unique_ptr<struct wl_event_source> xwayland_listen_event_source[2];
   // XWayland-hosting sommelier instances allow additional connections for IME
   // support.
   wl_listener extra_client_created_listener;
   pid_t child_pid;
   pid_t peer_pid;
   struct xkb_context* xkb_context;
+  // Compiled keymap cache shared by every keyboard (sl_keyboard_keymap()):
+  // the host's serialized keymap lives in one sealed memfd whose fd is
+  // handed to all clients, and the compiled form is reused for modifier
+  // tracking instead of recompiling per keyboard.  keymap_cache_data keeps
+  // the memfd mapped for comparing against incoming keymap events.
+  struct xkb_keymap* keymap_cache;
+  int keymap_cache_fd;
+  uint32_t keymap_cache_size;
+  char* keymap_cache_data;
   struct wl_list accelerators;
   struct wl_list windowed_accelerators;
   struct wl_list registries;
@@ -121,6 +155,16 @@ struct sl_context {
   xcb_screen_t* screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
+  // Hash indexes over the windows on the two lists above: X11 window (or
+  // frame window) id -> window, and host surface resource id -> paired
+  // window.  Maintained by sl_window and sl_window_update(); queried by
+  // sl_lookup_window() and sl_context_lookup_window_for_surface().
+  std::unordered_map<xcb_window_t, struct sl_window*> window_index;
+  std::unordered_map<uint32_t, struct sl_window*> surface_window_index;
+  // XCB replies (struct sl_pending_xcb_reply) queued by
+  // sl_xcb_collect_reply() and collected once the current burst of X
+  // events has been processed.  See sommelier.cc.
+  struct wl_list pending_xcb_replies;
   struct sl_window* host_focus_window;
   int needs_set_input_focus;
 #ifdef GAMEPAD_SUPPORT
@@ -169,28 +213,87 @@ struct sl_context {
   std::unique_ptr<struct wl_event_source> selection_send_event_source;
   xcb_get_property_reply_t* selection_property_reply;
   int selection_property_offset;
+  // Staging slot for the INCR chunk fetched while |selection_property_reply|
+  // is still streaming to the pipe. Together the two slots bound peak memory
+  // at two chunks.
+  xcb_get_property_reply_t* selection_property_next_reply;
+  // Set when a chunk was announced while both slots were occupied; the fetch
+  // (and the property delete that goes with it) is deferred until one drains.
+  int selection_property_notify_pending;
+  // Set once the zero-length INCR terminator has been fetched but staged
+  // chunks are still streaming out.
+  int selection_property_eof_pending;
   std::unique_ptr<struct wl_event_source> selection_event_source;
   xcb_atom_t selection_data_type;
   struct wl_array selection_data;
   int selection_data_offer_receive_fd;
   int selection_data_ack_pending;
+  // INCR chunk size for outgoing selection data, sized to the channel's
+  // max_send_size() so each chunk moves in one channel send.
+  uint32_t selection_incr_chunk_size;
   union {
     const char* name;
     xcb_intern_atom_cookie_t cookie;
     xcb_atom_t value;
   } atoms[ATOM_LAST + 1];
+  // String -> atom cache for dynamically interned names (mime types on
+  // data offers and pastes).  Seeded from the static atom table once its
+  // replies arrive; repeat lookups then resolve without an X round trip.
+  std::unordered_map<std::string, xcb_atom_t> atom_cache;
   xcb_visualid_t visual_ids[256];
   xcb_colormap_t colormaps[256];
   Timing* timing;
+  // Always-on performance counters, allocated for the lifetime of the
+  // process by sl_context_init().  See sommelier-counters.h.
+  struct sl_counters* counters;
+  // Stream recording for sommelier_bench replay, opened by --record-stream.
+  // NULL when not recording.  See sommelier-recording.h.
+  FILE* recording_file;
+  // Pipe buffer size requested (via F_SETPIPE_SZ) for clipboard and
+  // drag-and-drop pipe-to-pipe transfers.
+  size_t data_transfer_pipe_size;
+  // When positive, relative pointer deltas are accumulated and emitted at
+  // this rate (Hz) instead of one event per hardware report.
+  int relative_pointer_rate;
   const char* trace_filename;
   bool enable_xshape;
   bool trace_system;
   bool use_explicit_fence;
   bool use_virtgpu_channel;
   bool use_direct_scale;
+  bool enable_udmabuf;
+  // Defer optional host global binds and the Xwayland spawn until first use
+  // to shorten cold start.  See sl_registry_handler().
+  bool lazy_init;
+  // Idle output buffers (struct sl_output_buffer) retained for reuse across
+  // surfaces, most recently used first.  See sommelier-compositor.cc.
+  struct wl_list output_buffer_pool;
+  int output_buffer_pool_size;
+  // All live host surfaces, walked by the idle reclaim timer in
+  // sommelier-compositor.cc to find retained buffers whose surface has
+  // gone quiet.
+  struct wl_list reclaim_surfaces;
+  // Seconds without a commit before a surface's retained output buffers
+  // (and aged entries in output_buffer_pool) are destroyed and their
+  // guest mappings and host allocations released.  0 disables reclaim.
+  // Set by --idle-reclaim-delay.
+  int idle_reclaim_delay;
+  std::unique_ptr<struct wl_event_source> reclaim_timer_event_source;
+  // Freed sl_host_callback nodes recycled by sl_host_callback_alloc();
+  // frame callbacks churn one of these per surface per frame.
+  struct wl_list callback_pool;
   // Never freed after allocation due the fact sommelier doesn't have a
   // shutdown function yet.
   WaylandChannel* channel;
+  // Second channel instance reserved for bulk traffic (currently buffer
+  // allocations), so blocking host round trips never queue behind - or in
+  // front of - the latency sensitive protocol stream on `channel`.  NULL
+  // when the extra instance failed to initialize; allocations then share
+  // the main channel as before.
+  WaylandChannel* bulk_channel;
+  // Helper thread wrapper for channel allocations; never freed, like the
+  // channel itself.
+  ChannelAllocator* channel_allocator;
 };
 
 // Returns the string mapped to the given ATOM_ enum value.
@@ -205,6 +308,10 @@ const char* sl_context_atom_name(int atom_enum);
 
 void sl_context_init_default(struct sl_context* ctx);
 
+// Returns the event loop input bearing fds should be registered on,
+// creating it on first use.  Falls back to the main loop if creation fails.
+struct wl_event_loop* sl_context_input_event_loop(struct sl_context* ctx);
+
 bool sl_context_init_wayland_channel(struct sl_context* ctx,
                                      struct wl_event_loop* event_loop,
                                      bool display);
@@ -212,4 +319,9 @@ bool sl_context_init_wayland_channel(struct sl_context* ctx,
 sl_window* sl_context_lookup_window_for_surface(struct sl_context* ctx,
                                                 wl_resource* resource);
 
+// As above, keyed directly by the host surface resource id.  Returns NULL
+// for id 0 or when no paired window references the surface.
+sl_window* sl_context_lookup_window_for_surface_id(struct sl_context* ctx,
+                                                   uint32_t surface_id);
+
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_CTX_H_
@@ -4,6 +4,9 @@
 
 #include "sommelier.h"            // NOLINT(build/include_directory)
 #include "sommelier-transform.h"  // NOLINT(build/include_directory)
+#ifdef IO_URING_SUPPORT
+#include "sommelier-uring.h"  // NOLINT(build/include_directory)
+#endif
 
 #include <assert.h>
 #include <errno.h>
@@ -12,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -45,6 +49,11 @@ MAP_STRUCTS(wl_data_offer, sl_host_data_offer);
 struct sl_data_transfer {
   int read_fd;
   int write_fd;
+  // Pipe-to-pipe transfers skip the user-space staging buffer and move
+  // whole pipe buffers with splice() instead. |splice_chunk| is the pipe
+  // size we managed to set, used as the per-call splice length.
+  bool use_splice;
+  size_t splice_chunk;
   size_t offset;
   size_t bytes_left;
   uint8_t data[DEFAULT_BUFFER_SIZE];
@@ -146,12 +155,92 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   return 0;
 }
 
-static void sl_data_transfer_create(struct wl_event_loop* event_loop,
+static void sl_data_transfer_splice_pump(struct sl_data_transfer* transfer) {
+  while (true) {
+    ssize_t rv = splice(transfer->read_fd, nullptr, transfer->write_fd, nullptr,
+                        transfer->splice_chunk,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv > 0)
+      continue;
+
+    if (rv == 0) {
+      // EOF: the source closed its end and the inbound pipe is drained.
+      sl_data_transfer_destroy(transfer);
+      return;
+    }
+
+    if (errno != EAGAIN) {
+      // On a splice error, end the transfer.
+      sl_data_transfer_destroy(transfer);
+      return;
+    }
+
+    // EAGAIN is ambiguous: either the inbound pipe is empty or the outbound
+    // pipe is full. FIONREAD on the read end tells us which, so we know
+    // which fd to wait on.
+    int pending = 0;
+    if (ioctl(transfer->read_fd, FIONREAD, &pending) < 0)
+      pending = 0;
+    if (pending > 0) {
+      // Data is waiting but the outbound pipe is full; wait for the
+      // recipient to drain it.
+      wl_event_source_fd_update(transfer->read_event_source.get(), 0);
+      wl_event_source_fd_update(transfer->write_event_source.get(),
+                                WL_EVENT_WRITABLE);
+    } else {
+      wl_event_source_fd_update(transfer->write_event_source.get(), 0);
+      wl_event_source_fd_update(transfer->read_event_source.get(),
+                                WL_EVENT_READABLE);
+    }
+    return;
+  }
+}
+
+static int sl_handle_data_transfer_splice_read(int fd,
+                                               uint32_t mask,
+                                               void* data) {
+  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+
+  // Unlike the buffered path, a hangup needs no special casing here: any
+  // bytes still queued in the inbound pipe remain spliceable after the
+  // source closes its end, and splice() returning zero marks the real EOF.
+  sl_data_transfer_splice_pump(transfer);
+  return 0;
+}
+
+static int sl_handle_data_transfer_splice_write(int fd,
+                                                uint32_t mask,
+                                                void* data) {
+  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+
+  // If the recipient hung up there's no one left to splice to, so just
+  // destroy the transfer now.
+  if ((mask & WL_EVENT_WRITABLE) == 0) {
+    assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
+    sl_data_transfer_destroy(transfer);
+    return 0;
+  }
+
+  sl_data_transfer_splice_pump(transfer);
+  return 0;
+}
+
+static void sl_data_transfer_create(struct sl_context* ctx,
                                     int read_fd,
                                     int write_fd) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  struct stat read_stat, write_stat;
   int flags;
   int rv;
 
+#ifdef IO_URING_SUPPORT
+  // Large payloads move in multi-page chunks with batched submissions on
+  // io_uring; fall through to the poll-driven transfer when it's missing.
+  if (sl_uring_transfer_create(event_loop, read_fd, write_fd))
+    return;
+#endif
+
   flags = fcntl(write_fd, F_GETFL, 0);
   rv = fcntl(write_fd, F_SETFL, flags | O_NONBLOCK);
   assert(!rv);
@@ -162,14 +251,38 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   assert(transfer);
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
+  transfer->use_splice = false;
+  transfer->splice_chunk = 0;
   transfer->offset = 0;
   transfer->bytes_left = 0;
   memset(transfer->data, 0, DEFAULT_BUFFER_SIZE);
-  transfer->read_event_source.reset(
-      wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
-                           sl_handle_data_transfer_read, transfer));
+
+  // When both ends are pipes, move data with splice() instead of bouncing
+  // it through |data| one page at a time. Growing the pipe buffers first
+  // (best effort; F_SETPIPE_SZ is capped by /proc/sys/fs/pipe-max-size)
+  // lets a large paste complete in a handful of wakeups.
+  if (!fstat(read_fd, &read_stat) && S_ISFIFO(read_stat.st_mode) &&
+      !fstat(write_fd, &write_stat) && S_ISFIFO(write_stat.st_mode)) {
+    transfer->use_splice = true;
+    transfer->splice_chunk = DEFAULT_BUFFER_SIZE;
+    rv = fcntl(read_fd, F_SETPIPE_SZ, ctx->data_transfer_pipe_size);
+    if (rv > 0 && static_cast<size_t>(rv) > transfer->splice_chunk)
+      transfer->splice_chunk = rv;
+    rv = fcntl(write_fd, F_SETPIPE_SZ, ctx->data_transfer_pipe_size);
+    if (rv > 0 && static_cast<size_t>(rv) > transfer->splice_chunk)
+      transfer->splice_chunk = rv;
+  }
+
+  transfer->read_event_source.reset(wl_event_loop_add_fd(
+      event_loop, read_fd, WL_EVENT_READABLE,
+      transfer->use_splice ? sl_handle_data_transfer_splice_read
+                           : sl_handle_data_transfer_read,
+      transfer));
   transfer->write_event_source.reset(wl_event_loop_add_fd(
-      event_loop, write_fd, 0, sl_handle_data_transfer_write, transfer));
+      event_loop, write_fd, 0,
+      transfer->use_splice ? sl_handle_data_transfer_splice_write
+                           : sl_handle_data_transfer_write,
+      transfer));
 }
 
 static void sl_data_offer_receive(struct wl_client* client,
@@ -194,8 +307,7 @@ static void sl_data_offer_receive(struct wl_client* client,
     return;
   }
 
-  sl_data_transfer_create(wl_display_get_event_loop(host->ctx->host_display),
-                          pipe_fd, fd);
+  sl_data_transfer_create(host->ctx, pipe_fd, fd);
 
   wl_data_offer_receive(host->proxy, mime_type, pipe_fd);
 }
@@ -57,7 +57,7 @@ static void sl_host_callback_destroy(struct wl_resource* resource) {
 
   wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  delete host;
+  sl_host_callback_free(host);
 }
 
 static void sl_display_sync(struct wl_client* client,
@@ -65,7 +65,7 @@ static void sl_display_sync(struct wl_client* client,
                             uint32_t id) {
   struct sl_context* ctx =
       static_cast<sl_context*>(wl_resource_get_user_data(resource));
-  struct sl_host_callback* host_callback = new sl_host_callback();
+  struct sl_host_callback* host_callback = sl_host_callback_alloc(ctx);
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, id);
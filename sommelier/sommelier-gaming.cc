@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "gaming-input-unstable-v2-client-protocol.h"  // NOLINT(build/include_directory)
 
@@ -31,11 +32,11 @@
 // 6) Listen for zcr_gamepad_v2.activated to finalize a custom game controller
 //    Calls libevdev_uinput_create_from_device
 // 7) Listen for zcr_gamepad_v2.axis to set frame state for game controller
-//    Calls libevdev_uinput_write_event
+//    Stages the event in host_gamepad->frame_events
 // 8) Listen for zcr_gamepad_v2.button to set frame state for game controller
-//    Calls libevdev_uinput_write_event
+//    Stages the event in host_gamepad->frame_events
 // 9) Listen for zcr_gamepad_v2.frame to emit collected frame
-//    Calls libevdev_uinput_write_event(EV_SYN)
+//    Writes the staged events plus EV_SYN to uinput in one batch
 // 10) Listen for zcr_gamepad_v2.removed to destroy gamepad
 //    Must handle gamepads in all states of construction or error
 
@@ -103,6 +104,40 @@ static uint32_t remap_axis(struct sl_host_gamepad* host_gamepad,
   return axis;
 }
 
+static void sl_gamepad_flush_frame(struct sl_host_gamepad* host_gamepad) {
+  if (host_gamepad->frame_event_count == 0)
+    return;
+
+  // uinput accepts multiple events per write, so the whole frame costs one
+  // syscall instead of one per axis/button. The kernel stamps each event
+  // with the current time on delivery, matching what the per-event
+  // libevdev_uinput_write_event calls did.
+  ssize_t rv = write(libevdev_uinput_get_fd(host_gamepad->uinput_dev),
+                     host_gamepad->frame_events,
+                     host_gamepad->frame_event_count *
+                         sizeof(host_gamepad->frame_events[0]));
+  UNUSED(rv);
+  host_gamepad->frame_event_count = 0;
+}
+
+static void sl_gamepad_queue_event(struct sl_host_gamepad* host_gamepad,
+                                   uint16_t type,
+                                   uint16_t code,
+                                   int32_t value) {
+  if (host_gamepad->frame_event_count >=
+      ARRAY_SIZE(host_gamepad->frame_events)) {
+    // No real controller reports this many events per frame, but submit
+    // what we have rather than dropping anything.
+    sl_gamepad_flush_frame(host_gamepad);
+  }
+
+  struct input_event ev = {};
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  host_gamepad->frame_events[host_gamepad->frame_event_count++] = ev;
+}
+
 static void sl_internal_gamepad_axis(void* data,
                                      struct zcr_gamepad_v2* gamepad,
                                      uint32_t time,
@@ -117,8 +152,8 @@ static void sl_internal_gamepad_axis(void* data,
   axis = remap_axis(host_gamepad, axis);
 
   // Note: incoming time is ignored, it will be regenerated from current time.
-  libevdev_uinput_write_event(host_gamepad->uinput_dev, EV_ABS, axis,
-                              wl_fixed_to_double(value));
+  sl_gamepad_queue_event(host_gamepad, EV_ABS, axis,
+                         wl_fixed_to_double(value));
 }
 
 static void sl_internal_gamepad_button(void* data,
@@ -138,7 +173,7 @@ static void sl_internal_gamepad_button(void* data,
   int value = (state == ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED) ? 1 : 0;
 
   // Note: incoming time is ignored, it will be regenerated from current time.
-  libevdev_uinput_write_event(host_gamepad->uinput_dev, EV_KEY, button, value);
+  sl_gamepad_queue_event(host_gamepad, EV_KEY, button, value);
 }
 
 static void sl_internal_gamepad_frame(void* data,
@@ -151,7 +186,8 @@ static void sl_internal_gamepad_frame(void* data,
     return;
 
   // Note: incoming time is ignored, it will be regenerated from current time.
-  libevdev_uinput_write_event(host_gamepad->uinput_dev, EV_SYN, SYN_REPORT, 0);
+  sl_gamepad_queue_event(host_gamepad, EV_SYN, SYN_REPORT, 0);
+  sl_gamepad_flush_frame(host_gamepad);
 }
 
 static void sl_internal_gamepad_axis_added(void* data,
@@ -300,8 +336,15 @@ static const struct zcr_gaming_seat_v2_listener
         sl_internal_gaming_seat_gamepad_added_with_device_info};
 
 void sl_gaming_seat_add_listener(struct sl_context* ctx) {
-  if (ctx->gaming_input_manager && ctx->gaming_input_manager->internal) {
+  if (ctx->gaming_input_manager) {
     TRACE_EVENT("gaming", "sl_gaming_seat_add_listener");
+    if (!ctx->gaming_input_manager->internal) {
+      // Deferred by --lazy-init; this is the first point it's needed.
+      ctx->gaming_input_manager->internal = static_cast<zcr_gaming_input_v2*>(
+          wl_registry_bind(wl_display_get_registry(ctx->display),
+                           ctx->gaming_input_manager->id,
+                           &zcr_gaming_input_v2_interface, 2));
+    }
     // TODO(kenalba): does gaming_seat need to persist in ctx?
     struct zcr_gaming_seat_v2* gaming_seat =
         zcr_gaming_input_v2_get_gaming_seat(ctx->gaming_input_manager->internal,
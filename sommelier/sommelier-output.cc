@@ -347,6 +347,23 @@ void sl_output_send_host_output_state(struct sl_host_output* host) {
     wl_output_send_scale(host->resource, scale);
   if (wl_resource_get_version(host->resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
     wl_output_send_done(host->resource);
+
+  // The output's scale factors are final for this flush, so window scales
+  // that derive from them are recomputed here, once, instead of once per
+  // listener event that fed the flush.
+  if (host->ctx->use_direct_scale) {
+    struct sl_window* window;
+
+    wl_list_for_each(window, &host->ctx->windows, link) {
+      struct sl_host_surface* surface = window->paired_surface;
+
+      if (surface && surface->output.get() == host) {
+        sl_transform_try_window_scale(host->ctx, surface, window->width,
+                                      window->height);
+        sl_window_update(window);
+      }
+    }
+  }
 }
 
 static void sl_output_geometry(void* data,
@@ -372,6 +389,7 @@ static void sl_output_geometry(void* data,
   free(host->make);
   host->make = strdup(make);
   host->transform = transform;
+  host->dirty = true;
   // host_outputs is sorted by x. Delete then re-insert at the correct position.
   wl_list_remove(&host->link);
   // Insert at the end by default. If insert_at is not set in the loop,
@@ -402,15 +420,23 @@ static void sl_output_mode(void* data,
   host->width = width;
   host->height = height;
   host->refresh = refresh;
+  host->dirty = true;
 }
 
 static void sl_output_done(void* data, struct wl_output* output) {
   struct sl_host_output* host =
       static_cast<sl_host_output*>(wl_output_get_user_data(output));
 
-  // Early out if scale is expected but not yet know.
-  if (host->expecting_scale)
+  // Early out if scale or logical size is expected but not yet known; the
+  // accumulated state is flushed at the done following those events, so a
+  // hotplug or scale change storm reaches clients as one update.
+  if (host->expecting_scale || host->expecting_logical_size)
+    return;
+
+  // Nothing changed since the last flush.
+  if (!host->dirty)
     return;
+  host->dirty = false;
 
   sl_output_send_host_output_state(host);
 
@@ -443,6 +469,7 @@ static void sl_aura_output_scale(void* data,
   if (flags & ZAURA_OUTPUT_SCALE_PROPERTY_PREFERRED)
     host->preferred_scale = scale;
 
+  host->dirty = true;
   host->expecting_scale = 0;
 }
 
@@ -453,6 +480,7 @@ static void sl_aura_output_connection(void* data,
       static_cast<sl_host_output*>(zaura_output_get_user_data(output));
 
   host->internal = connection == ZAURA_OUTPUT_CONNECTION_TYPE_INTERNAL;
+  host->dirty = true;
 }
 
 static void sl_aura_output_device_scale_factor(void* data,
@@ -462,6 +490,7 @@ static void sl_aura_output_device_scale_factor(void* data,
       static_cast<sl_host_output*>(zaura_output_get_user_data(output));
 
   host->device_scale_factor = device_scale_factor;
+  host->dirty = true;
 }
 
 static void sl_aura_output_insets(void* data,
@@ -506,6 +535,7 @@ static void sl_xdg_output_logical_position(
       zxdg_output_v1_get_user_data(zxdg_output_v1));
   host->logical_y = y;
   host->logical_x = x;
+  host->dirty = true;
 }
 
 static void sl_xdg_output_logical_size(void* data,
@@ -518,6 +548,7 @@ static void sl_xdg_output_logical_size(void* data,
   host->logical_width = width;
   host->logical_height = height;
 
+  host->dirty = true;
   host->expecting_logical_size = false;
 }
 
@@ -582,6 +613,7 @@ static void sl_bind_host_output(struct wl_client* client,
   host->device_scale_factor = 1000;
   host->expecting_scale = 0;
   host->expecting_logical_size = false;
+  host->dirty = false;
   wl_list_insert(ctx->host_outputs.prev, &host->link);
   if (ctx->aura_shell) {
     host->expecting_scale = 1;
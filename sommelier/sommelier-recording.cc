@@ -0,0 +1,41 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-recording.h"  // NOLINT(build/include_directory)
+
+#include <stdio.h>
+
+#include "sommelier.h"      // NOLINT(build/include_directory)
+#include "sommelier-ctx.h"  // NOLINT(build/include_directory)
+
+void sl_recording_start(struct sl_context* ctx, const char* path) {
+  ctx->recording_file = fopen(path, "w");
+  if (!ctx->recording_file) {
+    perror(path);
+    return;
+  }
+  fprintf(ctx->recording_file, "# sommelier stream recording v1\n");
+}
+
+void sl_recording_attach(struct sl_context* ctx,
+                         uint32_t surface_id,
+                         struct sl_host_buffer* buffer) {
+  fprintf(ctx->recording_file, "a %u %u %u %u %u\n", surface_id,
+          buffer->resource ? wl_resource_get_id(buffer->resource) : 0,
+          buffer->width, buffer->height, buffer->shm_format);
+}
+
+void sl_recording_damage(struct sl_context* ctx,
+                         uint32_t surface_id,
+                         int32_t x,
+                         int32_t y,
+                         int32_t width,
+                         int32_t height) {
+  fprintf(ctx->recording_file, "d %u %d %d %d %d\n", surface_id, x, y, width,
+          height);
+}
+
+void sl_recording_commit(struct sl_context* ctx, uint32_t surface_id) {
+  fprintf(ctx->recording_file, "c %u\n", surface_id);
+}
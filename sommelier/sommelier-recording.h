@@ -0,0 +1,47 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_RECORDING_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_RECORDING_H_
+
+#include <stdint.h>
+
+struct sl_context;
+struct sl_host_buffer;
+
+// Records the client-side surface stream (attach/damage/commit, with buffer
+// metadata) of a live session to a text file that sommelier_bench can replay
+// against a mock host.  Enabled with --record-stream=PATH; all hooks are
+// guarded by a ctx->recording_file NULL check at the call site, so a session
+// that isn't recording pays nothing.
+//
+// The format is one operation per line, in stream order:
+//
+//   a <surface_id> <buffer_id> <width> <height> <shm_format>
+//   d <surface_id> <x> <y> <width> <height>
+//   c <surface_id>
+//
+// Buffer metadata rides on every attach so the replayer needs no separate
+// buffer table and recreates a buffer if its size or format changes.
+
+// Opens |path| for recording.  Logs and disables recording on failure.
+void sl_recording_start(struct sl_context* ctx, const char* path);
+
+// Appends an attach of |buffer| to the surface with |surface_id|.
+void sl_recording_attach(struct sl_context* ctx,
+                         uint32_t surface_id,
+                         struct sl_host_buffer* buffer);
+
+// Appends a damage rect for the surface with |surface_id|.
+void sl_recording_damage(struct sl_context* ctx,
+                         uint32_t surface_id,
+                         int32_t x,
+                         int32_t y,
+                         int32_t width,
+                         int32_t height);
+
+// Appends a commit of the surface with |surface_id|.
+void sl_recording_commit(struct sl_context* ctx, uint32_t surface_id);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_RECORDING_H_
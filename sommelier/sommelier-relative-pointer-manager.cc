@@ -27,6 +27,18 @@ struct sl_host_relative_pointer {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_relative_pointer_v1* proxy;
+  // Accumulation state for --relative-pointer-rate. Deltas are summed in
+  // fixed point (exact) and emitted from |flush_timer|, so an 8kHz mouse
+  // costs a bounded number of guest-bound events without losing any
+  // displacement.
+  struct wl_event_source* flush_timer;
+  wl_fixed_t pending_dx;
+  wl_fixed_t pending_dy;
+  wl_fixed_t pending_dx_unaccel;
+  wl_fixed_t pending_dy_unaccel;
+  uint32_t pending_utime_hi;
+  uint32_t pending_utime_lo;
+  int pending;
 };
 
 // Like ceil(), but strictly increases the magnitude of the input value (i.e.
@@ -37,6 +49,37 @@ wl_fixed_t magnitude_ceil(wl_fixed_t val) {
   return wl_fixed_from_double(temp);
 }
 
+static int sl_relative_pointer_flush(void* data) {
+  struct sl_host_relative_pointer* host =
+      static_cast<sl_host_relative_pointer*>(data);
+
+  if (!host->pending)
+    return 0;
+  host->pending = 0;
+
+  wl_fixed_t dx_unaccel = host->pending_dx_unaccel;
+  wl_fixed_t dy_unaccel = host->pending_dy_unaccel;
+
+  // Unfortunately, many x11 toolkits truncate RawMotion events. We force them
+  // to interpret cursor movement by rounding to the next greater-magnitude
+  // value. Rounding the accumulated delta (rather than each sample) keeps
+  // the inflation to at most one unit per emitted event.
+  if (host->ctx->xwayland) {
+    dx_unaccel = magnitude_ceil(dx_unaccel);
+    dy_unaccel = magnitude_ceil(dy_unaccel);
+  }
+
+  zwp_relative_pointer_v1_send_relative_motion(
+      host->resource, host->pending_utime_hi, host->pending_utime_lo,
+      host->pending_dx, host->pending_dy, dx_unaccel, dy_unaccel);
+
+  host->pending_dx = 0;
+  host->pending_dy = 0;
+  host->pending_dx_unaccel = 0;
+  host->pending_dy_unaccel = 0;
+  return 0;
+}
+
 static void sl_relative_pointer_relative_motion(
     void* data,
     struct zwp_relative_pointer_v1* relative_pointer,
@@ -50,6 +93,25 @@ static void sl_relative_pointer_relative_motion(
       static_cast<sl_host_relative_pointer*>(
           zwp_relative_pointer_v1_get_user_data(relative_pointer));
 
+  if (host->flush_timer) {
+    // Accumulation mode: sum the deltas exactly in fixed point and let the
+    // flush timer emit them at the configured rate. The timestamp of the
+    // latest sample is carried on the emitted event.
+    host->pending_dx += dx;
+    host->pending_dy += dy;
+    host->pending_dx_unaccel += dx_unaccel;
+    host->pending_dy_unaccel += dy_unaccel;
+    host->pending_utime_hi = utime_hi;
+    host->pending_utime_lo = utime_lo;
+    if (!host->pending) {
+      host->pending = 1;
+      int interval_ms = 1000 / host->ctx->relative_pointer_rate;
+      wl_event_source_timer_update(host->flush_timer,
+                                   interval_ms > 0 ? interval_ms : 1);
+    }
+    return;
+  }
+
   // Unfortunately, many x11 toolkits truncate RawMotion events. We force them
   // to interpret cursor movement by rounding to the next greater-magnitude
   // value.
@@ -67,6 +129,8 @@ static void sl_destroy_host_relative_pointer(struct wl_resource* resource) {
       static_cast<sl_host_relative_pointer*>(
           wl_resource_get_user_data(resource));
 
+  if (host->flush_timer)
+    wl_event_source_remove(host->flush_timer);
   zwp_relative_pointer_v1_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   delete host;
@@ -118,6 +182,11 @@ static void sl_relative_pointer_manager_get_relative_pointer(
       new sl_host_relative_pointer();
   relative_pointer_host->resource = relative_pointer_resource;
   relative_pointer_host->ctx = host->ctx;
+  if (host->ctx->relative_pointer_rate > 0) {
+    relative_pointer_host->flush_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->ctx->host_display),
+        sl_relative_pointer_flush, relative_pointer_host);
+  }
   relative_pointer_host->proxy =
       zwp_relative_pointer_manager_v1_get_relative_pointer(host->proxy,
                                                            host_pointer->proxy);
@@ -6,6 +6,7 @@
 #include "sommelier-transform.h"  // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -59,8 +60,10 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
     host_surface = static_cast<sl_host_surface*>(
         wl_resource_get_user_data(surface_resource));
     host_surface->has_role = 1;
-    if (host_surface->contents_width && host_surface->contents_height)
+    if (host_surface->contents_width && host_surface->contents_height) {
+      sl_host_surface_render_sync(host_surface);
       wl_surface_commit(host_surface->proxy);
+    }
   }
 
   sl_transform_guest_to_host(host->seat->ctx, nullptr, &hsx, &hsy);
@@ -85,6 +88,14 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+static void sl_pointer_flush_motion(struct sl_host_pointer* host) {
+  if (!host->motion_pending)
+    return;
+  host->motion_pending = 0;
+  wl_pointer_send_motion(host->resource, host->pending_motion_time,
+                         host->pending_motion_x, host->pending_motion_y);
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -98,8 +109,12 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource == host->focus_resource)
     return;
 
-  if (host->focus_resource)
+  if (host->focus_resource) {
+    // Any coalesced motion belongs to the surface being left; deliver it
+    // before the leave event.
+    sl_pointer_flush_motion(host);
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
+  }
 
   wl_list_remove(&host->focus_resource_listener.link);
   wl_list_init(&host->focus_resource_listener.link);
@@ -167,7 +182,20 @@ static void sl_pointer_motion(void* data,
 
   sl_transform_host_to_guest_fixed(host->seat->ctx, host->focus_surface, &mx,
                                    &my);
-  wl_pointer_send_motion(host->resource, time, mx, my);
+
+  if (wl_pointer_get_version(pointer) < WL_POINTER_FRAME_SINCE_VERSION) {
+    // No frame events to coalesce against; forward immediately.
+    wl_pointer_send_motion(host->resource, time, mx, my);
+    return;
+  }
+
+  // Only the latest position within a frame matters, so hold it until the
+  // frame boundary. A 1kHz mouse then costs one guest-bound event per host
+  // frame instead of one per hardware report.
+  host->pending_motion_x = mx;
+  host->pending_motion_y = my;
+  host->pending_motion_time = time;
+  host->motion_pending = 1;
 }
 
 static void sl_pointer_button(void* data,
@@ -179,6 +207,9 @@ static void sl_pointer_button(void* data,
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  // Button edges must not be delayed, and the position they land on must be
+  // current; flush any coalesced motion first.
+  sl_pointer_flush_motion(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -205,6 +236,8 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  sl_pointer_flush_motion(host);
+
   // Many X apps (e.g. VS Code, Firefox, Chromium) only allow scrolls to happen
   // in multiples of 5 units. This value comes from the smooth scrolling
   // extension of X, which says that 5 smooth scroll units is equal to 1 tick of
@@ -282,6 +315,42 @@ static void sl_host_keyboard_release(struct wl_client* client,
 static const struct wl_keyboard_interface sl_keyboard_implementation = {
     sl_host_keyboard_release};
 
+// Rebuilds the shared keymap cache from the serialized keymap |data|: the
+// bytes are copied into a sealed memfd whose fd every client receives, and
+// the keymap is compiled once for all keyboards' modifier tracking.
+static void sl_keyboard_keymap_cache_update(struct sl_context* ctx,
+                                            const char* data,
+                                            uint32_t size) {
+  int fd = memfd_create("sommelier-keymap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  errno_assert(fd >= 0);
+
+  ssize_t written = write(fd, data, size);
+  errno_assert(written == static_cast<ssize_t>(size));
+
+  // Seal the memfd before handing it out, so no client can truncate or
+  // rewrite the pages under the others.
+  errno_assert(!fcntl(fd, F_ADD_SEALS,
+                      F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+                          F_SEAL_SEAL));
+
+  if (ctx->keymap_cache)
+    xkb_keymap_unref(ctx->keymap_cache);
+  if (ctx->keymap_cache_data)
+    munmap(ctx->keymap_cache_data, ctx->keymap_cache_size);
+  if (ctx->keymap_cache_fd >= 0)
+    close(ctx->keymap_cache_fd);
+
+  ctx->keymap_cache = xkb_keymap_new_from_string(
+      ctx->xkb_context, data, XKB_KEYMAP_FORMAT_TEXT_V1,
+      static_cast<xkb_keymap_compile_flags>(XKB_KEYMAP_COMPILE_NO_FLAGS));
+  assert(ctx->keymap_cache);
+  ctx->keymap_cache_fd = fd;
+  ctx->keymap_cache_size = size;
+  ctx->keymap_cache_data = static_cast<char*>(
+      mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0));
+  errno_assert(ctx->keymap_cache_data != MAP_FAILED);
+}
+
 static void sl_keyboard_keymap(void* data,
                                struct wl_keyboard* keyboard,
                                uint32_t format,
@@ -289,36 +358,44 @@ static void sl_keyboard_keymap(void* data,
                                uint32_t size) {
   struct sl_host_keyboard* host =
       static_cast<sl_host_keyboard*>(wl_keyboard_get_user_data(keyboard));
+  struct sl_context* ctx = host->seat->ctx;
 
-  wl_keyboard_send_keymap(host->resource, format, fd, size);
-
-  if (format == WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
-    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+    wl_keyboard_send_keymap(host->resource, format, fd, size);
+    close(fd);
+    return;
+  }
 
-    assert(data != MAP_FAILED);
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  assert(map != MAP_FAILED);
 
-    if (host->keymap)
-      xkb_keymap_unref(host->keymap);
+  // Every keyboard gets identical bytes from the host, so the keymap is
+  // compiled and copied into a sealed memfd once per host keymap change;
+  // all clients then share that one fd's pages instead of each holding a
+  // private copy.
+  if (!ctx->keymap_cache || ctx->keymap_cache_size != size ||
+      memcmp(ctx->keymap_cache_data, map, size) != 0) {
+    sl_keyboard_keymap_cache_update(ctx, static_cast<char*>(map), size);
+  }
 
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->ctx->xkb_context, static_cast<char*>(data),
-        XKB_KEYMAP_FORMAT_TEXT_V1,
-        static_cast<xkb_keymap_compile_flags>(XKB_KEYMAP_COMPILE_NO_FLAGS));
-    assert(host->keymap);
+  munmap(map, size);
+  close(fd);
 
-    munmap(data, size);
+  // The marshaller dups the fd it sends, so the cache keeps its own.
+  wl_keyboard_send_keymap(host->resource, format, ctx->keymap_cache_fd, size);
 
-    if (host->state)
-      xkb_state_unref(host->state);
-    host->state = xkb_state_new(host->keymap);
-    assert(host->state);
+  if (host->keymap)
+    xkb_keymap_unref(host->keymap);
+  host->keymap = xkb_keymap_ref(ctx->keymap_cache);
 
-    host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
-    host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
-    host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
-  }
+  if (host->state)
+    xkb_state_unref(host->state);
+  host->state = xkb_state_new(host->keymap);
+  assert(host->state);
 
-  close(fd);
+  host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
+  host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
+  host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
 }
 
 static void sl_keyboard_set_focus(struct sl_host_keyboard* host,
@@ -681,6 +758,10 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
   host_pointer->axis_delta[1] = wl_fixed_from_int(0);
   host_pointer->axis_discrete[0] = 0;
   host_pointer->axis_discrete[1] = 0;
+  host_pointer->pending_motion_x = wl_fixed_from_int(0);
+  host_pointer->pending_motion_y = wl_fixed_from_int(0);
+  host_pointer->pending_motion_time = 0;
+  host_pointer->motion_pending = 0;
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -748,10 +829,19 @@ static void sl_host_seat_get_host_keyboard(struct wl_client* client,
   wl_array_init(&host_keyboard->pressed_keys);
 
   if (host->seat->ctx->keyboard_extension) {
+    struct sl_keyboard_extension* keyboard_extension =
+        host->seat->ctx->keyboard_extension;
+    if (!keyboard_extension->internal) {
+      // Deferred by --lazy-init; this is the first point it's needed.
+      keyboard_extension->internal =
+          static_cast<zcr_keyboard_extension_v1*>(wl_registry_bind(
+              wl_display_get_registry(host->seat->ctx->display),
+              keyboard_extension->id, &zcr_keyboard_extension_v1_interface,
+              1));
+    }
     host_keyboard->extended_keyboard_proxy =
         zcr_keyboard_extension_v1_get_extended_keyboard(
-            host->seat->ctx->keyboard_extension->internal,
-            host_keyboard->proxy);
+            keyboard_extension->internal, host_keyboard->proxy);
   } else {
     host_keyboard->extended_keyboard_proxy = NULL;
   }
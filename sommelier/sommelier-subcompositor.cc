@@ -19,6 +19,11 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  // The surface holding the subsurface role, or NULL once it has been
+  // destroyed.  Tracked so set_sync/set_desync can keep the surface's
+  // commit batching state (sl_host_surface::sub_sync) up to date.
+  struct sl_host_surface* surface;
+  struct wl_listener surface_destroy_listener;
 };
 MAP_STRUCTS(wl_subsurface, sl_host_subsurface);
 
@@ -40,19 +45,59 @@ static void sl_subsurface_set_position(struct wl_client* client,
   wl_subsurface_set_position(host->proxy, ix, iy);
 }
 
+static void sl_subsurface_set_sync(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_subsurface* host =
+      static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
+
+  if (host->surface)
+    host->surface->sub_sync = true;
+  wl_subsurface_set_sync(host->proxy);
+}
+
+static void sl_subsurface_set_desync(struct wl_client* client,
+                                     struct wl_resource* resource) {
+  struct sl_host_subsurface* host =
+      static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
+
+  if (host->surface)
+    host->surface->sub_sync = false;
+  wl_subsurface_set_desync(host->proxy);
+}
+
 static const struct wl_subsurface_interface sl_subsurface_implementation = {
     sl_subsurface_destroy,
     sl_subsurface_set_position,
     ForwardRequest<wl_subsurface_place_above>,
     ForwardRequest<wl_subsurface_place_below>,
-    ForwardRequest<wl_subsurface_set_sync>,
-    ForwardRequest<wl_subsurface_set_desync>,
+    sl_subsurface_set_sync,
+    sl_subsurface_set_desync,
 };
 
+static void sl_subsurface_surface_destroyed(struct wl_listener* listener,
+                                            void* data) {
+  struct sl_host_subsurface* host;
+
+  host = wl_container_of(listener, host, surface_destroy_listener);
+  // The surface's batching links are unwound by sl_destroy_host_surface().
+  host->surface = NULL;
+  wl_list_remove(&host->surface_destroy_listener.link);
+  wl_list_init(&host->surface_destroy_listener.link);
+}
+
 static void sl_destroy_host_subsurface(struct wl_resource* resource) {
   struct sl_host_subsurface* host =
       static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
 
+  if (host->surface) {
+    if (host->surface->sub_parent) {
+      wl_list_remove(&host->surface->sub_link);
+      host->surface->sub_parent = NULL;
+    }
+    host->surface->sub_sync = false;
+    host->surface->sub_commit_pending = false;
+  }
+  wl_list_remove(&host->surface_destroy_listener.link);
   wl_subsurface_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   delete host;
@@ -87,6 +132,19 @@ static void sl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
   host_surface->has_role = 1;
+
+  host_subsurface->surface = host_surface;
+  wl_list_init(&host_subsurface->surface_destroy_listener.link);
+  host_subsurface->surface_destroy_listener.notify =
+      sl_subsurface_surface_destroyed;
+  wl_resource_add_destroy_listener(surface_resource,
+                                   &host_subsurface->surface_destroy_listener);
+
+  // Subsurfaces start out in synchronized mode; link the surface into its
+  // parent's tree so parent commits can batch the children.
+  host_surface->sub_parent = host_parent;
+  host_surface->sub_sync = true;
+  wl_list_insert(&host_parent->sub_surfaces, &host_surface->sub_link);
 }  // NOLINT(whitespace/indent)
 
 static const struct wl_subcompositor_interface sl_subcompositor_implementation =
@@ -4,11 +4,13 @@
 
 #include "sommelier-timing.h"  // NOLINT(build/include_directory)
 
-#include <fstream>
+#include <algorithm>
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #define NSEC_PER_SEC 1000000000
 #define NSEC_PER_USEC 1000
@@ -17,9 +19,16 @@ static inline int64_t timespec_to_ns(timespec* t) {
   return (int64_t)t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
 }
 
-// Records start time to calculate first delta.
+// Records start time to calculate first delta and starts the background
+// flusher thread that drains the ring buffer to the timing log.
 void Timing::RecordStartTime() {
   clock_gettime(CLOCK_REALTIME, &last_event);
+
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  if (!flusher_running) {
+    flusher_running = true;
+    std::thread(&Timing::FlusherRun, this).detach();
+  }
 }
 
 int64_t Timing::GetTime() {
@@ -31,72 +40,163 @@ int64_t Timing::GetTime() {
   return now - last;
 }
 
+// Publishes an action to the ring buffer.  Event thread only; never blocks.
+void Timing::Record(const BufferAction& action) {
+  uint64_t idx = head.load(std::memory_order_relaxed);
+
+  actions[idx % kMaxNumActions] = action;
+  head.store(idx + 1, std::memory_order_release);
+}
+
 // Create a new action, add info gained from attach call.
 void Timing::UpdateLastAttach(int surface_id, int buffer_id) {
-  actions[event_id % kMaxNumActions] =
-      BufferAction(GetTime(), surface_id, buffer_id, BufferAction::ATTACH);
-  event_id++;
+  Record(BufferAction(GetTime(), surface_id, buffer_id, BufferAction::ATTACH));
 }
 
 // Create a new action, add info gained from commit call.
 void Timing::UpdateLastCommit(int surface_id) {
-  actions[event_id % kMaxNumActions] = BufferAction(
-      GetTime(), surface_id, kUnknownBufferId, BufferAction::COMMIT);
-  event_id++;
+  Record(BufferAction(GetTime(), surface_id, kUnknownBufferId,
+                      BufferAction::COMMIT));
 }
 
 // Add a release action with release timing info.
 void Timing::UpdateLastRelease(int buffer_id) {
-  actions[event_id % kMaxNumActions] = BufferAction(
-      GetTime(), kUnknownSurfaceId, buffer_id, BufferAction::RELEASE);
-  event_id++;
+  Record(BufferAction(GetTime(), kUnknownSurfaceId, buffer_id,
+                      BufferAction::RELEASE));
 }
 
-// Output the recorded actions to the timing log file.
+// Requests a flush and latency summary from the flusher thread.  Called
+// from the event thread (SIGUSR1); returns without writing anything.
 void Timing::OutputLog() {
-  if (event_id == 0) {
-    std::cout << "No events in buffer, exiting" << std::endl;
-    return;
-  }
-
-  std::cout << "Writing buffer activity to the timing log file" << std::endl;
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  flush_requested = true;
+  flush_cond.notify_all();
+}
 
-  std::string output_filename =
-      std::string(filename) + "_set_" + std::to_string(saves);
+// Appends all published ring entries to the log file and updates the
+// latency samples.  Flusher thread only.
+void Timing::Drain() {
+  uint64_t published = head.load(std::memory_order_acquire);
+
+  // Entries more than one ring length behind have been overwritten by the
+  // producer; skip to the oldest one that is still intact.
+  if (published - tail > kMaxNumActions) {
+    uint64_t lost = published - tail - kMaxNumActions;
+    overwritten += lost;
+    tail += lost;
+  }
 
-  std::ofstream outfile(output_filename);
+  while (tail < published) {
+    const BufferAction& action = actions[tail % kMaxNumActions];
 
-  int start = 0;
-  int buf_size = event_id;
-  if (event_id >= kMaxNumActions) {
-    start = event_id % kMaxNumActions;
-    buf_size = kMaxNumActions;
-  }
+    clock_ns += action.delta_time;
 
-  outfile << "Type Surface_ID Buffer_ID Delta_Time" << std::endl;
-  for (int i = 0; i < buf_size; i++) {
-    int idx = (i + start) % kMaxNumActions;
     std::string type("?");
-    if (actions[idx].action_type == BufferAction::ATTACH) {
-      type = "a";
-    } else if (actions[idx].action_type == BufferAction::COMMIT) {
-      type = "c";
-    } else if (actions[idx].action_type == BufferAction::RELEASE) {
-      type = "r";
+    switch (action.action_type) {
+      case BufferAction::ATTACH: {
+        type = "a";
+        attach_time_by_surface[action.surface_id] = clock_ns;
+        attach_time_by_buffer[action.buffer_id] = clock_ns;
+        break;
+      }
+      case BufferAction::COMMIT: {
+        type = "c";
+        auto it = attach_time_by_surface.find(action.surface_id);
+        if (it != attach_time_by_surface.end()) {
+          commit_latencies[num_commit_latencies++ % kMaxLatencySamples] =
+              clock_ns - it->second;
+        }
+        break;
+      }
+      case BufferAction::RELEASE: {
+        type = "r";
+        auto it = attach_time_by_buffer.find(action.buffer_id);
+        if (it != attach_time_by_buffer.end()) {
+          release_latencies[num_release_latencies++ % kMaxLatencySamples] =
+              clock_ns - it->second;
+          attach_time_by_buffer.erase(it);
+        }
+        break;
+      }
+      default:
+        break;
     }
+
     outfile << type << " ";
-    outfile << actions[idx].surface_id << " ";
-    outfile << actions[idx].buffer_id << " ";
-    outfile << static_cast<double>(actions[idx].delta_time) / NSEC_PER_USEC
+    outfile << action.surface_id << " ";
+    outfile << action.buffer_id << " ";
+    outfile << static_cast<double>(action.delta_time) / NSEC_PER_USEC
             << std::endl;
+
+    tail++;
   }
+}
+
+static int64_t percentile(int64_t* samples, uint64_t count, int pct) {
+  if (!count)
+    return 0;
+
+  // The samples are a scratch copy, so reordering them in place is fine.
+  uint64_t rank = (count - 1) * pct / 100;
+  std::nth_element(samples, samples + rank, samples + count);
+  return samples[rank];
+}
 
+// Writes percentile attach->commit and attach->release latencies for the
+// most recent samples.  Flusher thread only.
+void Timing::WriteSummary() {
+  int64_t commits[kMaxLatencySamples];
+  int64_t releases[kMaxLatencySamples];
+  uint64_t num_commits = std::min<uint64_t>(num_commit_latencies,
+                                            kMaxLatencySamples);
+  uint64_t num_releases = std::min<uint64_t>(num_release_latencies,
+                                             kMaxLatencySamples);
+
+  std::copy(commit_latencies, commit_latencies + num_commits, commits);
+  std::copy(release_latencies, release_latencies + num_releases, releases);
+
+  std::stringstream summary;
+  summary << "Summary events=" << head.load(std::memory_order_acquire)
+          << " overwritten=" << overwritten;
+  summary << " attach_to_commit_us p50="
+          << percentile(commits, num_commits, 50) / NSEC_PER_USEC
+          << " p90=" << percentile(commits, num_commits, 90) / NSEC_PER_USEC
+          << " p99=" << percentile(commits, num_commits, 99) / NSEC_PER_USEC;
+  summary << " attach_to_release_us p50="
+          << percentile(releases, num_releases, 50) / NSEC_PER_USEC
+          << " p90=" << percentile(releases, num_releases, 90) / NSEC_PER_USEC
+          << " p99=" << percentile(releases, num_releases, 99) / NSEC_PER_USEC;
+
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
   std::stringstream nsec;
-  nsec << std::setw(9) << std::setfill('0') << last_event.tv_nsec;
-  outfile << "EndTime " << event_id - 1 << " " << last_event.tv_sec << "."
-          << nsec.str() << std::endl;
+  nsec << std::setw(9) << std::setfill('0') << now.tv_nsec;
+
+  outfile << summary.str() << std::endl;
+  outfile << "EndTime " << now.tv_sec << "." << nsec.str() << std::endl;
+  outfile.flush();
+
+  std::cout << summary.str() << std::endl;
+}
+
+void Timing::FlusherRun() {
+  outfile.open(std::string(filename), std::ofstream::app);
+  outfile << "Type Surface_ID Buffer_ID Delta_Time" << std::endl;
 
-  outfile.close();
-  std::cout << "Finished writing " << output_filename << std::endl;
-  ++saves;
+  while (true) {
+    bool summary_requested;
+    {
+      std::unique_lock<std::mutex> lock(flush_mutex);
+      // Wake periodically so the ring is drained well before it can wrap
+      // even without an explicit flush request.
+      flush_cond.wait_for(lock, std::chrono::seconds(1),
+                          [&] { return flush_requested; });
+      summary_requested = flush_requested;
+      flush_requested = false;
+    }
+
+    Drain();
+    if (summary_requested)
+      WriteSummary();
+  }
 }
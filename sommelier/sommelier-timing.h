@@ -5,12 +5,23 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_TIMING_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_TIMING_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
 #include <stdint.h>
 #include <time.h>
+#include <unordered_map>
 
 const int kUnknownBufferId = -1;
 const int kUnknownSurfaceId = -1;
 
+// Records attach/commit/release activity on the hot path and streams it to
+// the timing log from a background flusher thread.  The record path is a
+// single-producer (event thread) / single-consumer (flusher) ring buffer
+// with no locks, so recording never blocks frame forwarding; the flusher
+// drains the ring to disk continuously, which also means entries are no
+// longer dropped once the ring has wrapped.
 class Timing {
  public:
   explicit Timing(const char* fname) : filename(fname) {}
@@ -18,11 +29,17 @@ class Timing {
   void UpdateLastAttach(int surface_id, int buffer_id);
   void UpdateLastCommit(int surface_id);
   void UpdateLastRelease(int buffer_id);
+
+  // Requests an asynchronous flush of everything recorded so far plus a
+  // latency summary (percentile attach->commit and attach->release times).
+  // Returns immediately; the flusher thread does the work.
   void OutputLog();
 
  private:
   // 10 min * 60 sec/min * 60 frames/sec * 3 actions/frame = 108000 actions
   static const int kMaxNumActions = 10 * 60 * 60 * 3;
+  // Most recent latency samples retained for the summary percentiles.
+  static const int kMaxLatencySamples = 4096;
 
   struct BufferAction {
     enum Type { UNKNOWN, ATTACH, COMMIT, RELEASE };
@@ -41,11 +58,38 @@ class Timing {
         : delta_time(dt), surface_id(sid), buffer_id(bid), action_type(type) {}
   };
 
+  void Record(const BufferAction& action);
+  void FlusherRun();
+  void Drain();
+  void WriteSummary();
+
+  // Ring buffer.  The event thread writes the entry, then publishes it by
+  // advancing |head|; the flusher owns |tail|.  If the flusher falls more
+  // than kMaxNumActions behind, overwritten entries are counted in
+  // |overwritten| and skipped.
   BufferAction actions[kMaxNumActions];
-  int event_id = 0;
-  int saves = 0;
+  std::atomic<uint64_t> head{0};
+  uint64_t tail = 0;
+  uint64_t overwritten = 0;
+
   const char* filename;
-  timespec last_event;
+  timespec last_event;  // Event thread only.
+
+  // Flusher thread coordination.
+  std::mutex flush_mutex;
+  std::condition_variable flush_cond;
+  bool flush_requested = false;
+  bool flusher_running = false;
+
+  // Flusher-owned log and latency state.
+  std::ofstream outfile;
+  int64_t clock_ns = 0;
+  std::unordered_map<int, int64_t> attach_time_by_surface;
+  std::unordered_map<int, int64_t> attach_time_by_buffer;
+  int64_t commit_latencies[kMaxLatencySamples];
+  int64_t release_latencies[kMaxLatencySamples];
+  uint64_t num_commit_latencies = 0;
+  uint64_t num_release_latencies = 0;
 
   int64_t GetTime();
 };      // class Timing
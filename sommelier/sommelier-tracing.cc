@@ -5,9 +5,13 @@
 #include "sommelier-tracing.h"  // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <atomic>
 #include <fcntl.h>
 #include <memory>
 #include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -33,6 +37,82 @@
 // TODO(jbates): support ARM CPU counter
 #endif
 
+namespace {
+
+// Kept in sync with PERFETTO_DEFINE_CATEGORIES in sommelier-tracing.h; the
+// trailing "other" slot also absorbs unknown category strings.
+const char* const kTraceCategories[SL_TRACE_NUM_CATEGORIES] = {
+    "surface", "display",  "drm",  "shell", "shm",
+    "viewport", "sync", "x11wm", "gaming", "other"};
+
+// Aggregates for unsampled spans, updated from the event loop and the
+// render thread; relaxed atomics, since the dump only needs totals.
+std::atomic<uint64_t> trace_span_count[SL_TRACE_NUM_CATEGORIES];
+std::atomic<uint64_t> trace_span_total_ns[SL_TRACE_NUM_CATEGORIES];
+
+}  // namespace
+
+uint32_t sl_trace_sample_rates[SL_TRACE_NUM_CATEGORIES];
+thread_local uint32_t sl_trace_sample_countdown[SL_TRACE_NUM_CATEGORIES];
+
+int sl_trace_category_index(const char* category) {
+  for (int i = 0; i < SL_TRACE_NUM_CATEGORIES; i++) {
+    if (!strcmp(category, kTraceCategories[i]))
+      return i;
+  }
+  return SL_TRACE_NUM_CATEGORIES - 1;
+}
+
+void sl_trace_sample_init(const char* spec) {
+  char* copy = strdup(spec);
+  char* saveptr = NULL;
+
+  for (char* entry = strtok_r(copy, ",", &saveptr); entry;
+       entry = strtok_r(NULL, ",", &saveptr)) {
+    char* sep = strchr(entry, '=');
+    if (!sep) {
+      fprintf(stderr, "error: malformed trace sample entry '%s'\n", entry);
+      continue;
+    }
+    *sep = '\0';
+    uint32_t rate = strtoul(sep + 1, NULL, 10);
+    if (!*entry) {
+      for (int i = 0; i < SL_TRACE_NUM_CATEGORIES; i++)
+        sl_trace_sample_rates[i] = rate;
+      continue;
+    }
+    int i;
+    for (i = 0; i < SL_TRACE_NUM_CATEGORIES; i++) {
+      if (!strcmp(entry, kTraceCategories[i])) {
+        sl_trace_sample_rates[i] = rate;
+        break;
+      }
+    }
+    if (i == SL_TRACE_NUM_CATEGORIES)
+      fprintf(stderr, "error: unknown trace category '%s'\n", entry);
+  }
+  free(copy);
+}
+
+void sl_trace_span_record(int category, int64_t duration_ns) {
+  trace_span_count[category].fetch_add(1, std::memory_order_relaxed);
+  if (duration_ns > 0) {
+    trace_span_total_ns[category].fetch_add(duration_ns,
+                                            std::memory_order_relaxed);
+  }
+}
+
+void sl_trace_stats_dump(int fd) {
+  for (int i = 0; i < SL_TRACE_NUM_CATEGORIES; i++) {
+    dprintf(fd, "trace_%s_spans %lu\n", kTraceCategories[i],
+            static_cast<unsigned long>(
+                trace_span_count[i].load(std::memory_order_relaxed)));
+    dprintf(fd, "trace_%s_ns %lu\n", kTraceCategories[i],
+            static_cast<unsigned long>(
+                trace_span_total_ns[i].load(std::memory_order_relaxed)));
+  }
+}
+
 #if defined(PERFETTO_TRACING)
 PERFETTO_TRACK_EVENT_STATIC_STORAGE();
 
@@ -5,6 +5,84 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_TRACING_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_TRACING_H_
 
+#include <stdint.h>
+
+#include "sommelier-counters.h"  // NOLINT(build/include_directory)
+
+// Sampled tracing: full perfetto events for hot paths (the per-rect copy
+// loop, input callbacks) distort the latency being measured, so categories
+// can be sampled with --trace-sample=CATEGORY=N, keeping 1 of every N
+// events.  Unsampled spans -- and all spans in builds without perfetto --
+// still feed per-category count/total-ns aggregates, reported through the
+// stats socket alongside the performance counters.
+
+// Number of categories in PERFETTO_DEFINE_CATEGORIES below; unknown
+// category strings map to the trailing "other" slot.
+#define SL_TRACE_NUM_CATEGORIES 10
+
+// Sampling rates, indexed by category: keep 1 of every rate events; 0 and
+// 1 both mean every event.  Written once at startup, read per event.
+extern uint32_t sl_trace_sample_rates[SL_TRACE_NUM_CATEGORIES];
+extern thread_local uint32_t
+    sl_trace_sample_countdown[SL_TRACE_NUM_CATEGORIES];
+
+// Resolves a category name to its index; called once per TRACE_EVENT site
+// through a function-local static.
+int sl_trace_category_index(const char* category);
+
+// Parses a --trace-sample spec like "surface=64,x11wm=16".  An entry
+// without a name ("=N") applies to every category.
+void sl_trace_sample_init(const char* spec);
+
+// Folds an unsampled span into its category's aggregates.
+void sl_trace_span_record(int category, int64_t duration_ns);
+
+// Writes the aggregates to |fd| as "name value" lines, counters style.
+void sl_trace_stats_dump(int fd);
+
+// Constant-time sampling decision: one thread-local countdown per category,
+// so hot paths pay an array load and a decrement per event.
+static inline bool sl_trace_sample(int category) {
+  uint32_t rate = sl_trace_sample_rates[category];
+  if (rate <= 1)
+    return true;
+  if (sl_trace_sample_countdown[category] == 0) {
+    sl_trace_sample_countdown[category] = rate - 1;
+    return true;
+  }
+  sl_trace_sample_countdown[category]--;
+  return false;
+}
+
+// Scoped bookkeeping behind TRACE_EVENT: a sampled span closes its perfetto
+// slice on destruction, an unsampled one records its duration in the
+// aggregates instead.
+template <typename F>
+class SlTraceSpan {
+ public:
+  SlTraceSpan(int category, bool sampled, F end)
+      : category_(category),
+        sampled_(sampled),
+        start_ns_(sampled ? 0 : sl_counters_now_ns()),
+        end_(end) {}
+  ~SlTraceSpan() {
+    if (sampled_)
+      end_();
+    else
+      sl_trace_span_record(category_, sl_counters_now_ns() - start_ns_);
+  }
+
+ private:
+  int category_;
+  bool sampled_;
+  int64_t start_ns_;
+  F end_;
+};
+
+#define SL_TRACE_UID2(a, b) a##b
+#define SL_TRACE_UID1(a, b) SL_TRACE_UID2(a, b)
+#define SL_TRACE_UID(a) SL_TRACE_UID1(a, __LINE__)
+
 #if defined(PERFETTO_TRACING)
 #include <perfetto.h>
 #include <xcb/xcb.h>
@@ -43,8 +121,30 @@ void perfetto_annotate_cardinal_list(const perfetto::EventContext& perfetto,
                                      xcb_get_property_reply_t* reply);
 void perfetto_annotate_time_sync(const perfetto::EventContext& perfetto);
 
+// Replace perfetto's TRACE_EVENT with the sampling wrapper: a sampled event
+// opens a real perfetto slice, an unsampled one only updates the
+// aggregates.
+#undef TRACE_EVENT
+#define TRACE_EVENT(category, name, ...)                          \
+  static const int SL_TRACE_UID(sl_trace_cat) =                   \
+      sl_trace_category_index(category);                          \
+  const bool SL_TRACE_UID(sl_trace_sampled) =                     \
+      sl_trace_sample(SL_TRACE_UID(sl_trace_cat));                \
+  if (SL_TRACE_UID(sl_trace_sampled)) {                           \
+    TRACE_EVENT_BEGIN(category, name, ##__VA_ARGS__);             \
+  }                                                               \
+  SlTraceSpan SL_TRACE_UID(sl_trace_span)(                        \
+      SL_TRACE_UID(sl_trace_cat), SL_TRACE_UID(sl_trace_sampled), \
+      [] { TRACE_EVENT_END(category); });
+
 #else
-#define TRACE_EVENT(category, name, ...)
+// Without perfetto the spans still feed the aggregates, so production
+// builds keep count/total-ns visibility per category at counter cost.
+#define TRACE_EVENT(category, name, ...)                     \
+  static const int SL_TRACE_UID(sl_trace_cat) =              \
+      sl_trace_category_index(category);                     \
+  SlTraceSpan SL_TRACE_UID(sl_trace_span)(                   \
+      SL_TRACE_UID(sl_trace_cat), false, [] {});
 #endif
 
 void initialize_tracing(bool in_process_backend, bool system_backend);
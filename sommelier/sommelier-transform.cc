@@ -198,6 +198,51 @@ void sl_transform_damage_coord(struct sl_context* ctx,
   }
 }
 
+void sl_transform_damage_rects(struct sl_context* ctx,
+                               const struct sl_host_surface* surface,
+                               double buffer_scalex,
+                               double buffer_scaley,
+                               pixman_box32_t* rects,
+                               int count) {
+  if (ctx->use_direct_scale) {
+    double scalex, scaley;
+
+    sl_transform_get_scale_factors(ctx, surface, &scalex, &scaley);
+
+    // Resolve the reciprocals once so the per-rect work is multiplies only.
+    double rscalex = 1.0 / (scalex * buffer_scalex);
+    double rscaley = 1.0 / (scaley * buffer_scaley);
+
+    for (int i = 0; i < count; i++) {
+      rects[i].x1 = static_cast<int32_t>(
+          trunc(static_cast<double>(rects[i].x1) * rscalex));
+      rects[i].y1 = static_cast<int32_t>(
+          trunc(static_cast<double>(rects[i].y1) * rscaley));
+      rects[i].x2 = static_cast<int32_t>(
+          trunc(static_cast<double>(rects[i].x2) * rscalex));
+      rects[i].y2 = static_cast<int32_t>(
+          trunc(static_cast<double>(rects[i].y2) * rscaley));
+    }
+  } else {
+    double rsx = 1.0 / (buffer_scalex * ctx->scale);
+    double rsy = 1.0 / (buffer_scaley * ctx->scale);
+
+    for (int i = 0; i < count; i++) {
+      // Enclosing rect after scaling and outset by one pixel to account for
+      // potential filtering, as in sl_transform_damage_coord().
+      int64_t x1 = rects[i].x1;
+      int64_t y1 = rects[i].y1;
+      int64_t x2 = rects[i].x2;
+      int64_t y2 = rects[i].y2;
+
+      rects[i].x1 = static_cast<int32_t>(MAX(MIN_SIZE, x1 - 1) * rsx);
+      rects[i].y1 = static_cast<int32_t>(MAX(MIN_SIZE, y1 - 1) * rsy);
+      rects[i].x2 = static_cast<int32_t>(ceil(MIN(x2 + 1, MAX_SIZE) * rsx));
+      rects[i].y2 = static_cast<int32_t>(ceil(MIN(y2 + 1, MAX_SIZE) * rsy));
+    }
+  }
+}
+
 void sl_transform_host_to_guest(struct sl_context* ctx,
                                 struct sl_host_surface* surface,
                                 int32_t* x,
@@ -106,6 +106,16 @@ void sl_transform_damage_coord(struct sl_context* ctx,
                                int64_t* x2,
                                int64_t* y2);
 
+// Batch variant of sl_transform_damage_coord(). The scale factors and their
+// reciprocals are resolved once for the whole array, then |count| rects are
+// transformed in place with multiplies only.
+void sl_transform_damage_rects(struct sl_context* ctx,
+                               const struct sl_host_surface* surface,
+                               double buffer_scalex,
+                               double buffer_scaley,
+                               pixman_box32_t* rects,
+                               int count);
+
 // Basic Transformations
 // The following transformations fall under the basic type
 
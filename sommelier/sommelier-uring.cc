@@ -0,0 +1,228 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-uring.h"   // NOLINT(build/include_directory)
+#include "sommelier-tracing.h"  // NOLINT(build/include_directory)
+
+#include <assert.h>
+#include <errno.h>
+#include <liburing.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+
+#include "virtualization/wayland_channel.h"  // NOLINT(build/include_directory)
+
+// Number of submission queue entries in the shared ring.  Each transfer has
+// at most one read and one write in flight, so this comfortably covers many
+// concurrent clipboard/drag-and-drop transfers.
+#define URING_QUEUE_DEPTH 64
+
+/*
+ * A pipe-to-pipe proxy driven by the shared io_uring.  Two multi-page
+ * buffers are kept in rotation: while one is being written out, the next
+ * read fills the other, so the pipe stays busy in both directions and a
+ * large payload moves in MAX_BUFFER_SIZE chunks with batched submissions
+ * instead of a read()/write() syscall pair per page-sized poll wakeup.
+ */
+struct sl_uring_transfer {
+  int read_fd;
+  int write_fd;
+
+  struct {
+    uint8_t data[MAX_BUFFER_SIZE];
+    size_t len;
+    size_t offset;
+    bool full;
+  } bufs[2];
+
+  // Buffer index the outstanding read/write targets, or -1 when idle.
+  int read_buf;
+  int write_buf;
+
+  // No more data will be read, due to EOF or an error on either fd.
+  bool finished;
+};
+
+static struct io_uring uring_ring;
+static int uring_state = -1;  // -1: unprobed, 0: unavailable, 1: ready
+
+// Registered with the event loop on first use; like the ring itself, it
+// lives for the lifetime of the process.
+static struct wl_event_source* uring_event_source = NULL;
+
+// Completions carry the transfer pointer with the low bit distinguishing
+// reads from writes; the allocation is more than 2-byte aligned.
+#define URING_OP_WRITE 0x1u
+
+static void sl_uring_submit_read(struct sl_uring_transfer* transfer, int buf) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&uring_ring);
+
+  assert(sqe);
+  io_uring_prep_read(sqe, transfer->read_fd, transfer->bufs[buf].data,
+                     sizeof(transfer->bufs[buf].data), 0);
+  io_uring_sqe_set_data(sqe, transfer);
+  transfer->read_buf = buf;
+}
+
+static void sl_uring_submit_write(struct sl_uring_transfer* transfer, int buf) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&uring_ring);
+
+  assert(sqe);
+  io_uring_prep_write(sqe, transfer->write_fd,
+                      transfer->bufs[buf].data + transfer->bufs[buf].offset,
+                      transfer->bufs[buf].len - transfer->bufs[buf].offset, 0);
+  io_uring_sqe_set_data(
+      sqe, (void*)((uintptr_t)transfer | URING_OP_WRITE));
+  transfer->write_buf = buf;
+}
+
+static void sl_uring_transfer_maybe_destroy(struct sl_uring_transfer* transfer) {
+  // Outstanding operations still reference the buffers; the transfer is
+  // reaped once the last completion for it drains.
+  if (transfer->read_buf >= 0 || transfer->write_buf >= 0)
+    return;
+
+  close(transfer->read_fd);
+  close(transfer->write_fd);
+  delete transfer;
+}
+
+static void sl_uring_handle_read_done(struct sl_uring_transfer* transfer,
+                                      int res) {
+  int buf = transfer->read_buf;
+
+  transfer->read_buf = -1;
+
+  if (transfer->finished) {
+    sl_uring_transfer_maybe_destroy(transfer);
+    return;
+  }
+
+  if (res <= 0) {
+    // EOF or a read error: let any buffered data drain, then stop.
+    transfer->finished = true;
+    if (transfer->write_buf < 0 && !transfer->bufs[0].full &&
+        !transfer->bufs[1].full) {
+      sl_uring_transfer_maybe_destroy(transfer);
+    }
+    return;
+  }
+
+  transfer->bufs[buf].len = res;
+  transfer->bufs[buf].offset = 0;
+  transfer->bufs[buf].full = true;
+
+  if (transfer->write_buf < 0)
+    sl_uring_submit_write(transfer, buf);
+
+  // Keep reading into the other buffer while this one drains.
+  int other = buf ^ 1;
+  if (!transfer->bufs[other].full)
+    sl_uring_submit_read(transfer, other);
+}
+
+static void sl_uring_handle_write_done(struct sl_uring_transfer* transfer,
+                                       int res) {
+  int buf = transfer->write_buf;
+
+  transfer->write_buf = -1;
+
+  if (res < 0 && !transfer->finished) {
+    // Nobody left to deliver to; stop reading and drain.
+    transfer->finished = true;
+    transfer->bufs[0].full = false;
+    transfer->bufs[1].full = false;
+    sl_uring_transfer_maybe_destroy(transfer);
+    return;
+  }
+
+  if (res >= 0) {
+    transfer->bufs[buf].offset += res;
+    if (transfer->bufs[buf].offset < transfer->bufs[buf].len) {
+      // Short write: continue from the new offset.
+      sl_uring_submit_write(transfer, buf);
+      return;
+    }
+  }
+
+  transfer->bufs[buf].full = false;
+
+  int other = buf ^ 1;
+  if (transfer->bufs[other].full) {
+    sl_uring_submit_write(transfer, other);
+  } else if (transfer->finished) {
+    sl_uring_transfer_maybe_destroy(transfer);
+    return;
+  }
+
+  // The drained buffer is free for the next read, unless one is running.
+  if (!transfer->finished && transfer->read_buf < 0)
+    sl_uring_submit_read(transfer, buf);
+}
+
+static int sl_handle_uring_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("other", "sl_handle_uring_event");
+  struct io_uring_cqe* cqe;
+  bool submitted = false;
+
+  while (!io_uring_peek_cqe(&uring_ring, &cqe)) {
+    uintptr_t tag = (uintptr_t)io_uring_cqe_get_data(cqe);
+    struct sl_uring_transfer* transfer =
+        (struct sl_uring_transfer*)(tag & ~URING_OP_WRITE);
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&uring_ring, cqe);
+
+    if (tag & URING_OP_WRITE)
+      sl_uring_handle_write_done(transfer, res);
+    else
+      sl_uring_handle_read_done(transfer, res);
+    submitted = true;
+  }
+
+  if (submitted)
+    io_uring_submit(&uring_ring);
+
+  return 1;
+}
+
+bool sl_uring_supported(void) {
+  if (uring_state < 0)
+    uring_state = io_uring_queue_init(URING_QUEUE_DEPTH, &uring_ring, 0) ? 0
+                                                                         : 1;
+
+  return uring_state == 1;
+}
+
+bool sl_uring_transfer_create(struct wl_event_loop* event_loop,
+                              int read_fd,
+                              int write_fd) {
+  if (!sl_uring_supported())
+    return false;
+
+  if (!uring_event_source) {
+    uring_event_source =
+        wl_event_loop_add_fd(event_loop, uring_ring.ring_fd, WL_EVENT_READABLE,
+                             sl_handle_uring_event, NULL);
+    if (!uring_event_source)
+      return false;
+  }
+
+  struct sl_uring_transfer* transfer = new sl_uring_transfer();
+  transfer->read_fd = read_fd;
+  transfer->write_fd = write_fd;
+  transfer->read_buf = -1;
+  transfer->write_buf = -1;
+  transfer->finished = false;
+  transfer->bufs[0].full = false;
+  transfer->bufs[1].full = false;
+
+  sl_uring_submit_read(transfer, 0);
+  io_uring_submit(&uring_ring);
+
+  return true;
+}
@@ -0,0 +1,25 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_URING_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_URING_H_
+
+struct wl_event_loop;
+
+// Returns true if io_uring is available on the running kernel.  The first
+// call probes by creating the shared ring; the result is cached.
+bool sl_uring_supported(void);
+
+// Starts proxying data from |read_fd| to |write_fd| on the shared io_uring,
+// with double-buffered multi-page reads and writes so a large transfer costs
+// a handful of submissions instead of one read()/write() pair per poll
+// wakeup.  Both fds are owned by the transfer and closed when it completes.
+//
+// Returns false if io_uring is unavailable or the transfer could not be
+// queued; the caller should fall back to its wl_event_loop implementation.
+bool sl_uring_transfer_create(struct wl_event_loop* event_loop,
+                              int read_fd,
+                              int write_fd);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_URING_H_
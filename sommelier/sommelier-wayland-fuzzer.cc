@@ -19,6 +19,7 @@
 class FuzzChannel : public WaylandChannel {
  private:
   int recv_fd = -1;
+  uint8_t recv_buffer[DEFAULT_BUFFER_SIZE];
 
  public:
   int send_fd = -1;
@@ -55,14 +56,12 @@ class FuzzChannel : public WaylandChannel {
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override {
-    uint8_t* buffer = static_cast<uint8_t*>(malloc(DEFAULT_BUFFER_SIZE));
-    int bytes = recv(receive.channel_fd, buffer, DEFAULT_BUFFER_SIZE, 0);
+    int bytes = recv(receive.channel_fd, recv_buffer, DEFAULT_BUFFER_SIZE, 0);
     if (bytes < 0) {
-      free(buffer);
       return -errno;
     }
 
-    receive.data = buffer;
+    receive.data = recv_buffer;
     receive.data_size = bytes;
     receive.num_fds = 0;
 
@@ -36,6 +36,7 @@ sl_window::sl_window(struct sl_context* ctx,
       height(height),
       border_width(border_width) {
   wl_list_insert(&ctx->unpaired_windows, &link);
+  ctx->window_index[id] = this;
   pixman_region32_init(&shape_rectangles);
 }
 
@@ -45,6 +46,15 @@ sl_window::~sl_window() {
     ctx->needs_set_input_focus = 1;
   }
 
+  ctx->window_index.erase(id);
+  if (frame_id != XCB_WINDOW_NONE)
+    ctx->window_index.erase(frame_id);
+  if (indexed_surface_id) {
+    auto it = ctx->surface_window_index.find(indexed_surface_id);
+    if (it != ctx->surface_window_index.end() && it->second == this)
+      ctx->surface_window_index.erase(it);
+  }
+
   free(name);
   free(clazz);
   free(startup_id);
@@ -168,8 +178,10 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 
 void sl_commit(struct sl_window* window, struct sl_host_surface* host_surface) {
   if (sl_process_pending_configure_acks(window, host_surface)) {
-    if (host_surface)
+    if (host_surface) {
+      sl_host_surface_render_sync(host_surface);
       wl_surface_commit(host_surface->proxy);
+    }
   }
 }
 
@@ -330,6 +342,56 @@ static void sl_internal_xdg_toplevel_close(void* data,
 
 static const struct xdg_toplevel_listener sl_internal_xdg_toplevel_listener = {
     sl_internal_xdg_toplevel_configure, sl_internal_xdg_toplevel_close};
+
+static void sl_internal_aura_surface_occlusion_changed(
+    void* data,
+    struct zaura_surface* aura_surface,
+    wl_fixed_t occlusion_fraction,
+    uint32_t occlusion_reason) {
+  // The coarse occlusion_state_changed event below is what drives commit
+  // suppression; the fraction updates carry no extra information for it.
+}
+
+static void sl_internal_aura_surface_lock_frame_normal(
+    void* data, struct zaura_surface* aura_surface) {}
+
+static void sl_internal_aura_surface_unlock_frame_normal(
+    void* data, struct zaura_surface* aura_surface) {}
+
+static void sl_internal_aura_surface_occlusion_state_changed(
+    void* data,
+    struct zaura_surface* aura_surface,
+    uint32_t mode) {
+  TRACE_EVENT("surface", "sl_internal_aura_surface_occlusion_state_changed");
+  struct sl_window* window = static_cast<sl_window*>(data);
+
+  // Minimized windows report HIDDEN, fully covered ones OCCLUDED; in both
+  // cases nothing the client draws can be seen, so commit staging is
+  // suppressed until the surface is exposed again.
+  bool hidden = mode == ZAURA_SURFACE_OCCLUSION_STATE_OCCLUDED ||
+                mode == ZAURA_SURFACE_OCCLUSION_STATE_HIDDEN;
+
+  if (window->paired_surface)
+    sl_host_surface_set_hidden(window->paired_surface, hidden);
+}
+
+static void sl_internal_aura_surface_desk_changed(
+    void* data, struct zaura_surface* aura_surface, int32_t state) {}
+
+static void sl_internal_aura_surface_start_throttle(
+    void* data, struct zaura_surface* aura_surface) {}
+
+static void sl_internal_aura_surface_end_throttle(
+    void* data, struct zaura_surface* aura_surface) {}
+
+static const struct zaura_surface_listener sl_internal_aura_surface_listener = {
+    sl_internal_aura_surface_occlusion_changed,
+    sl_internal_aura_surface_lock_frame_normal,
+    sl_internal_aura_surface_unlock_frame_normal,
+    sl_internal_aura_surface_occlusion_state_changed,
+    sl_internal_aura_surface_desk_changed,
+    sl_internal_aura_surface_start_throttle,
+    sl_internal_aura_surface_end_throttle};
 void sl_update_application_id(struct sl_context* ctx,
                               struct sl_window* window) {
   TRACE_EVENT("other", "sl_update_application_id");
@@ -382,9 +444,27 @@ void sl_window_update(struct sl_window* window) {
     wl_list_remove(&window->link);
     wl_list_insert(&ctx->unpaired_windows, &window->link);
     window->unpaired = 1;
+    // The occlusion updates driving commit suppression stop with the
+    // pairing; don't leave the surface stuck hidden.
+    if (window->paired_surface)
+      sl_host_surface_set_hidden(window->paired_surface, false);
     window->paired_surface = NULL;
   }
 
+  // Keep the surface id index in sync with list membership.
+  if (window->indexed_surface_id &&
+      (window->unpaired ||
+       window->indexed_surface_id != window->host_surface_id)) {
+    auto it = ctx->surface_window_index.find(window->indexed_surface_id);
+    if (it != ctx->surface_window_index.end() && it->second == window)
+      ctx->surface_window_index.erase(it);
+    window->indexed_surface_id = 0;
+  }
+  if (!window->unpaired && window->host_surface_id) {
+    ctx->surface_window_index[window->host_surface_id] = window;
+    window->indexed_surface_id = window->host_surface_id;
+  }
+
   if (!host_resource) {
     if (window->aura_surface) {
       zaura_surface_destroy(window->aura_surface);
@@ -493,6 +573,16 @@ void sl_window_update(struct sl_window* window) {
     if (!window->aura_surface) {
       window->aura_surface = zaura_shell_get_aura_surface(
           ctx->aura_shell->internal, host_surface->proxy);
+
+      // Drive commit suppression from the host's occlusion state; the
+      // fraction events from older hosts lack the coarse hidden/occluded
+      // signal, so tracking is only requested where the state event exists.
+      if (ctx->aura_shell->version >=
+          ZAURA_SURFACE_OCCLUSION_STATE_CHANGED_SINCE_VERSION) {
+        zaura_surface_add_listener(window->aura_surface,
+                                   &sl_internal_aura_surface_listener, window);
+        zaura_surface_set_occlusion_tracking(window->aura_surface);
+      }
     }
 
     zaura_surface_set_frame(window->aura_surface,
@@ -585,6 +675,7 @@ void sl_window_update(struct sl_window* window) {
 #ifdef COMMIT_LOOP_FIX
   sl_commit(window, host_surface);
 #else
+  sl_host_surface_render_sync(host_surface);
   wl_surface_commit(host_surface->proxy);
 #endif
 
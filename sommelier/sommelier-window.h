@@ -45,8 +45,14 @@ struct sl_window {
   xcb_window_t id = XCB_WINDOW_NONE;
   xcb_window_t frame_id = XCB_WINDOW_NONE;
   uint32_t host_surface_id = 0;
+  // Key under which this window is registered in ctx->surface_window_index,
+  // or 0 when it is not registered (unpaired or no surface).
+  uint32_t indexed_surface_id = 0;
   int unpaired = 1;
   bool shaped = false;
+  // Bumped whenever shape_rectangles changes, so output buffers stamped out
+  // with an old shape can detect that they need full regeneration.
+  uint64_t shape_generation = 1;
   int x = 0;
   int y = 0;
   int width = 0;
@@ -11,32 +11,31 @@
 
 static void sl_clear_shape_region(sl_window* window) {
   window->shaped = false;
+  window->shape_generation++;
   pixman_region32_fini(&window->shape_rectangles);
 }
 
-static void sl_attach_shape_region(struct sl_context* ctx,
-                                   xcb_window_t window) {
+static void sl_collect_shape_rectangles_reply(struct sl_context* ctx,
+                                              void* data,
+                                              uint32_t window_id) {
+  xcb_shape_get_rectangles_reply_t* reply =
+      static_cast<xcb_shape_get_rectangles_reply_t*>(data);
   sl_window* sl_window = nullptr;
-  xcb_shape_get_rectangles_reply_t* reply;
   int i;
 
-  sl_window = sl_lookup_window(ctx, window);
-  if (!sl_window)
-    return;
-
-  reply = xcb_shape_get_rectangles_reply(
-      ctx->connection,
-      xcb_shape_get_rectangles(ctx->connection, window, XCB_SHAPE_SK_BOUNDING),
-      NULL);
-
-  if (!reply)
+  sl_window = sl_lookup_window(ctx, window_id);
+  if (!sl_window || !reply) {
+    free(reply);
     return;
+  }
 
   int nrects = xcb_shape_get_rectangles_rectangles_length(reply);
   xcb_rectangle_t* rects = xcb_shape_get_rectangles_rectangles(reply);
 
-  if (!rects || nrects <= 0)
+  if (!rects || nrects <= 0) {
+    free(reply);
     return;
+  }
 
   pixman_box32_t* boxes =
       static_cast<pixman_box32_t*>(calloc(sizeof(pixman_box32_t), nrects));
@@ -54,6 +53,7 @@ static void sl_attach_shape_region(struct sl_context* ctx,
     boxes[i].y2 = rects[i].y + rects[i].height;
   }
 
+  pixman_region32_fini(&sl_window->shape_rectangles);
   pixman_region32_init_rects(&sl_window->shape_rectangles, boxes, nrects);
 
   free(boxes);
@@ -61,6 +61,22 @@ static void sl_attach_shape_region(struct sl_context* ctx,
   sl_window->shaped = true;
 }
 
+static void sl_attach_shape_region(struct sl_context* ctx,
+                                   xcb_window_t window) {
+  sl_window* sl_window = sl_lookup_window(ctx, window);
+  if (!sl_window)
+    return;
+
+  // Keep the region valid while the reply is in flight; the collection
+  // callback replaces it with the fetched rectangles.
+  pixman_region32_init(&sl_window->shape_rectangles);
+
+  xcb_shape_get_rectangles_cookie_t cookie =
+      xcb_shape_get_rectangles(ctx->connection, window, XCB_SHAPE_SK_BOUNDING);
+  sl_xcb_collect_reply(ctx, cookie.sequence, sl_collect_shape_rectangles_reply,
+                       window);
+}
+
 void sl_handle_shape_notify(struct sl_context* ctx,
                             struct xcb_shape_notify_event_t* event) {
   sl_window* window = nullptr;
@@ -133,11 +149,12 @@ pixman_format_code_t sl_pixman_format_for_shm_format(uint32_t shm_format) {
 
 void sl_xshape_generate_argb_image(struct sl_context* ctx,
                                    pixman_region32_t* shape,
+                                   pixman_region32_t* damage,
                                    struct sl_mmap* src_mmap,
                                    pixman_image_t* dst_image,
                                    uint32_t src_shm_format) {
-  int buf_width, buf_height, nrects;
-  pixman_region32_t intersect_rects;
+  int buf_width, buf_height, nrects, nclear;
+  pixman_region32_t clear_rects, intersect_rects;
   pixman_image_t* src;
 
   assert(ctx);
@@ -155,10 +172,18 @@ void sl_xshape_generate_argb_image(struct sl_context* ctx,
   // any OOB accesses
   // In addition, we can assume the dimensions of the dst_image is
   // the same size as the input image
+  //
+  // If |damage| is non-NULL, only that part of the image is regenerated;
+  // the rest of dst_image is assumed to still hold a stamp out of the same
+  // shape. Callers must pass NULL (or full-buffer damage) whenever the
+  // shape itself changed.
+
+  pixman_region32_init_rect(&clear_rects, 0, 0, buf_width, buf_height);
+  if (damage)
+    pixman_region32_intersect(&clear_rects, &clear_rects, damage);
 
   pixman_region32_init(&intersect_rects);
-  pixman_region32_intersect_rect(&intersect_rects, shape, 0, 0, buf_width,
-                                 buf_height);
+  pixman_region32_intersect(&intersect_rects, shape, &clear_rects);
 
   // With the blank destination image, we will take the source image and the
   // shape rectangles and generate the "stamped out" ARGB image.
@@ -177,11 +202,13 @@ void sl_xshape_generate_argb_image(struct sl_context* ctx,
       reinterpret_cast<uint32_t*>(src_mmap->addr), src_mmap->stride[0]);
 
   pixman_box32_t* rects = pixman_region32_rectangles(&intersect_rects, &nrects);
+  pixman_box32_t* clear_boxes =
+      pixman_region32_rectangles(&clear_rects, &nclear);
 
   pixman_color_t clear = {.red = 0, .green = 0, .blue = 0, .alpha = 0};
-  pixman_box32_t dstbox = {.x1 = 0, .y1 = 0, .x2 = buf_width, .y2 = buf_height};
 
-  pixman_image_fill_boxes(PIXMAN_OP_SRC, dst_image, &clear, 1, &dstbox);
+  pixman_image_fill_boxes(PIXMAN_OP_SRC, dst_image, &clear, nclear,
+                          clear_boxes);
 
   for (int i = 0; i < nrects; i++) {
     pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dst_image, rects[i].x1,
@@ -189,4 +216,8 @@ void sl_xshape_generate_argb_image(struct sl_context* ctx,
                            (rects[i].x2 - rects[i].x1),
                            (rects[i].y2 - rects[i].y1));
   }
+
+  pixman_image_unref(src);
+  pixman_region32_fini(&intersect_rects);
+  pixman_region32_fini(&clear_rects);
 }
@@ -16,6 +16,7 @@ void sl_shape_query(struct sl_context* ctx, xcb_window_t xwindow);
 
 void sl_xshape_generate_argb_image(struct sl_context* ctx,
                                    pixman_region32_t* shape,
+                                   pixman_region32_t* damage,
                                    struct sl_mmap* src_mmap,
                                    pixman_image_t* dst_image,
                                    uint32_t src_shm_format);
@@ -3,6 +3,8 @@
 // found in the LICENSE file.
 
 #include "sommelier.h"            // NOLINT(build/include_directory)
+#include "sommelier-counters.h"   // NOLINT(build/include_directory)
+#include "sommelier-recording.h"  // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"    // NOLINT(build/include_directory)
 #include "sommelier-transform.h"  // NOLINT(build/include_directory)
 #include "sommelier-xshape.h"     // NOLINT(build/include_directory)
@@ -30,6 +32,7 @@
 #include <xcb/composite.h>
 #include <xcb/shape.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xfixes.h>
 #include <xcb/xproto.h>
 
@@ -269,6 +272,11 @@ static void sl_buffer_release(void* data, struct wl_buffer* buffer) {
   if (host->ctx->timing != NULL) {
     host->ctx->timing->UpdateLastRelease(resource_id);
   }
+  if (host->attach_time_ns) {
+    sl_counters_record_release_latency(
+        host->ctx->counters, sl_counters_now_ns() - host->attach_time_ns);
+    host->attach_time_ns = 0;
+  }
   wl_buffer_send_release(host->resource);
 }
 
@@ -293,6 +301,28 @@ static void sl_destroy_host_buffer(struct wl_resource* resource) {
   delete host;
 }
 
+struct sl_host_callback* sl_host_callback_alloc(struct sl_context* ctx) {
+  struct sl_host_callback* callback;
+
+  if (!wl_list_empty(&ctx->callback_pool)) {
+    callback = wl_container_of(ctx->callback_pool.next, callback, link);
+    wl_list_remove(&callback->link);
+    callback->resource = NULL;
+    callback->proxy = NULL;
+  } else {
+    callback = new sl_host_callback();
+  }
+  callback->ctx = ctx;
+  return callback;
+}
+
+void sl_host_callback_free(struct sl_host_callback* callback) {
+  // Nodes live for the process lifetime once allocated; the pool is
+  // unbounded but its size is capped in practice by the peak number of
+  // callbacks in flight.
+  wl_list_insert(&callback->ctx->callback_pool, &callback->link);
+}
+
 struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
                                              struct wl_client* client,
                                              uint32_t id,
@@ -320,15 +350,39 @@ struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
   }
   host_buffer->sync_point = NULL;
   host_buffer->is_drm = is_drm;
+  host_buffer->zero_copy = false;
+  host_buffer->attach_time_ns = 0;
 
   return host_buffer;
 }  // NOLINT(whitespace/indent)
 
+// Looks up a dynamically interned atom (mime types, mostly) in the
+// context-wide cache.  Returns XCB_ATOM_NONE on a miss; the caller then
+// pays the intern round trip once and records the result with
+// sl_cache_atom() so every later offer or paste resolves locally.
+static xcb_atom_t sl_lookup_cached_atom(struct sl_context* ctx,
+                                        const char* name) {
+  auto it = ctx->atom_cache.find(name);
+  return it != ctx->atom_cache.end() ? it->second : XCB_ATOM_NONE;
+}
+
+static void sl_cache_atom(struct sl_context* ctx,
+                          const char* name,
+                          xcb_atom_t atom) {
+  ctx->atom_cache[name] = atom;
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
   TRACE_EVENT("other", "sl_internal_data_offer_destroy");
+  struct sl_data_offer_mime_type* mime_types =
+      reinterpret_cast<sl_data_offer_mime_type*>(host->mime_types.data);
+  int count = host->mime_types.size / sizeof(struct sl_data_offer_mime_type);
+
   wl_data_offer_destroy(host->internal);
+  for (int i = 0; i < count; i++)
+    free(mime_types[i].name);
   wl_array_release(&host->atoms);
-  wl_array_release(&host->cookies);
+  wl_array_release(&host->mime_types);
   delete host;
 }
 
@@ -349,23 +403,32 @@ static void sl_set_selection(struct sl_context* ctx,
       return;
     }
 
-    int atoms = data_offer->cookies.size / sizeof(xcb_intern_atom_cookie_t);
+    int atoms = data_offer->mime_types.size /
+                sizeof(struct sl_data_offer_mime_type);
     wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * (atoms + 2));
     (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[0] =
         ctx->atoms[ATOM_TARGETS].value;
     (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[1] =
         ctx->atoms[ATOM_TIMESTAMP].value;
     for (int i = 0; i < atoms; i++) {
-      xcb_intern_atom_cookie_t cookie =
-          (reinterpret_cast<xcb_intern_atom_cookie_t*>(
-              data_offer->cookies.data))[i];
-      xcb_intern_atom_reply_t* reply =
-          xcb_intern_atom_reply(ctx->connection, cookie, NULL);
-      if (reply) {
-        (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[i + 2] =
-            reply->atom;
-        free(reply);
+      struct sl_data_offer_mime_type* mime_type =
+          &(reinterpret_cast<sl_data_offer_mime_type*>(
+              data_offer->mime_types.data))[i];
+
+      if (mime_type->atom == XCB_ATOM_NONE) {
+        xcb_intern_atom_reply_t* reply =
+            xcb_intern_atom_reply(ctx->connection, mime_type->cookie, NULL);
+        if (reply) {
+          mime_type->atom = reply->atom;
+          sl_cache_atom(ctx, mime_type->name, reply->atom);
+          free(reply);
+        }
+        free(mime_type->name);
+        mime_type->name = NULL;
       }
+
+      (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[i + 2] =
+          mime_type->atom;
     }
 
     xcb_set_selection_owner(ctx->connection, ctx->selection_window,
@@ -380,9 +443,17 @@ static void sl_internal_data_offer_offer(void* data,
                                          const char* type) {
   TRACE_EVENT("other", "sl_internal_data_offer_offer");
   struct sl_data_offer* host = static_cast<sl_data_offer*>(data);
-  xcb_intern_atom_cookie_t* cookie = static_cast<xcb_intern_atom_cookie_t*>(
-      wl_array_add(&host->cookies, sizeof(xcb_intern_atom_cookie_t)));
-  *cookie = xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+  struct sl_data_offer_mime_type* mime_type =
+      static_cast<sl_data_offer_mime_type*>(wl_array_add(
+          &host->mime_types, sizeof(struct sl_data_offer_mime_type)));
+
+  mime_type->atom = sl_lookup_cached_atom(host->ctx, type);
+  mime_type->name = NULL;
+  if (mime_type->atom == XCB_ATOM_NONE) {
+    mime_type->cookie =
+        xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+    mime_type->name = strdup(type);
+  }
 }
 
 static void sl_internal_data_offer_source_actions(
@@ -410,7 +481,7 @@ static void sl_internal_data_device_data_offer(
   host_data_offer->ctx = ctx;
   host_data_offer->internal = data_offer;
   wl_array_init(&host_data_offer->atoms);
-  wl_array_init(&host_data_offer->cookies);
+  wl_array_init(&host_data_offer->mime_types);
 
   wl_data_offer_add_listener(host_data_offer->internal,
                              &sl_internal_data_offer_listener, host_data_offer);
@@ -695,9 +766,14 @@ void sl_registry_handler(void* data,
     assert(keyboard_extension);
     keyboard_extension->ctx = ctx;
     keyboard_extension->id = id;
-    keyboard_extension->internal =
-        static_cast<zcr_keyboard_extension_v1*>(wl_registry_bind(
-            registry, id, &zcr_keyboard_extension_v1_interface, 1));
+    if (ctx->lazy_init) {
+      // Bound when the first keyboard is created. See sommelier-seat.cc.
+      keyboard_extension->internal = NULL;
+    } else {
+      keyboard_extension->internal =
+          static_cast<zcr_keyboard_extension_v1*>(wl_registry_bind(
+              registry, id, &zcr_keyboard_extension_v1_interface, 1));
+    }
     assert(!ctx->keyboard_extension);
     ctx->keyboard_extension = keyboard_extension;
   } else if (strcmp(interface, "zwp_text_input_manager_v1") == 0) {
@@ -730,8 +806,14 @@ void sl_registry_handler(void* data,
     assert(gaming_input_manager);
     gaming_input_manager->ctx = ctx;
     gaming_input_manager->id = id;
-    gaming_input_manager->internal = static_cast<zcr_gaming_input_v2*>(
-        wl_registry_bind(registry, id, &zcr_gaming_input_v2_interface, 2));
+    if (ctx->lazy_init) {
+      // Bound when the first gaming seat is requested. See
+      // sommelier-gaming.cc.
+      gaming_input_manager->internal = NULL;
+    } else {
+      gaming_input_manager->internal = static_cast<zcr_gaming_input_v2*>(
+          wl_registry_bind(registry, id, &zcr_gaming_input_v2_interface, 2));
+    }
     assert(!ctx->gaming_input_manager);
     ctx->gaming_input_manager = gaming_input_manager;
 #endif
@@ -840,7 +922,8 @@ static void sl_registry_remover(void* data,
     return;
   }
   if (ctx->keyboard_extension && ctx->keyboard_extension->id == id) {
-    zcr_keyboard_extension_v1_destroy(ctx->keyboard_extension->internal);
+    if (ctx->keyboard_extension->internal)
+      zcr_keyboard_extension_v1_destroy(ctx->keyboard_extension->internal);
     free(ctx->keyboard_extension);
     ctx->keyboard_extension = NULL;
     return;
@@ -859,7 +942,8 @@ static void sl_registry_remover(void* data,
   }
 #ifdef GAMEPAD_SUPPORT
   if (ctx->gaming_input_manager && ctx->gaming_input_manager->id == id) {
-    zcr_gaming_input_v2_destroy(ctx->gaming_input_manager->internal);
+    if (ctx->gaming_input_manager->internal)
+      zcr_gaming_input_v2_destroy(ctx->gaming_input_manager->internal);
     free(ctx->gaming_input_manager);
     ctx->gaming_input_manager = NULL;
     return;
@@ -964,36 +1048,58 @@ static void sl_destroy_window(struct sl_window* window) {
   delete window;
 }
 
-static int sl_is_window(struct sl_window* window, xcb_window_t id) {
-  if (window->id == id)
-    return 1;
+struct sl_window* sl_lookup_window(struct sl_context* ctx, xcb_window_t id) {
+  // The index covers paired and unpaired windows, keyed by both the client
+  // window id and the frame window id.
+  auto it = ctx->window_index.find(id);
+  return it != ctx->window_index.end() ? it->second : NULL;
+}
 
-  if (window->frame_id != XCB_WINDOW_NONE) {
-    if (window->frame_id == id)
-      return 1;
-  }
+int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
+  const xcb_setup_t* setup = xcb_get_setup(ctx->connection);
 
-  return 0;
+  return (id & ~setup->resource_id_mask) == setup->resource_id_base;
 }
 
-struct sl_window* sl_lookup_window(struct sl_context* ctx, xcb_window_t id) {
-  struct sl_window* window;
+struct sl_pending_xcb_reply {
+  struct wl_list link;
+  unsigned int sequence;
+  void (*func)(struct sl_context* ctx, void* reply, uint32_t data);
+  uint32_t data;
+};
 
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  wl_list_for_each(window, &ctx->unpaired_windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  return NULL;
+void sl_xcb_collect_reply(struct sl_context* ctx,
+                          unsigned int sequence,
+                          void (*func)(struct sl_context* ctx,
+                                       void* reply,
+                                       uint32_t data),
+                          uint32_t data) {
+  struct sl_pending_xcb_reply* pending = static_cast<sl_pending_xcb_reply*>(
+      malloc(sizeof(struct sl_pending_xcb_reply)));
+  assert(pending);
+  pending->sequence = sequence;
+  pending->func = func;
+  pending->data = data;
+  wl_list_insert(ctx->pending_xcb_replies.prev, &pending->link);
 }
 
-int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
-  const xcb_setup_t* setup = xcb_get_setup(ctx->connection);
+void sl_xcb_collect_pending_replies(struct sl_context* ctx) {
+  if (wl_list_empty(&ctx->pending_xcb_replies))
+    return;
 
-  return (id & ~setup->resource_id_mask) == setup->resource_id_base;
+  TRACE_EVENT("x11wm", "sl_xcb_collect_pending_replies");
+  // All requests are already in flight, so the whole batch costs a single
+  // round trip.  Callbacks may queue further replies; they are collected by
+  // the same loop.
+  while (!wl_list_empty(&ctx->pending_xcb_replies)) {
+    struct sl_pending_xcb_reply* pending = wl_container_of(
+        ctx->pending_xcb_replies.next, pending, link);
+    wl_list_remove(&pending->link);
+
+    void* reply = xcb_wait_for_reply(ctx->connection, pending->sequence, NULL);
+    pending->func(ctx, reply, pending->data);
+    free(pending);
+  }
 }
 
 static void sl_handle_create_notify(struct sl_context* ctx,
@@ -1394,6 +1500,7 @@ void sl_handle_map_request(struct sl_context* ctx,
     values[2] = ctx->colormaps[depth];
 
     window->frame_id = xcb_generate_id(ctx->connection);
+    ctx->window_index[window->frame_id] = window;
     xcb_create_window(
         ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
         window->y, window->width, window->height, 0,
@@ -1457,6 +1564,7 @@ void sl_handle_unmap_notify(struct sl_context* ctx,
     xcb_reparent_window(ctx->connection, window->id, ctx->screen->root,
                         window->x, window->y);
     xcb_destroy_window(ctx->connection, window->frame_id);
+    ctx->window_index.erase(window->frame_id);
     window->frame_id = XCB_WINDOW_NONE;
   }
 
@@ -1675,14 +1783,10 @@ void sl_handle_client_message(struct sl_context* ctx,
     perfetto_annotate_window(ctx, p, "event->window", event->window);
   });
   if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
-    struct sl_window *window, *unpaired_window = NULL;
+    struct sl_window* unpaired_window = sl_lookup_window(ctx, event->window);
 
-    wl_list_for_each(window, &ctx->unpaired_windows, link) {
-      if (sl_is_window(window, event->window)) {
-        unpaired_window = window;
-        break;
-      }
-    }
+    if (unpaired_window && !unpaired_window->unpaired)
+      unpaired_window = NULL;
 
     if (unpaired_window) {
       unpaired_window->host_surface_id = event->data.data32[0];
@@ -1861,20 +1965,30 @@ static void sl_handle_focus_out(struct sl_context* ctx,
 
 int sl_begin_data_source_send(struct sl_context* ctx,
                               int fd,
+                              xcb_atom_t atom,
                               xcb_intern_atom_cookie_t cookie,
+                              const char* mime_type,
                               struct sl_data_source* data_source) {
-  xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(ctx->connection, cookie, NULL);
+  // A cached target atom skips the intern round trip entirely; otherwise
+  // collect the reply and remember it for the next paste of this type.
+  if (atom == XCB_ATOM_NONE) {
+    xcb_intern_atom_reply_t* reply =
+        xcb_intern_atom_reply(ctx->connection, cookie, NULL);
 
-  if (!reply) {
-    close(fd);
-    return 0;
+    if (!reply) {
+      close(fd);
+      return 0;
+    }
+
+    atom = reply->atom;
+    sl_cache_atom(ctx, mime_type, atom);
+    free(reply);
   }
 
   int flags, rv;
 
   xcb_convert_selection(ctx->connection, ctx->selection_window,
-                        ctx->atoms[ATOM_CLIPBOARD].value, reply->atom,
+                        ctx->atoms[ATOM_CLIPBOARD].value, atom,
                         ctx->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
 
   flags = fcntl(fd, F_GETFL, 0);
@@ -1882,7 +1996,6 @@ int sl_begin_data_source_send(struct sl_context* ctx,
   errno_assert(!rv);
 
   ctx->selection_data_source_send_fd = fd;
-  free(reply);
   return 1;
 }
 
@@ -1893,14 +2006,49 @@ void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
     request = wl_container_of(next, request, link);
     wl_list_remove(next);
 
-    int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
+    int rv = sl_begin_data_source_send(ctx, request->fd, request->atom,
+                                       request->cookie, request->mime_type,
                                        request->data_source);
+    free(request->mime_type);
     free(request);
     if (rv)
       break;
   }
 }
 
+static void sl_write_selection_property(struct sl_context* ctx,
+                                        xcb_get_property_reply_t* reply);
+
+// Fetch the current INCR chunk from our selection window. The delete flag on
+// the fetch is what tells the selection owner to start producing the next
+// chunk, so issuing it as early as possible overlaps the owner's work with
+// our writes to the pipe.
+static void sl_fetch_incr_chunk(struct sl_context* ctx) {
+  xcb_get_property_reply_t* reply = xcb_get_property_reply(
+      ctx->connection,
+      xcb_get_property(ctx->connection, 1, ctx->selection_window,
+                       ctx->atoms[ATOM_WL_SELECTION].value,
+                       XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+      NULL);
+  if (!reply)
+    return;
+
+  if (xcb_get_property_value_length(reply) == 0) {
+    // A zero-length property marks the end of the INCR transfer. The pipe is
+    // closed once any staged chunks have drained.
+    free(reply);
+    ctx->selection_property_eof_pending = 1;
+    return;
+  }
+
+  if (ctx->selection_property_reply) {
+    // A chunk is still streaming to the pipe; stage this one behind it.
+    ctx->selection_property_next_reply = reply;
+  } else {
+    sl_write_selection_property(ctx, reply);
+  }
+}
+
 static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = static_cast<sl_context*>(data);
   int bytes, bytes_left;
@@ -1915,21 +2063,53 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
     fprintf(stderr, "write error to target fd: %m\n");
     close(fd);
     fd = -1;
-  } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
-    } else {
-      close(fd);
-      fd = -1;
+    if (ctx->selection_property_next_reply) {
+      free(ctx->selection_property_next_reply);
+      ctx->selection_property_next_reply = NULL;
     }
-  } else {
+    ctx->selection_property_notify_pending = 0;
+    ctx->selection_property_eof_pending = 0;
+  } else if (bytes < bytes_left) {
     ctx->selection_property_offset += bytes;
     return 1;
   }
 
+  // The current chunk is fully written (or the pipe errored out). Its
+  // property was already deleted when it was fetched, so the owner may
+  // have produced the next chunk in the meantime.
   free(ctx->selection_property_reply);
   ctx->selection_property_reply = NULL;
+
+  if (fd >= 0 && !ctx->selection_incremental_transfer) {
+    // One-shot transfer complete.
+    close(fd);
+    fd = -1;
+  } else if (fd >= 0) {
+    if (ctx->selection_property_next_reply) {
+      // Promote the staged chunk and keep streaming without waiting for
+      // another X round trip.
+      ctx->selection_property_reply = ctx->selection_property_next_reply;
+      ctx->selection_property_next_reply = NULL;
+      ctx->selection_property_offset = 0;
+      if (ctx->selection_property_notify_pending) {
+        // A further chunk was announced while both slots were full; fetch
+        // it into the staging slot we just freed.
+        ctx->selection_property_notify_pending = 0;
+        sl_fetch_incr_chunk(ctx);
+      }
+      return 1;
+    }
+    if (!ctx->selection_property_eof_pending) {
+      // Wait for the owner to announce the next chunk.
+      ctx->selection_send_event_source.reset();
+      return 1;
+    }
+    // The terminator was already fetched; finish up.
+    ctx->selection_property_eof_pending = 0;
+    close(fd);
+    fd = -1;
+  }
+
   if (ctx->selection_send_event_source) {
     ctx->selection_send_event_source.reset();
   }
@@ -1976,35 +2156,41 @@ static void sl_send_selection_notify(struct sl_context* ctx,
 
 static void sl_send_selection_data(struct sl_context* ctx) {
   assert(!ctx->selection_data_ack_pending);
+  uint32_t bytes = ctx->selection_data.size;
+  if (bytes > ctx->selection_incr_chunk_size)
+    bytes = ctx->selection_incr_chunk_size;
   xcb_change_property(
       ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
       ctx->selection_request.property, ctx->selection_data_type,
-      /*format=*/8, ctx->selection_data.size, ctx->selection_data.data);
+      /*format=*/8, bytes, ctx->selection_data.data);
   ctx->selection_data_ack_pending = 1;
-  ctx->selection_data.size = 0;
+  // xcb_change_property copies the data, so the front of the buffer can be
+  // reclaimed for the pipe reads that continue while we wait for the ack.
+  memmove(ctx->selection_data.data,
+          reinterpret_cast<char*>(ctx->selection_data.data) + bytes,
+          ctx->selection_data.size - bytes);
+  ctx->selection_data.size -= bytes;
 }
 
-static const uint32_t sl_incr_chunk_size = 64 * 1024;
-
 static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = static_cast<sl_context*>(data);
 
   // When a selection starts, the wl_array in |ctx->selection_data| is
   // initialized with a size of zero. Since we now need to actually write into
-  // it, allocate |sl_incr_chunk_size| bytes to store the selection data in. We
-  // need to buffer this much to decide between a one-shot transfer and an
-  // incremental transfer, as this decision must be made before the first
-  // response is sent.
+  // it, allocate two chunks worth of space: one chunk to decide between a
+  // one-shot transfer and an incremental transfer (this decision must be made
+  // before the first response is sent), and a second so the pipe can keep
+  // draining while a posted chunk waits for the requestor's ack.
+  size_t buffer_size = 2 * ctx->selection_incr_chunk_size;
   if (ctx->selection_data.alloc == 0) {
     // wl_array_add is ostensibly failable, but the only failure case comes from
     // calling malloc, and if that fails we should just die anyway.
-    errno_assert(
-        (size_t)wl_array_add(&ctx->selection_data, sl_incr_chunk_size));
+    errno_assert((size_t)wl_array_add(&ctx->selection_data, buffer_size));
 
     // wl_array_add increments |size| as well as |alloc|, but we don't actually
     // want that yet. Instead we will set |size| later based on the results of
     // the read call.
-    ctx->selection_data.size -= sl_incr_chunk_size;
+    ctx->selection_data.size -= buffer_size;
   }
 
   int offset = ctx->selection_data.size;
@@ -2017,41 +2203,296 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
     sl_send_selection_notify(ctx, XCB_ATOM_NONE);
     ctx->selection_data_offer_receive_fd = -1;
     close(fd);
-  } else {
-    ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
-      if (!ctx->selection_incremental_transfer) {
-        ctx->selection_incremental_transfer = 1;
-        xcb_change_property(
-            ctx->connection, XCB_PROP_MODE_REPLACE,
-            ctx->selection_request.requestor, ctx->selection_request.property,
-            ctx->atoms[ATOM_INCR].value, 32, 1, &sl_incr_chunk_size);
-        ctx->selection_data_ack_pending = 1;
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-      } else if (!ctx->selection_data_ack_pending) {
-        sl_send_selection_data(ctx);
-      }
-    } else if (bytes == 0) {
-      if (!ctx->selection_data_ack_pending)
-        sl_send_selection_data(ctx);
-      if (!ctx->selection_incremental_transfer) {
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
-      xcb_flush(ctx->connection);
-      ctx->selection_data_offer_receive_fd = -1;
-      close(fd);
-    } else {
-      ctx->selection_data.size = offset + bytes;
-      return 1;
+    ctx->selection_event_source.reset();
+    return 1;
+  }
+
+  ctx->selection_data.size = offset + bytes;
+
+  if (bytes == 0) {
+    if (!ctx->selection_data_ack_pending)
+      sl_send_selection_data(ctx);
+    if (!ctx->selection_incremental_transfer) {
+      sl_send_selection_notify(ctx, ctx->selection_request.property);
+      ctx->selection_request.requestor = XCB_NONE;
+      wl_array_release(&ctx->selection_data);
+    }
+    xcb_flush(ctx->connection);
+    ctx->selection_data_offer_receive_fd = -1;
+    close(fd);
+    ctx->selection_event_source.reset();
+    return 1;
+  }
+
+  if (ctx->selection_data.size >= ctx->selection_incr_chunk_size) {
+    if (!ctx->selection_incremental_transfer) {
+      ctx->selection_incremental_transfer = 1;
+      xcb_change_property(
+          ctx->connection, XCB_PROP_MODE_REPLACE,
+          ctx->selection_request.requestor, ctx->selection_request.property,
+          ctx->atoms[ATOM_INCR].value, 32, 1, &ctx->selection_incr_chunk_size);
+      ctx->selection_data_ack_pending = 1;
+      sl_send_selection_notify(ctx, ctx->selection_request.property);
+    } else if (!ctx->selection_data_ack_pending) {
+      sl_send_selection_data(ctx);
     }
   }
 
-  ctx->selection_event_source.reset();
+  if (static_cast<size_t>(ctx->selection_data.size) ==
+      ctx->selection_data.alloc) {
+    // Both chunk buffers are full; pause reading until an ack frees one.
+    ctx->selection_event_source.reset();
+  }
   return 1;
 }
 
+static void sl_update_title(struct sl_context* ctx, struct sl_window* window) {
+  if (!window->xdg_toplevel)
+    return;
+
+  xdg_toplevel_set_title(window->xdg_toplevel,
+                         window->name ? window->name : "");
+}
+
+static void sl_update_size_limits(struct sl_context* ctx,
+                                  struct sl_window* window) {
+  if (!window->xdg_toplevel)
+    return;
+
+  if (window->size_flags & P_MIN_SIZE) {
+    int32_t minw = window->min_width;
+    int32_t minh = window->min_height;
+
+    sl_transform_guest_to_host(window->ctx, window->paired_surface, &minw,
+                               &minh);
+    xdg_toplevel_set_min_size(window->xdg_toplevel, minw, minh);
+  } else {
+    xdg_toplevel_set_min_size(window->xdg_toplevel, 0, 0);
+  }
+
+  if (window->size_flags & P_MAX_SIZE) {
+    int32_t maxw = window->max_width;
+    int32_t maxh = window->max_height;
+
+    sl_transform_guest_to_host(window->ctx, window->paired_surface, &maxw,
+                               &maxh);
+    xdg_toplevel_set_max_size(window->xdg_toplevel, maxw, maxh);
+  } else {
+    xdg_toplevel_set_max_size(window->xdg_toplevel, 0, 0);
+  }
+}
+
+static void sl_update_frame_type(struct sl_window* window) {
+  if (!window->aura_surface)
+    return;
+
+  zaura_surface_set_frame(window->aura_surface,
+                          window->decorated ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
+                          : window->depth == 32
+                              ? ZAURA_SURFACE_FRAME_TYPE_NONE
+                              : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
+}
+
+static void sl_update_frame_colors(struct sl_context* ctx,
+                                   struct sl_window* window) {
+  uint32_t frame_color;
+
+  if (!window->aura_surface)
+    return;
+
+  frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
+  zaura_surface_set_frame_colors(window->aura_surface, frame_color,
+                                 frame_color);
+}
+
+static void sl_collect_name_reply(struct sl_context* ctx,
+                                  void* data,
+                                  uint32_t window_id,
+                                  bool is_net_wm_name) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+
+  if (!window) {
+    free(reply);
+    return;
+  }
+
+  // A _NET_WM_NAME collected earlier in the same burst takes precedence
+  // over WM_NAME.
+  if (!is_net_wm_name && window->has_net_wm_name) {
+    free(reply);
+    return;
+  }
+
+  if (reply) {
+    free(window->name);
+    window->name = strndup(static_cast<char*>(xcb_get_property_value(reply)),
+                           xcb_get_property_value_length(reply));
+    if (is_net_wm_name)
+      window->has_net_wm_name = true;
+    free(reply);
+  }
+
+  sl_update_title(ctx, window);
+}
+
+static void sl_collect_wm_name_reply(struct sl_context* ctx,
+                                     void* reply,
+                                     uint32_t window_id) {
+  sl_collect_name_reply(ctx, reply, window_id, /*is_net_wm_name=*/false);
+}
+
+static void sl_collect_net_wm_name_reply(struct sl_context* ctx,
+                                         void* reply,
+                                         uint32_t window_id) {
+  sl_collect_name_reply(ctx, reply, window_id, /*is_net_wm_name=*/true);
+}
+
+static void sl_collect_wm_class_reply(struct sl_context* ctx,
+                                      void* data,
+                                      uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+
+  if (!window) {
+    free(reply);
+    return;
+  }
+
+  if (reply) {
+    sl_decode_wm_class(window, reply);
+    free(reply);
+  }
+  sl_update_application_id(ctx, window);
+}
+
+static void sl_collect_application_id_reply(struct sl_context* ctx,
+                                            void* data,
+                                            uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+
+  if (!window || !reply) {
+    free(reply);
+    return;
+  }
+
+  sl_set_application_id_from_atom(ctx, window, reply);
+  sl_update_application_id(ctx, window);
+  free(reply);
+}
+
+static void sl_collect_wm_normal_hints_reply(struct sl_context* ctx,
+                                             void* data,
+                                             uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+  struct sl_wm_size_hints size_hints = {0};
+
+  if (!window) {
+    free(reply);
+    return;
+  }
+
+  if (reply) {
+    memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
+    free(reply);
+  }
+  TRACE_EVENT("x11wm", "XCB_PROPERTY_NOTIFY: XCB_ATOM_WM_NORMAL_HINTS",
+              [&](perfetto::EventContext p) {
+                perfetto_annotate_size_hints(p, size_hints);
+              });
+
+  window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
+  if (window->size_flags & P_MIN_SIZE) {
+    window->min_width = size_hints.min_width;
+    window->min_height = size_hints.min_height;
+  }
+  if (window->size_flags & P_MAX_SIZE) {
+    window->max_width = size_hints.max_width;
+    window->max_height = size_hints.max_height;
+  }
+
+  sl_update_size_limits(ctx, window);
+}
+
+static void sl_collect_wm_hints_reply(struct sl_context* ctx,
+                                      void* data,
+                                      uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+  struct sl_wm_hints wm_hints = {0};
+
+  if (!window || !reply) {
+    free(reply);
+    return;
+  }
+
+  memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
+  free(reply);
+
+  if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
+    sl_request_attention(ctx, window, /*is_strong_request=*/false);
+  }
+}
+
+static void sl_collect_motif_wm_hints_reply(struct sl_context* ctx,
+                                            void* data,
+                                            uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+  struct sl_mwm_hints mwm_hints = {0};
+
+  if (!window) {
+    free(reply);
+    return;
+  }
+
+  if (reply) {
+    if (xcb_get_property_value_length(reply) >=
+        static_cast<int>(sizeof(mwm_hints))) {
+      memcpy(&mwm_hints, xcb_get_property_value(reply), sizeof(mwm_hints));
+    }
+    free(reply);
+    if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
+      if (mwm_hints.decorations & MWM_DECOR_ALL)
+        window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
+      else
+        window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
+    }
+  }
+
+  sl_update_frame_type(window);
+}
+
+static void sl_collect_gtk_theme_variant_reply(struct sl_context* ctx,
+                                               void* data,
+                                               uint32_t window_id) {
+  xcb_get_property_reply_t* reply =
+      static_cast<xcb_get_property_reply_t*>(data);
+  struct sl_window* window = sl_lookup_window(ctx, window_id);
+
+  if (!window) {
+    free(reply);
+    return;
+  }
+
+  if (reply) {
+    if (xcb_get_property_value_length(reply) >= 4)
+      window->dark_frame =
+          !strcmp(static_cast<char*>(xcb_get_property_value(reply)), "dark");
+    free(reply);
+  }
+
+  sl_update_frame_colors(ctx, window);
+}
+
 void sl_handle_property_notify(struct sl_context* ctx,
                                xcb_property_notify_event_t* event) {
   TRACE_EVENT("x11wm", "XCB_PROPERTY_NOTIFY", [&](perfetto::EventContext p) {
@@ -2086,31 +2527,17 @@ void sl_handle_property_notify(struct sl_context* ctx,
       atom = XCB_ATOM_WM_NAME;
 
     if (atom != XCB_ATOM_NONE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id, atom, XCB_ATOM_ANY,
-                           0, 2048),
-          NULL);
-      if (reply) {
-        window->name =
-            strndup(static_cast<char*>(xcb_get_property_value(reply)),
-                    xcb_get_property_value_length(reply));
-        free(reply);
-
-        if (atom == ctx->atoms[ATOM_NET_WM_NAME].value) {
-          window->has_net_wm_name = true;
-        }
-      }
-    }
-
-    if (!window->xdg_toplevel)
+      xcb_get_property_cookie_t cookie = xcb_get_property(
+          ctx->connection, 0, window->id, atom, XCB_ATOM_ANY, 0, 2048);
+      sl_xcb_collect_reply(ctx, cookie.sequence,
+                           atom == ctx->atoms[ATOM_NET_WM_NAME].value
+                               ? sl_collect_net_wm_name_reply
+                               : sl_collect_wm_name_reply,
+                           window->id);
       return;
-
-    if (window->name) {
-      xdg_toplevel_set_title(window->xdg_toplevel, window->name);
-    } else {
-      xdg_toplevel_set_title(window->xdg_toplevel, "");
     }
+
+    sl_update_title(ctx, window);
   } else if (event->atom == XCB_ATOM_WM_CLASS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window || event->state == XCB_PROPERTY_DELETE)
@@ -2119,13 +2546,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
     xcb_get_property_cookie_t cookie =
         xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_CLASS,
                          XCB_ATOM_ANY, 0, 2048);
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, cookie, NULL);
-    if (reply) {
-      sl_decode_wm_class(window, reply);
-      free(reply);
-    }
-    sl_update_application_id(ctx, window);
+    sl_xcb_collect_reply(ctx, cookie.sequence, sl_collect_wm_class_reply,
+                         window->id);
   } else if (event->atom == ctx->application_id_property_atom) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window || event->state == XCB_PROPERTY_DELETE)
@@ -2137,13 +2559,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
     xcb_get_property_cookie_t cookie = xcb_get_property(
         ctx->connection, 0, window->id, ctx->application_id_property_atom,
         XCB_ATOM_CARDINAL, 0, 1);
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, cookie, NULL);
-    if (reply) {
-      sl_set_application_id_from_atom(ctx, window, reply);
-      sl_update_application_id(ctx, window);
-      free(reply);
-    }
+    sl_xcb_collect_reply(ctx, cookie.sequence, sl_collect_application_id_reply,
+                         window->id);
   } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2152,57 +2569,15 @@ void sl_handle_property_notify(struct sl_context* ctx,
     window->size_flags &= ~(P_MIN_SIZE | P_MAX_SIZE);
 
     if (event->state != XCB_PROPERTY_DELETE) {
-      struct sl_wm_size_hints size_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_ANY, 0,
-                           sizeof(size_hints)),
-          NULL);
-      if (reply) {
-        memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
-        free(reply);
-      }
-      TRACE_EVENT("x11wm", "XCB_PROPERTY_NOTIFY: XCB_ATOM_WM_NORMAL_HINTS",
-                  [&](perfetto::EventContext p) {
-                    perfetto_annotate_size_hints(p, size_hints);
-                  });
-
-      window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
-      if (window->size_flags & P_MIN_SIZE) {
-        window->min_width = size_hints.min_width;
-        window->min_height = size_hints.min_height;
-      }
-      if (window->size_flags & P_MAX_SIZE) {
-        window->max_width = size_hints.max_width;
-        window->max_height = size_hints.max_height;
-      }
-    }
-
-    if (!window->xdg_toplevel)
+      xcb_get_property_cookie_t cookie = xcb_get_property(
+          ctx->connection, 0, window->id, XCB_ATOM_WM_NORMAL_HINTS,
+          XCB_ATOM_ANY, 0, sizeof(struct sl_wm_size_hints));
+      sl_xcb_collect_reply(ctx, cookie.sequence,
+                           sl_collect_wm_normal_hints_reply, window->id);
       return;
-
-    if (window->size_flags & P_MIN_SIZE) {
-      int32_t minw = window->min_width;
-      int32_t minh = window->min_height;
-
-      sl_transform_guest_to_host(window->ctx, window->paired_surface, &minw,
-                                 &minh);
-      xdg_toplevel_set_min_size(window->xdg_toplevel, minw, minh);
-    } else {
-      xdg_toplevel_set_min_size(window->xdg_toplevel, 0, 0);
     }
 
-    if (window->size_flags & P_MAX_SIZE) {
-      int32_t maxw = window->max_width;
-      int32_t maxh = window->max_height;
-
-      sl_transform_guest_to_host(window->ctx, window->paired_surface, &maxw,
-                                 &maxh);
-      xdg_toplevel_set_max_size(window->xdg_toplevel, maxw, maxh);
-    } else {
-      xdg_toplevel_set_max_size(window->xdg_toplevel, 0, 0);
-    }
+    sl_update_size_limits(ctx, window);
   } else if (event->atom == XCB_ATOM_WM_HINTS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2210,21 +2585,11 @@ void sl_handle_property_notify(struct sl_context* ctx,
 
     if (event->state == XCB_PROPERTY_DELETE)
       return;
-    struct sl_wm_hints wm_hints = {0};
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
+    xcb_get_property_cookie_t cookie =
         xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_HINTS,
-                         XCB_ATOM_ANY, 0, sizeof(wm_hints)),
-        NULL);
-
-    if (!reply)
-      return;
-    memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
-    free(reply);
-
-    if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
-      sl_request_attention(ctx, window, /*is_strong_request=*/false);
-    }
+                         XCB_ATOM_ANY, 0, sizeof(struct sl_wm_hints));
+    sl_xcb_collect_reply(ctx, cookie.sequence, sl_collect_wm_hints_reply,
+                         window->id);
   } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2234,39 +2599,18 @@ void sl_handle_property_notify(struct sl_context* ctx,
     window->decorated = window->managed;
 
     if (event->state != XCB_PROPERTY_DELETE) {
-      struct sl_mwm_hints mwm_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY,
-                           0, sizeof(mwm_hints)),
-          NULL);
-      if (reply) {
-        if (xcb_get_property_value_length(reply) >=
-            static_cast<int>(sizeof(mwm_hints))) {
-          memcpy(&mwm_hints, xcb_get_property_value(reply), sizeof(mwm_hints));
-        }
-        free(reply);
-        if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
-          if (mwm_hints.decorations & MWM_DECOR_ALL)
-            window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
-          else
-            window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
-        }
-      }
-    }
-
-    if (!window->aura_surface)
+      xcb_get_property_cookie_t cookie = xcb_get_property(
+          ctx->connection, 0, window->id,
+          ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY, 0,
+          sizeof(struct sl_mwm_hints));
+      sl_xcb_collect_reply(ctx, cookie.sequence,
+                           sl_collect_motif_wm_hints_reply, window->id);
       return;
+    }
 
-    zaura_surface_set_frame(window->aura_surface,
-                            window->decorated ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
-                            : window->depth == 32
-                                ? ZAURA_SURFACE_FRAME_TYPE_NONE
-                                : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
+    sl_update_frame_type(window);
   } else if (event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
     struct sl_window* window;
-    uint32_t frame_color;
 
     window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2275,26 +2619,15 @@ void sl_handle_property_notify(struct sl_context* ctx,
     window->dark_frame = 0;
 
     if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        if (xcb_get_property_value_length(reply) >= 4)
-          window->dark_frame = !strcmp(
-              static_cast<char*>(xcb_get_property_value(reply)), "dark");
-        free(reply);
-      }
-    }
-
-    if (!window->aura_surface)
+      xcb_get_property_cookie_t cookie = xcb_get_property(
+          ctx->connection, 0, window->id,
+          ctx->atoms[ATOM_GTK_THEME_VARIANT].value, XCB_ATOM_ANY, 0, 2048);
+      sl_xcb_collect_reply(ctx, cookie.sequence,
+                           sl_collect_gtk_theme_variant_reply, window->id);
       return;
+    }
 
-    frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
-    zaura_surface_set_frame_colors(window->aura_surface, frame_color,
-                                   frame_color);
+    sl_update_frame_colors(ctx, window);
   } else if (event->atom ==
              ctx->atoms[ATOM_XWAYLAND_RANDR_EMU_MONITOR_RECTS].value) {
     TRACE_EVENT("x11wm",
@@ -2316,23 +2649,24 @@ void sl_handle_property_notify(struct sl_context* ctx,
     if (event->window == ctx->selection_window &&
         event->state == XCB_PROPERTY_NEW_VALUE &&
         ctx->selection_incremental_transfer) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, ctx->selection_window,
-                           ctx->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-          NULL);
-
-      if (!reply)
+      if (ctx->selection_property_reply &&
+          ctx->selection_property_next_reply) {
+        // Both chunk slots are occupied; defer the fetch (and the delete
+        // that goes with it) until one drains so peak memory stays bounded
+        // at two chunks.
+        ctx->selection_property_notify_pending = 1;
         return;
+      }
 
-      if (xcb_get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
-      } else {
+      sl_fetch_incr_chunk(ctx);
+
+      if (ctx->selection_property_eof_pending &&
+          !ctx->selection_property_reply) {
+        // The terminator arrived with nothing left in flight.
+        ctx->selection_property_eof_pending = 0;
         assert(!ctx->selection_send_event_source);
         close(ctx->selection_data_source_send_fd);
         ctx->selection_data_source_send_fd = -1;
-        free(reply);
 
         sl_process_data_source_send_pending_list(ctx);
       }
@@ -2383,18 +2717,24 @@ static void sl_internal_data_source_send(void* data,
   struct sl_data_source* host = static_cast<sl_data_source*>(data);
   struct sl_context* ctx = host->ctx;
 
-  xcb_intern_atom_cookie_t cookie =
-      xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
+  xcb_atom_t atom = sl_lookup_cached_atom(ctx, mime_type);
+  xcb_intern_atom_cookie_t cookie = {0};
+  if (atom == XCB_ATOM_NONE) {
+    cookie =
+        xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
+  }
 
   if (ctx->selection_data_source_send_fd < 0) {
-    sl_begin_data_source_send(ctx, fd, cookie, host);
+    sl_begin_data_source_send(ctx, fd, atom, cookie, mime_type, host);
   } else {
     struct sl_data_source_send_request* request =
         static_cast<sl_data_source_send_request*>(
             malloc(sizeof(struct sl_data_source_send_request)));
 
     request->fd = fd;
+    request->atom = atom;
     request->cookie = cookie;
+    request->mime_type = atom == XCB_ATOM_NONE ? strdup(mime_type) : NULL;
     request->data_source = host;
     wl_list_insert(&ctx->selection_data_source_send_pending, &request->link);
   }
@@ -2572,6 +2912,18 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
   xcb_get_atom_name_cookie_t atom_name_cookie =
       xcb_get_atom_name(ctx->connection, data_type);
 
+  // Size INCR chunks to the negotiated channel send size: the largest
+  // multiple of max_send_size() that fits the default chunk size, so each
+  // chunk crosses the channel in whole sends with no partial trailing
+  // transaction.
+  if (ctx->channel && ctx->channel->max_send_size() > 0) {
+    size_t send_size = ctx->channel->max_send_size();
+    if (send_size >= 64 * 1024)
+      ctx->selection_incr_chunk_size = send_size;
+    else
+      ctx->selection_incr_chunk_size = (64 * 1024 / send_size) * send_size;
+  }
+
   wl_array_init(&ctx->selection_data);
   ctx->selection_data_ack_pending = 0;
 
@@ -2787,6 +3139,10 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
     ++count;
   }
 
+  // Property fetches issued by the handlers above are pipelined; collect
+  // their replies now that the event queue has drained.
+  sl_xcb_collect_pending_replies(ctx);
+
   if ((mask & ~WL_EVENT_WRITABLE) == 0)
     xcb_flush(ctx->connection);
 
@@ -2904,7 +3260,7 @@ static void sl_connect(struct sl_context* ctx) {
       ctx->connection, ctx->screen->root, XCB_CW_EVENT_MASK, values);
 
   ctx->connection_event_source.reset(wl_event_loop_add_fd(
-      wl_display_get_event_loop(ctx->host_display),
+      sl_context_input_event_loop(ctx),
       xcb_get_file_descriptor(ctx->connection), WL_EVENT_READABLE,
       &sl_handle_x_connection_event, ctx));
 
@@ -2960,12 +3316,15 @@ static void sl_connect(struct sl_context* ctx) {
                     1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
                     NULL);
 
-  // Wait on results for all the atom intern requests we sent above.
+  // Wait on results for all the atom intern requests we sent above.  The
+  // results also seed the dynamic atom cache, so a selection advertising
+  // e.g. UTF8_STRING never pays an intern round trip.
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
     atom_reply =
         xcb_intern_atom_reply(ctx->connection, ctx->atoms[i].cookie, &error);
     assert(!error);
     ctx->atoms[i].value = atom_reply->atom;
+    sl_cache_atom(ctx, sl_context_atom_name(i), atom_reply->atom);
     free(atom_reply);
   }
   if (ctx->application_id_property_name) {
@@ -3337,6 +3696,8 @@ static void sl_print_usage() {
       "  --xwayland-gl-driver-path=PATH\tPath to GL drivers for Xwayland\n"
       "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
       "  --enable-xshape\t\tEnable X11 XShape extension support\n"
+      "  --enable-udmabuf\t\tExport client shm buffers as dma-bufs via "
+      "/dev/udmabuf to avoid staging copies\n"
       "  --no-exit-with-child\t\tKeep process alive after child exists\n"
       "  --no-clipboard-manager\tDisable X11 clipboard manager\n"
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
@@ -3345,10 +3706,26 @@ static void sl_print_usage() {
       "  --force-drm-device=DEVICE\tDRM device to use\n"
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
       "  --timing-filename=PATH\tPath to timing output log\n"
+      "  --stats-socket=PATH\t\tUNIX socket that serves a performance\n"
+      "\t\t\t\tcounter dump on each connection\n"
+      "  --record-stream=PATH\t\tRecord the surface stream for replay\n"
+      "\t\t\t\twith sommelier_bench\n"
+      "  --transfer-pipe-size=BYTES\tPipe buffer size for clipboard and\n"
+      "\t\t\t\tdrag-and-drop transfers (default: 1MiB)\n"
+      "  --relative-pointer-rate=HZ\tAccumulate relative pointer deltas and\n"
+      "\t\t\t\temit at this rate (default: unlimited)\n"
+      "  --idle-reclaim-delay=SECONDS\tDestroy retained output buffers after\n"
+      "\t\t\t\tthis long without use (default: 30, 0 disables)\n"
+      "  --hugepage-buffers\t\tBack large shm buffer mappings with\n"
+      "\t\t\t\ttransparent hugepages\n"
       "  --direct-scale\t\tEnable direct scaling mode\n"
+      "  --lazy-init\t\t\tDefer optional host binds and the Xwayland spawn\n"
+      "\t\t\t\t(requires --x-display) until first use\n"
 #ifdef PERFETTO_TRACING
       "  --trace-filename=PATH\t\tPath to Perfetto trace filename\n"
       "  --trace-system\t\tPerfetto trace to system daemon\n"
+      "  --trace-sample=SPEC\t\tPer-category trace sampling rates, e.g.\n"
+      "\t\t\t\tsurface=64,x11wm=16 keeps 1 of every N events\n"
 #endif
       "  --fullscreen-mode=MODE\tDefault fullscreen behavior (immersive,"
       " plain)\n"
@@ -3645,6 +4022,16 @@ void sl_spawn_xwayland(sl_context* ctx,
     args[i++] = display_fd_str;
     args[i++] = "-wm";
     args[i++] = wm_fd_str;
+    // Hand over any X11 sockets sommelier has been listening on while the
+    // spawn was deferred (--lazy-init); pending connections stay queued on
+    // them and are accepted by Xwayland once it starts.
+    for (int j = 0; j < 2; ++j) {
+      if (ctx->xwayland_listen_fds[j] >= 0) {
+        fd = dup(ctx->xwayland_listen_fds[j]);
+        args[i++] = "-listenfd";
+        args[i++] = sl_xasprintf("%d", fd);
+      }
+    }
     if (xauth_path) {
       args[i++] = "-auth";
       args[i++] = sl_xasprintf("%s", xauth_path);
@@ -3673,6 +4060,104 @@ void sl_spawn_xwayland(sl_context* ctx,
   ctx->xwayland_pid = pid;
 }
 
+#define X_SOCKET_DIR "/tmp/.X11-unix"
+
+// Spawn arguments captured in real_main() when --lazy-init defers the
+// Xwayland spawn, and consumed by sl_handle_x_socket_event() on the first
+// connection attempt.  The strings point into argv/environ and stay valid
+// for the lifetime of the process.
+struct sl_deferred_xwayland_spawn {
+  struct wl_event_loop* event_loop;
+  int wayland_socket_fd;
+  const char* xwayland_cmd_prefix;
+  const char* xwayland_path;
+  int xdisplay;
+  const char* xauth_path;
+  const char* xfont_path;
+  const char* xwayland_gl_driver_path;
+  const char* glamor;
+};
+
+static struct sl_deferred_xwayland_spawn deferred_xwayland_spawn;
+
+// Creates the filesystem and abstract listening sockets for X display
+// |xdisplay|, the same pair Xwayland itself would create.  With --lazy-init
+// sommelier owns these until Xwayland is spawned on the first connection
+// attempt and inherits them via -listenfd.
+static int sl_listen_x_display(int xdisplay, int* listen_fds) {
+  struct sockaddr_un addr;
+  int rv;
+
+  rv = mkdir(X_SOCKET_DIR, 01777);
+  if (rv < 0 && errno != EEXIST)
+    return -1;
+
+  listen_fds[0] = -1;
+  listen_fds[1] = -1;
+
+  for (int i = 0; i < 2; ++i) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "%s/X%d",
+             X_SOCKET_DIR, xdisplay);
+    socklen_t addrlen =
+        offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+
+    // The abstract socket (i == 0) keeps the leading NUL; the filesystem
+    // socket shifts the path down and unlinks any stale entry first.
+    if (i == 1) {
+      memmove(addr.sun_path, addr.sun_path + 1, strlen(addr.sun_path + 1) + 1);
+      addrlen =
+          offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
+      unlink(addr.sun_path);
+    }
+
+    int fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    errno_assert(fd >= 0);
+
+    rv = bind(fd, (struct sockaddr*)&addr, addrlen);
+    if (rv < 0) {
+      close(fd);
+      for (int j = 0; j < i; ++j) {
+        close(listen_fds[j]);
+        listen_fds[j] = -1;
+      }
+      return -1;
+    }
+
+    rv = listen(fd, 128);
+    errno_assert(rv >= 0);
+
+    listen_fds[i] = fd;
+  }
+
+  return 0;
+}
+
+static int sl_handle_x_socket_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("other", "sl_handle_x_socket_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_deferred_xwayland_spawn* spawn = &deferred_xwayland_spawn;
+
+  // Don't accept the connection; it stays queued on the listening socket
+  // and Xwayland picks it up once it has taken the sockets over.
+  ctx->xwayland_listen_event_source[0].reset();
+  ctx->xwayland_listen_event_source[1].reset();
+
+  sl_spawn_xwayland(ctx, spawn->event_loop, spawn->wayland_socket_fd,
+                    spawn->xwayland_cmd_prefix, spawn->xwayland_path,
+                    spawn->xdisplay, spawn->xauth_path, spawn->xfont_path,
+                    spawn->xwayland_gl_driver_path, spawn->glamor);
+
+  close(spawn->wayland_socket_fd);
+  for (int i = 0; i < 2; ++i) {
+    close(ctx->xwayland_listen_fds[i]);
+    ctx->xwayland_listen_fds[i] = -1;
+  }
+
+  return 1;
+}
+
 int real_main(int argc, char** argv) {
   struct sl_context ctx;
   sl_context_init_default(&ctx);
@@ -3698,6 +4183,7 @@ int real_main(int argc, char** argv) {
   const char* xfont_path = getenv("SOMMELIER_XFONT_PATH");
   const char* vm_id = getenv("SOMMELIER_VM_IDENTIFIER");
   const char* socket_name = "wayland-0";
+  const char* stats_socket_path = NULL;
   bool noop_driver = false;
   struct wl_event_loop* event_loop;
   struct wl_listener client_destroy_listener = {};
@@ -3739,6 +4225,8 @@ int real_main(int argc, char** argv) {
       client_fd = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--direct-scale") == arg) {
       ctx.use_direct_scale = true;
+    } else if (strstr(arg, "--lazy-init") == arg) {
+      ctx.lazy_init = true;
     } else if (strstr(arg, "--scale") == arg) {
       scale = sl_arg_value(arg);
     } else if (strstr(arg, "--dpi") == arg) {
@@ -3788,10 +4276,24 @@ int real_main(int argc, char** argv) {
       xfont_path = sl_arg_value(arg);
     } else if (strstr(arg, "--timing-filename") == arg) {
       ctx.timing = new Timing(sl_arg_value(arg));
+    } else if (strstr(arg, "--stats-socket") == arg) {
+      stats_socket_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--record-stream") == arg) {
+      sl_recording_start(&ctx, sl_arg_value(arg));
+    } else if (strstr(arg, "--transfer-pipe-size") == arg) {
+      ctx.data_transfer_pipe_size = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--relative-pointer-rate") == arg) {
+      ctx.relative_pointer_rate = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--idle-reclaim-delay") == arg) {
+      ctx.idle_reclaim_delay = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--hugepage-buffers") == arg) {
+      sl_mmap_set_hugepages_enabled(true);
     } else if (strstr(arg, "--explicit-fence") == arg) {
       ctx.use_explicit_fence = true;
     } else if (strstr(arg, "--enable-xshape") == arg) {
       ctx.enable_xshape = true;
+    } else if (strstr(arg, "--enable-udmabuf") == arg) {
+      ctx.enable_udmabuf = true;
     } else if (strstr(arg, "--virtgpu-channel") == arg) {
       ctx.use_virtgpu_channel = true;
     } else if (strstr(arg, "--noop-driver") == arg) {
@@ -3801,6 +4303,8 @@ int real_main(int argc, char** argv) {
       ctx.trace_filename = sl_arg_value(arg);
     } else if (strstr(arg, "--trace-system") == arg) {
       ctx.trace_system = true;
+    } else if (strstr(arg, "--trace-sample") == arg) {
+      sl_trace_sample_init(sl_arg_value(arg));
 #endif
     } else if (arg[0] == '-') {
       if (strcmp(arg, "--") == 0) {
@@ -3907,8 +4411,10 @@ int real_main(int argc, char** argv) {
     ctx.channel = NULL;
   } else if (ctx.use_virtgpu_channel) {
     ctx.channel = new VirtGpuChannel();
+    ctx.bulk_channel = new VirtGpuChannel();
   } else {
     ctx.channel = new VirtWaylandChannel();
+    ctx.bulk_channel = new VirtWaylandChannel();
   }
 
   event_loop = wl_display_get_event_loop(ctx.host_display);
@@ -3965,6 +4471,7 @@ int real_main(int argc, char** argv) {
 
   if (ctx.virtwl_display_fd != -1) {
     ctx.display = wl_display_connect_to_fd(ctx.virtwl_display_fd);
+    ctx.host_display_name = "virtwl";
   } else {
     if (display == NULL)
       display = getenv("WAYLAND_DISPLAY");
@@ -3972,6 +4479,7 @@ int real_main(int argc, char** argv) {
       display = "wayland-0";
 
     ctx.display = wl_display_connect(display);
+    ctx.host_display_name = display;
   }
 
   if (!ctx.display) {
@@ -3984,9 +4492,9 @@ int real_main(int argc, char** argv) {
   if (!sl_parse_accelerators(&ctx.windowed_accelerators, windowed_accelerators))
     return EXIT_FAILURE;
 
-  ctx.display_event_source.reset(
-      wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
-                           WL_EVENT_READABLE, sl_handle_event, &ctx));
+  ctx.display_event_source.reset(wl_event_loop_add_fd(
+      sl_context_input_event_loop(&ctx), wl_display_get_fd(ctx.display),
+      WL_EVENT_READABLE, sl_handle_event, &ctx));
 
   wl_registry_add_listener(wl_display_get_registry(ctx.display),
                            &sl_registry_listener, &ctx);
@@ -4009,9 +4517,48 @@ int real_main(int argc, char** argv) {
         wl_event_loop_add_signal(event_loop, SIGCHLD, sl_handle_sigchld, &ctx));
 
     if (ctx.xwayland) {
-      sl_spawn_xwayland(&ctx, event_loop, sv[1], xwayland_cmd_prefix,
-                        xwayland_path, xdisplay, xauth_path, xfont_path,
-                        xwayland_gl_driver_path, glamor);
+      bool defer_spawn = false;
+      if (ctx.lazy_init) {
+        // Deferring the spawn requires owning the X11 sockets up front,
+        // which in turn requires a fixed display number.
+        if (xdisplay > 0) {
+          defer_spawn =
+              sl_listen_x_display(xdisplay, ctx.xwayland_listen_fds) == 0;
+          if (!defer_spawn) {
+            fprintf(stderr,
+                    "warning: unable to listen on X display %d, "
+                    "spawning Xwayland now\n",
+                    xdisplay);
+          }
+        } else {
+          fprintf(stderr,
+                  "warning: --lazy-init requires --x-display, "
+                  "spawning Xwayland now\n");
+        }
+      }
+      if (defer_spawn) {
+        deferred_xwayland_spawn.event_loop = event_loop;
+        deferred_xwayland_spawn.wayland_socket_fd = sv[1];
+        deferred_xwayland_spawn.xwayland_cmd_prefix = xwayland_cmd_prefix;
+        deferred_xwayland_spawn.xwayland_path = xwayland_path;
+        deferred_xwayland_spawn.xdisplay = xdisplay;
+        deferred_xwayland_spawn.xauth_path = xauth_path;
+        deferred_xwayland_spawn.xfont_path = xfont_path;
+        deferred_xwayland_spawn.xwayland_gl_driver_path =
+            xwayland_gl_driver_path;
+        deferred_xwayland_spawn.glamor = glamor;
+        for (i = 0; i < 2; ++i) {
+          ctx.xwayland_listen_event_source[i].reset(wl_event_loop_add_fd(
+              event_loop, ctx.xwayland_listen_fds[i], WL_EVENT_READABLE,
+              sl_handle_x_socket_event, &ctx));
+        }
+        // sv[1] stays open until the deferred spawn consumes it.
+        sv[1] = -1;
+      } else {
+        sl_spawn_xwayland(&ctx, event_loop, sv[1], xwayland_cmd_prefix,
+                          xwayland_path, xdisplay, xauth_path, xfont_path,
+                          xwayland_gl_driver_path, glamor);
+      }
     } else {
       pid = fork();
       errno_assert(pid != -1);
@@ -4024,7 +4571,14 @@ int real_main(int argc, char** argv) {
       }
       ctx.child_pid = pid;
     }
-    close(sv[1]);
+    if (sv[1] >= 0)
+      close(sv[1]);
+  }
+
+  // Serve performance counter dumps on demand.  The counters themselves are
+  // always on; only the export socket is optional.
+  if (stats_socket_path) {
+    sl_counters_listen(&ctx, stats_socket_path);
   }
 
   // Attempt to enable tracing.  This could be called earlier but would rather
@@ -4060,6 +4614,14 @@ int real_main(int argc, char** argv) {
     if (wl_display_flush(ctx.display) < 0)
       return EXIT_FAILURE;
 
+    // Input-bearing fds first: whatever is already pending on the input
+    // loop is handled before the bulk backlog on the main loop, so an X11
+    // property storm or a selection transfer can't starve pointer input.
+    // The low priority handlers all work in bounded chunks, so the next
+    // drain is never more than one main loop callback away.
+    if (ctx.input_event_loop)
+      wl_event_loop_dispatch(ctx.input_event_loop, 0);
+
     if (wl_event_loop_dispatch(event_loop, -1) == -1) {
       // Ignore EINTR or sommelier will exit when attached by strace or gdb.
       if (errno != EINTR)
@@ -108,6 +108,12 @@ struct sl_host_pointer {
   uint32_t time;
   wl_fixed_t axis_delta[2];
   int32_t axis_discrete[2];
+  // Latest unsent motion, coalesced until the host's frame event so a burst
+  // of high-rate motions becomes a single guest-bound event per frame.
+  wl_fixed_t pending_motion_x;
+  wl_fixed_t pending_motion_y;
+  uint32_t pending_motion_time;
+  int motion_pending;
 };
 
 struct sl_relative_pointer_manager {
@@ -127,10 +133,20 @@ struct sl_viewport {
 };
 
 struct sl_host_callback {
+  struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_callback* proxy;
+  // Pending guest frame callbacks queue on sl_host_surface::frame_callbacks
+  // until the frame pacer releases them; freed nodes queue on
+  // sl_context::callback_pool.  Unused by display sync callbacks.
+  struct wl_list link;
 };
 
+// Pooled allocation for the per-frame callback churn; freed nodes are
+// recycled instead of hitting the heap allocator every frame.
+struct sl_host_callback* sl_host_callback_alloc(struct sl_context* ctx);
+void sl_host_callback_free(struct sl_host_callback* callback);
+
 struct sl_host_surface {
   struct sl_context* ctx;
   struct wl_resource* resource;
@@ -151,6 +167,7 @@ struct sl_host_surface {
   struct sl_mmap* contents_shm_mmap;
   bool contents_shaped;
   pixman_region32_t contents_shape;
+  uint64_t contents_shape_generation;
   int has_role;
   int has_output;
   int has_own_scale;
@@ -161,6 +178,74 @@ struct sl_host_surface {
   struct zwp_linux_surface_synchronization_v1* surface_sync;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  // Idle reclaim bookkeeping: when the surface last committed, and its
+  // membership in sl_context::reclaim_surfaces.
+  uint64_t last_commit_ns;
+  struct wl_list reclaim_link;
+  // Adaptive staging (see sl_surface_staging_* in sommelier-compositor.cc):
+  // whether new output buffers for this surface are dmabufs or shm, the
+  // contents size that choice was made for, EWMAs of the measured per-commit
+  // copy+sync cost for each type ([0] = shm, [1] = dmabuf) and the number of
+  // commits since the last re-evaluation.
+  bool staging_dmabuf;
+  uint32_t staging_width;
+  uint32_t staging_height;
+  int64_t staging_cost_ns[2];
+  int staging_commits;
+  // Copy+sync cost accumulated for the commit currently in flight.
+  int64_t staging_frame_ns;
+  // Guest damage accumulated since the last commit and forwarded to the host
+  // in one batch at commit time; damage is double-buffered state, so this is
+  // equivalent to forwarding each rect as it arrives. Surface and buffer
+  // coordinates accumulate separately as they transform differently.
+  pixman_region32_t pending_damage_surface;
+  pixman_region32_t pending_damage_buffer;
+  // Copy/convert/shape work for the last commit, while it is staged on the
+  // render thread.  NULL when no commit is in flight.
+  struct sl_render_job* render_job;
+  // Synchronized-subsurface batching (see sl_host_surface_commit()):
+  // surfaces holding a subsurface role on this one, this surface's link in
+  // its parent's list, and whether a synchronized commit is staged awaiting
+  // the parent.  A parent commit drains the staged child jobs so the whole
+  // tree's host commits go out back to back ahead of a single flush.
+  struct wl_list sub_surfaces;
+  struct wl_list sub_link;
+  struct sl_host_surface* sub_parent;
+  bool sub_sync;
+  bool sub_commit_pending;
+  bool sub_flush_pending;
+  // Visibility-aware commits, driven by the window's aura occlusion state:
+  // while hidden, commits skip the staging copy and the host commit, the
+  // pooled output buffers keep accumulating damage, and the latest client
+  // buffer is held as copy source so one consolidated commit can be
+  // replayed on re-expose.
+  bool hidden;
+  bool hidden_commit_pending;
+  // Attach staged behind the buffer's acquire fence, forwarded together
+  // with any commit that arrives meanwhile once the fence signals.  See
+  // sl_host_surface_attach().
+  struct wl_event_source* fence_event_source;
+  int fence_fd;  // Owned sync file fd, or -1 when polling the dmabuf.
+  struct wl_buffer* fence_attach_buffer;
+  int32_t fence_attach_x;
+  int32_t fence_attach_y;
+  bool fence_commit_pending;
+  // Frame callback pacing (see sl_host_surface_frame()).  Guest callbacks
+  // queue here until the pacer fires them from a local timer at the host's
+  // learned refresh, or, once the surface has run ahead of the host, when
+  // the host's own frame callback arrives.
+  struct wl_list frame_callbacks;
+  // Host-side callback observing the host's effective refresh; at most one
+  // in flight.
+  struct wl_callback* frame_tracking_proxy;
+  struct wl_event_source* frame_timer;
+  // EWMA of host frame callback inter-arrival time, in microseconds.
+  int64_t frame_period_us;
+  int64_t last_host_frame_us;
+  int64_t last_guest_frame_us;
+  // Guest callbacks fired since the host last confirmed a frame; when this
+  // reaches the pacer's limit, further callbacks wait for the host.
+  int frame_credit_used;
   WeakResourcePtr<sl_host_output> output;
 };
 MAP_STRUCTS(wl_surface, sl_host_surface);
@@ -182,11 +267,23 @@ struct sl_host_buffer {
   uint32_t shm_format;
   struct sl_sync_point* sync_point;
   bool is_drm;
+  // True for udmabuf-backed wl_shm buffers: |proxy| scans out of the
+  // client's own pool pages, so a re-attach before the host has released
+  // the buffer must fall back to the staging copy path (using |shm_mmap|)
+  // instead of letting the client draw into the frame being presented.
+  bool zero_copy;
+  // When this buffer was last attached, for the release latency histogram
+  // in sl_counters.  0 when no release is outstanding.
+  int64_t attach_time_ns;
 };
 
 struct sl_data_source_send_request {
   int fd;
+  // Resolved target atom, or XCB_ATOM_NONE when `cookie` holds a pending
+  // intern request for `mime_type` (owned).
+  xcb_atom_t atom;
   xcb_intern_atom_cookie_t cookie;
+  char* mime_type;
   struct sl_data_source* data_source;
   struct wl_list link;
 };
@@ -246,6 +343,10 @@ struct sl_host_output {
   int device_scale_factor;
   int expecting_scale;
   bool expecting_logical_size;
+  // Set by the wl_output/zaura_output/zxdg_output listeners as host state
+  // trickles in; the accumulated state is flushed to clients in one batch
+  // at wl_output.done (see sl_output_done()).
+  bool dirty;
 
   // The scaling factors for direct mode
   // virt_scale: Used to translate from physical space to virtual space
@@ -300,11 +401,20 @@ struct sl_data_device_manager {
   struct wl_data_device_manager* internal;
 };
 
+// A mime type advertised on a data offer.  Types already in the context's
+// atom cache resolve immediately; otherwise `name` (owned) holds the type
+// until sl_set_selection() collects the intern reply and caches it.
+struct sl_data_offer_mime_type {
+  xcb_atom_t atom;  // XCB_ATOM_NONE until resolved.
+  xcb_intern_atom_cookie_t cookie;
+  char* name;  // NULL once resolved.
+};
+
 struct sl_data_offer {
   struct sl_context* ctx;
   struct wl_data_offer* internal;
-  struct wl_array atoms;    // Contains xcb_atom_t
-  struct wl_array cookies;  // Contains xcb_intern_atom_cookie_t
+  struct wl_array atoms;       // Contains xcb_atom_t
+  struct wl_array mime_types;  // Contains sl_data_offer_mime_type
 };
 
 struct sl_text_input_manager {
@@ -396,6 +506,8 @@ struct sl_sync_point {
 };
 
 #ifdef GAMEPAD_SUPPORT
+#include <linux/input.h>
+
 struct sl_host_gamepad {
   struct sl_context* ctx;
   int state;
@@ -403,6 +515,10 @@ struct sl_host_gamepad {
   struct libevdev_uinput* uinput_dev;
   bool axes_quirk;
   struct wl_list link;
+  // Events staged between zcr_gamepad_v2 frame boundaries, submitted to
+  // uinput in a single write at frame time.
+  struct input_event frame_events[64];
+  size_t frame_event_count;
 };
 #endif
 
@@ -420,10 +536,30 @@ void sl_compositor_init_context(struct sl_context* ctx,
                                 uint32_t id,
                                 uint32_t version);
 
+// Waits for |host|'s commit, if one is still staged on the render thread,
+// and finishes it.  Must be called before committing the host surface's
+// proxy from outside the compositor module.
+void sl_host_surface_render_sync(struct sl_host_surface* host);
+
+// Marks |host| hidden (minimized or fully occluded) or visible.  Hidden
+// surfaces suppress commit staging; turning visible replays the commits
+// skipped meanwhile as one consolidated copy-and-commit.
+void sl_host_surface_set_hidden(struct sl_host_surface* host, bool hidden);
+
 size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
 
+bool sl_udmabuf_supported(void);
+
+struct wl_buffer* sl_udmabuf_create_buffer(struct sl_context* ctx,
+                                           int shm_fd,
+                                           uint32_t offset,
+                                           uint32_t width,
+                                           uint32_t height,
+                                           uint32_t stride,
+                                           uint32_t shm_format);
+
 struct sl_global* sl_shm_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_subcompositor_global_create(struct sl_context* ctx);
@@ -476,6 +612,24 @@ void sl_roundtrip(struct sl_context* ctx);
 struct sl_window* sl_lookup_window(struct sl_context* ctx, xcb_window_t id);
 int sl_is_our_window(struct sl_context* ctx, xcb_window_t id);
 
+// Queues an XCB reply for collection after the current burst of X events has
+// been processed, so that consecutive events cost one pipelined round trip
+// instead of a blocking round trip each.  |sequence| is the request cookie's
+// sequence number.  |func| receives the raw reply, or NULL on error, and is
+// responsible for freeing it.  |data| is typically a window id; callbacks
+// must look windows up again as a later event in the same burst may have
+// destroyed them.
+void sl_xcb_collect_reply(struct sl_context* ctx,
+                          unsigned int sequence,
+                          void (*func)(struct sl_context* ctx,
+                                       void* reply,
+                                       uint32_t data),
+                          uint32_t data);
+
+// Collects all queued replies in submission order.  Called when the X event
+// queue has drained; also safe to call when nothing is pending.
+void sl_xcb_collect_pending_replies(struct sl_context* ctx);
+
 // Exported for testing
 void sl_handle_destroy_notify(struct sl_context* ctx,
                               xcb_destroy_notify_event_t* event);
@@ -0,0 +1,274 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmarks for the per-frame kernels: the damage copy
+// (sl_copy_rows_parallel), shape stamping (sl_xshape_generate_argb_image)
+// and the coordinate transforms (sl_transform_*), each measured in
+// isolation so copy-path changes can be quantified without a full replay.
+// Results are ns per operation plus GB/s where the kernel moves pixels:
+//
+//   sommelier_microbench [--filter=SUBSTRING]
+
+#include <string>
+#include <vector>
+
+#include <pixman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sommelier.h"            // NOLINT(build/include_directory)
+#include "sommelier-transform.h"  // NOLINT(build/include_directory)
+#include "sommelier-xshape.h"     // NOLINT(build/include_directory)
+#include "compositor/sommelier-copy.h"  // NOLINT(build/include_directory)
+
+namespace {
+
+const char* bench_filter = "";
+
+// Sink for transform results so the compiler cannot elide the loops.
+volatile int64_t bench_sink = 0;
+
+int64_t bench_now_ns() {
+  timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+bool bench_enabled(const char* name) {
+  return strstr(name, bench_filter) != NULL;
+}
+
+void bench_report(const char* name,
+                  uint64_t ops,
+                  uint64_t bytes,
+                  int64_t elapsed_ns) {
+  if (bytes) {
+    printf("%-48s %10.1f ns/op %8.2f GB/s\n", name,
+           static_cast<double>(elapsed_ns) / ops,
+           static_cast<double>(bytes) / elapsed_ns);
+  } else {
+    printf("%-48s %10.1f ns/op\n", name,
+           static_cast<double>(elapsed_ns) / ops);
+  }
+}
+
+// Copies a width x height frame of |bpp| bytes per pixel, split into
+// |rect_count| horizontal bands, the same shape of work a commit with that
+// many damage rects produces.  |stride_pad| adds bytes of per-row slack so
+// the partial-stride (non-contiguous) path is exercised too.
+void bench_copy(const char* name,
+                int32_t width,
+                int32_t height,
+                size_t bpp,
+                int rect_count,
+                size_t stride_pad,
+                bool non_temporal) {
+  if (!bench_enabled(name))
+    return;
+
+  size_t stride = width * bpp + stride_pad;
+  size_t frame_bytes = stride * height;
+  uint8_t* src = static_cast<uint8_t*>(malloc(frame_bytes));
+  uint8_t* dst = static_cast<uint8_t*>(malloc(frame_bytes));
+
+  memset(src, 0x5a, frame_bytes);
+  memset(dst, 0, frame_bytes);
+
+  std::vector<struct sl_copy_task> tasks;
+  int32_t band_height = height / rect_count;
+  for (int i = 0; i < rect_count; ++i) {
+    int32_t y1 = i * band_height;
+    int32_t y2 = (i == rect_count - 1) ? height : y1 + band_height;
+    tasks.push_back({dst + y1 * stride, src + y1 * stride,
+                     static_cast<size_t>(width) * bpp, stride, stride,
+                     y2 - y1, non_temporal});
+  }
+
+  // Size the run so each case moves roughly the same amount of data.
+  uint64_t copied_bytes = static_cast<uint64_t>(width) * bpp * height;
+  int iterations = MAX(1, static_cast<int>((512 << 20) / copied_bytes));
+
+  sl_copy_rows_parallel(tasks.data(), tasks.size());  // Warm the pool.
+
+  int64_t start_ns = bench_now_ns();
+  for (int i = 0; i < iterations; ++i)
+    sl_copy_rows_parallel(tasks.data(), tasks.size());
+  bench_report(name, iterations, copied_bytes * iterations,
+               bench_now_ns() - start_ns);
+
+  free(src);
+  free(dst);
+}
+
+// Stamps a width x height ARGB image through a shape made of
+// tiles_per_axis^2 / 2 rectangles (a checkerboard; 1 means the full
+// frame), covering the simple-shape and complex-shape ends of the path.
+void bench_xshape(struct sl_context* ctx,
+                  const char* name,
+                  int32_t width,
+                  int32_t height,
+                  int tiles_per_axis) {
+  if (!bench_enabled(name))
+    return;
+
+  size_t stride = width * 4;
+  size_t frame_bytes = stride * height;
+  int fd = memfd_create("sommelier-microbench", MFD_CLOEXEC);
+  errno_assert(fd >= 0);
+  errno_assert(!ftruncate(fd, frame_bytes));
+
+  struct sl_mmap* src_mmap =
+      sl_mmap_create(fd, frame_bytes, 4, 1, 0, stride, 0, 0, 1, 1);
+  memset(src_mmap->addr, 0x5a, frame_bytes);
+
+  pixman_image_t* dst_image =
+      pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, NULL, 0);
+
+  pixman_region32_t shape;
+  pixman_region32_init(&shape);
+  if (tiles_per_axis <= 1) {
+    pixman_region32_union_rect(&shape, &shape, 0, 0, width, height);
+  } else {
+    int32_t tile_w = width / tiles_per_axis;
+    int32_t tile_h = height / tiles_per_axis;
+    for (int ty = 0; ty < tiles_per_axis; ++ty) {
+      for (int tx = (ty & 1); tx < tiles_per_axis; tx += 2) {
+        pixman_region32_union_rect(&shape, &shape, tx * tile_w, ty * tile_h,
+                                   tile_w, tile_h);
+      }
+    }
+  }
+
+  int iterations = MAX(1, static_cast<int>((256 << 20) / frame_bytes));
+  int64_t start_ns = bench_now_ns();
+  for (int i = 0; i < iterations; ++i) {
+    sl_xshape_generate_argb_image(ctx, &shape, NULL, src_mmap, dst_image,
+                                  WL_SHM_FORMAT_ARGB8888);
+  }
+  bench_report(name, iterations, static_cast<uint64_t>(frame_bytes) * iterations,
+               bench_now_ns() - start_ns);
+
+  pixman_region32_fini(&shape);
+  pixman_image_unref(dst_image);
+  sl_mmap_unref(src_mmap);  // Closes fd.
+}
+
+// Runs the transform kernels with whatever scale mode |ctx| and |surface|
+// are configured for.  |mode| tags the output rows.
+void bench_transforms(struct sl_context* ctx,
+                      struct sl_host_surface* surface,
+                      const char* mode) {
+  const int kIterations = 1 << 20;
+  char name[64];
+  int64_t acc = 0;
+
+  snprintf(name, sizeof(name), "transform_guest_to_host_%s", mode);
+  if (bench_enabled(name)) {
+    int64_t start_ns = bench_now_ns();
+    for (int i = 0; i < kIterations; ++i) {
+      int32_t x = i & 0xfff, y = (i >> 1) & 0xfff;
+      sl_transform_guest_to_host(ctx, surface, &x, &y);
+      acc += x + y;
+    }
+    bench_report(name, kIterations, 0, bench_now_ns() - start_ns);
+  }
+
+  snprintf(name, sizeof(name), "transform_host_to_guest_%s", mode);
+  if (bench_enabled(name)) {
+    int64_t start_ns = bench_now_ns();
+    for (int i = 0; i < kIterations; ++i) {
+      int32_t x = i & 0xfff, y = (i >> 1) & 0xfff;
+      sl_transform_host_to_guest(ctx, surface, &x, &y);
+      acc += x + y;
+    }
+    bench_report(name, kIterations, 0, bench_now_ns() - start_ns);
+  }
+
+  snprintf(name, sizeof(name), "transform_guest_to_host_fixed_%s", mode);
+  if (bench_enabled(name)) {
+    int64_t start_ns = bench_now_ns();
+    for (int i = 0; i < kIterations; ++i) {
+      wl_fixed_t x = i & 0xffff, y = (i >> 1) & 0xffff;
+      sl_transform_guest_to_host_fixed(ctx, surface, &x, &y);
+      acc += x + y;
+    }
+    bench_report(name, kIterations, 0, bench_now_ns() - start_ns);
+  }
+
+  snprintf(name, sizeof(name), "transform_damage_rects_64_%s", mode);
+  if (bench_enabled(name)) {
+    const int kRects = 64;
+    const int kBatches = 1 << 14;
+    pixman_box32_t rects[kRects];
+    int64_t start_ns = bench_now_ns();
+    for (int i = 0; i < kBatches; ++i) {
+      for (int j = 0; j < kRects; ++j) {
+        rects[j].x1 = j * 8;
+        rects[j].y1 = j * 4;
+        rects[j].x2 = rects[j].x1 + 32;
+        rects[j].y2 = rects[j].y1 + 32;
+      }
+      sl_transform_damage_rects(ctx, surface, 1.0, 1.0, rects, kRects);
+      acc += rects[kRects - 1].x2;
+    }
+    bench_report(name, static_cast<uint64_t>(kBatches) * kRects, 0,
+                 bench_now_ns() - start_ns);
+  }
+
+  bench_sink = acc;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (strstr(argv[i], "--filter=") == argv[i]) {
+      bench_filter = argv[i] + strlen("--filter=");
+    } else {
+      fprintf(stderr, "usage: sommelier_microbench [--filter=SUBSTRING]\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Copy kernel: full-frame and fragmented damage, both store types, the
+  // formats the copy path sees (32 and 16 bpp) and a padded stride.
+  bench_copy("copy_1080p_1rect", 1920, 1080, 4, 1, 0, false);
+  bench_copy("copy_1080p_1rect_nt", 1920, 1080, 4, 1, 0, true);
+  bench_copy("copy_1080p_16rects", 1920, 1080, 4, 16, 0, false);
+  bench_copy("copy_1080p_256rects", 1920, 1080, 4, 256, 0, false);
+  bench_copy("copy_1080p_1rect_rgb565", 1920, 1080, 2, 1, 0, false);
+  bench_copy("copy_1080p_1rect_padded_stride", 1920, 1080, 4, 1, 256, false);
+  bench_copy("copy_4k_1rect_nt", 3840, 2160, 4, 1, 0, true);
+
+  struct sl_context ctx;
+  sl_context_init_default(&ctx);
+
+  // Shape stamping: a trivial full-frame shape against checkerboards of
+  // increasing rectangle counts.
+  bench_xshape(&ctx, "xshape_1080p_full", 1920, 1080, 1);
+  bench_xshape(&ctx, "xshape_1080p_32rects", 1920, 1080, 8);
+  bench_xshape(&ctx, "xshape_1080p_512rects", 1920, 1080, 32);
+
+  // Transforms, with non-unit scales so the multiply/divide paths run.
+  struct sl_host_surface surface = {};
+  surface.scale_round_on_x = true;
+  surface.scale_round_on_y = true;
+
+  ctx.scale = 1.25;
+  ctx.xdg_scale_x = 1.25;
+  ctx.xdg_scale_y = 1.25;
+  bench_transforms(&ctx, &surface, "legacy");
+
+  ctx.use_direct_scale = true;
+  surface.has_own_scale = 1;
+  surface.xdg_scale_x = 1.6;
+  surface.xdg_scale_y = 1.6;
+  bench_transforms(&ctx, &surface, "direct");
+
+  return EXIT_SUCCESS;
+}
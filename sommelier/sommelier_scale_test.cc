@@ -0,0 +1,166 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Scalability regression suite: deployments run 50+ X11 windows per
+// instance, where linear walks over ctx->windows and per-window work start
+// to dominate per-event cost.  Each test grows the window population
+// through kSmall/kLarge and asserts that the measured per-event cost does
+// not grow superlinearly, catching accidental O(n^2) behavior in window
+// creation, lookup, restacking and registry bookkeeping before it ships.
+//
+// The bounds are scaling ratios rather than absolute times, so they hold
+// on slow or loaded builders: growing the population 100x may make a
+// per-event cost at most kMaxCostRatio (25x) more expensive, well above
+// the noise of a linear walk but far below the 100x a quadratic walk
+// would show.
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+#include <wayland-server.h>
+#include <xcb/xcb.h>
+
+#include "sommelier.h"           // NOLINT(build/include_directory)
+#include "sommelier-counters.h"  // NOLINT(build/include_directory)
+#include "sommelier-global.h"    // NOLINT(build/include_directory)
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+// Window populations the per-event costs are compared across.
+constexpr int kSmall = 10;
+constexpr int kLarge = 1000;
+
+// Allowed growth of a per-event cost when the population grows 100x.
+constexpr int kMaxCostRatio = 25;
+
+}  // namespace
+
+// Fixture with a context but no host connection: the X11 side talks to an
+// xcb error connection, which accepts and discards requests, so the paths
+// under test run their full bookkeeping without a server.
+class ScalabilityTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    sl_context_init_default(&ctx);
+    ctx.host_display = wl_display_create();
+    ASSERT_NE(ctx.host_display, nullptr);
+    ctx.xwayland = 1;
+    ctx.connection = xcb_connect(NULL, NULL);
+  }
+
+ protected:
+  // Creates windows with ids (next_window_id_ .. next_window_id_ + count)
+  // and returns the average creation cost in ns.  Created windows are moved
+  // onto ctx->windows and marked managed so sl_restack_windows() sees them,
+  // mirroring the state of a mapped X11 window.
+  int64_t CreateWindows(int count) {
+    int64_t start_ns = sl_counters_now_ns();
+    for (int i = 0; i < count; i++) {
+      xcb_window_t id = next_window_id_++;
+      sl_create_window(&ctx, id, 0, 0, 64, 64, 0);
+      sl_window* window = sl_lookup_window(&ctx, id);
+      EXPECT_NE(window, nullptr);
+      wl_list_remove(&window->link);
+      wl_list_insert(&ctx.windows, &window->link);
+      window->managed = 1;
+      window->frame_id = id;
+    }
+    return (sl_counters_now_ns() - start_ns) / count;
+  }
+
+  sl_context ctx;
+  xcb_window_t next_window_id_ = 1;
+};
+
+TEST_F(ScalabilityTest, WindowCreationCostStaysFlat) {
+  // Warm up allocators and the index before the measured phases.
+  CreateWindows(kSmall);
+
+  int64_t small_ns = CreateWindows(kSmall);
+  while (next_window_id_ <= kLarge)
+    CreateWindows(kSmall);
+  int64_t large_ns = CreateWindows(kSmall);
+
+  // Creation inserts into a list and a hash index; both are O(1), so the
+  // per-window cost must not track the population.
+  EXPECT_LE(large_ns, std::max<int64_t>(small_ns, 1) * kMaxCostRatio)
+      << "per-window creation cost grew from " << small_ns << "ns to "
+      << large_ns << "ns";
+}
+
+TEST_F(ScalabilityTest, WindowLookupCostStaysFlat) {
+  constexpr int kLookups = 100000;
+
+  auto time_lookups = [&]() {
+    // Misses bound the cost from above: an indexed lookup pays the same
+    // either way, while a linear scan pays its full length.
+    int64_t start_ns = sl_counters_now_ns();
+    for (int i = 0; i < kLookups; i++)
+      EXPECT_EQ(sl_lookup_window(&ctx, 0x7fffffff), nullptr);
+    return (sl_counters_now_ns() - start_ns) / kLookups;
+  };
+
+  CreateWindows(kSmall);
+  int64_t small_ns = time_lookups();
+  CreateWindows(kLarge - kSmall);
+  int64_t large_ns = time_lookups();
+
+  EXPECT_LE(large_ns, std::max<int64_t>(small_ns, 1) * kMaxCostRatio)
+      << "per-lookup cost grew from " << small_ns << "ns to " << large_ns
+      << "ns";
+}
+
+TEST_F(ScalabilityTest, RestackCostIsLinearInWindows) {
+  constexpr int kRestacks = 200;
+
+  // Restacking inherently touches every managed window once; the guarded
+  // quantity is the cost per window touched.
+  auto time_restack_per_window = [&](int population) {
+    int64_t start_ns = sl_counters_now_ns();
+    for (int i = 0; i < kRestacks; i++)
+      sl_restack_windows(&ctx, 1 /* focus_resource_id */);
+    return (sl_counters_now_ns() - start_ns) / (kRestacks * population);
+  };
+
+  CreateWindows(kSmall);
+  int64_t small_ns = time_restack_per_window(kSmall);
+  CreateWindows(kLarge - kSmall);
+  int64_t large_ns = time_restack_per_window(kLarge);
+
+  EXPECT_LE(large_ns, std::max<int64_t>(small_ns, 1) * kMaxCostRatio)
+      << "per-window restack cost grew from " << small_ns << "ns to "
+      << large_ns << "ns";
+}
+
+TEST_F(ScalabilityTest, GlobalRegistrationCostStaysFlat) {
+  // Registry bookkeeping: every sl_global_create() appends to ctx->globals
+  // and broadcasts to each bound registry.  A scan of the existing globals
+  // on insert would make advertising the Nth global O(N).
+  auto time_globals = [&](int count) {
+    int64_t start_ns = sl_counters_now_ns();
+    for (int i = 0; i < count; i++)
+      sl_global_create(&ctx, &wl_output_interface, 1, &ctx, nullptr);
+    return (sl_counters_now_ns() - start_ns) / count;
+  };
+
+  time_globals(kSmall);  // Warm up.
+  int64_t small_ns = time_globals(kSmall);
+  time_globals(kLarge);
+  int64_t large_ns = time_globals(kSmall);
+
+  EXPECT_LE(large_ns, std::max<int64_t>(small_ns, 1) * kMaxCostRatio)
+      << "per-global registration cost grew from " << small_ns << "ns to "
+      << large_ns << "ns";
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,134 @@
+// Copyright 2023 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "wayland_channel.h"  // NOLINT(build/include_directory)
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+ChannelAllocator::ChannelAllocator(WaylandChannel* channel, bool dedicated)
+    : channel_(channel), dedicated_(dedicated) {
+  completion_fd_ = eventfd(0, EFD_CLOEXEC);
+  assert(completion_fd_ >= 0);
+
+  // A shared channel is also driven by the event loop's protocol traffic and
+  // must never be entered from another thread, so the worker only exists for
+  // a dedicated channel.
+  if (!dedicated_)
+    return;
+
+  // Like the channel itself, the allocator lives for the lifetime of the
+  // process, so the worker is simply detached.
+  std::thread worker(&ChannelAllocator::worker, this);
+  worker.detach();
+}
+
+void ChannelAllocator::allocate(
+    const struct WaylandBufferCreateInfo& create_info,
+    CompletionFunc callback,
+    void* data) {
+  Request* request = new Request();
+
+  request->create_info = create_info;
+  memset(&request->create_output, 0, sizeof(request->create_output));
+  request->rv = 0;
+  request->callback = callback;
+  request->data = data;
+  request->done = false;
+
+  if (!dedicated_) {
+    // Allocate inline on the caller's thread, but still deliver the
+    // completion from dispatch() so callers see one calling convention.
+    request->rv = channel_->allocate(request->create_info,
+                                     request->create_output);
+    request->done = true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    completed_.push_back(request);
+
+    uint64_t count = 1;
+    ssize_t bytes = write(completion_fd_, &count, sizeof(count));
+    assert(bytes == sizeof(count));
+    (void)bytes;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back(request);
+  pending_cv_.notify_one();
+}
+
+int32_t ChannelAllocator::allocate_sync(
+    const struct WaylandBufferCreateInfo& create_info,
+    struct WaylandBufferCreateOutput& create_output) {
+  if (!dedicated_)
+    return channel_->allocate(create_info, create_output);
+
+  Request request;
+
+  request.create_info = create_info;
+  memset(&request.create_output, 0, sizeof(request.create_output));
+  request.rv = 0;
+  request.callback = NULL;
+  request.data = NULL;
+  request.done = false;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.push_back(&request);
+  pending_cv_.notify_one();
+  done_cv_.wait(lock, [&request] { return request.done; });
+
+  create_output = request.create_output;
+  return request.rv;
+}
+
+void ChannelAllocator::worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    pending_cv_.wait(lock, [this] { return !pending_.empty(); });
+    Request* request = pending_.front();
+    pending_.pop_front();
+
+    lock.unlock();
+    request->rv = channel_->allocate(request->create_info,
+                                     request->create_output);
+    lock.lock();
+
+    request->done = true;
+    if (request->callback) {
+      completed_.push_back(request);
+
+      uint64_t count = 1;
+      ssize_t bytes = write(completion_fd_, &count, sizeof(count));
+      assert(bytes == sizeof(count));
+      (void)bytes;
+    } else {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+void ChannelAllocator::dispatch() {
+  uint64_t count;
+  ssize_t bytes = read(completion_fd_, &count, sizeof(count));
+  (void)bytes;
+
+  while (true) {
+    Request* request;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (completed_.empty())
+        return;
+      request = completed_.front();
+      completed_.pop_front();
+    }
+
+    request->callback(request->rv, &request->create_output, request->data);
+    delete request;
+  }
+}
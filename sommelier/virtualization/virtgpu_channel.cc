@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -36,10 +37,16 @@
 #define DRM_RENDER_NODE_START 128
 
 #define MAX_SEND_SIZE \
+  (MAX_BUFFER_SIZE - sizeof(struct CrossDomainSendReceive))
+#define LEGACY_SEND_SIZE \
   (DEFAULT_BUFFER_SIZE - sizeof(struct CrossDomainSendReceive))
 #define MAX_WRITE_SIZE \
   (DEFAULT_BUFFER_SIZE - sizeof(struct CrossDomainReadWrite))
 
+// Upper bound on cached image descriptions; enough for many distinct window
+// sizes without letting a long session grow the cache indefinitely.
+#define MAX_IMAGE_CACHE_ENTRIES 256
+
 struct virtgpu_param {
   uint64_t param;
   const char* name;
@@ -275,6 +282,16 @@ int32_t VirtGpuChannel::create_context(int& out_channel_fd) {
   return 0;
 }
 
+int32_t VirtGpuChannel::create_allocation_context(void) {
+  int channel_fd;
+
+  // Metadata queries wait on the shared ring, so an allocation-only
+  // instance still needs the full context bring-up.  The host side Wayland
+  // connection this creates sits idle; that is the price of keeping
+  // allocation round trips off the protocol context's queue.
+  return create_context(channel_fd);
+}
+
 int32_t VirtGpuChannel::create_pipe(int& out_pipe_fd) {
   // This may be undesirable given your point of view, since the host
   // generates the descriptor IDs.  However, given the way Sommelier is
@@ -290,14 +307,8 @@ int32_t VirtGpuChannel::create_pipe(int& out_pipe_fd) {
 
 int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
   int32_t ret;
-  uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
-
   struct CrossDomainSendReceive* cmd_send =
-      (struct CrossDomainSendReceive*)cmd_buffer;
-
-  void* send_data = &cmd_buffer[sizeof(struct CrossDomainSendReceive)];
-
-  memset(cmd_send, 0, sizeof(struct CrossDomainSendReceive));
+      (struct CrossDomainSendReceive*)send_buffer_;
 
   if (send.data_size > max_send_size())
     return -EINVAL;
@@ -305,29 +316,123 @@ int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
   if (send.num_fds > CROSS_DOMAIN_MAX_IDENTIFIERS)
     return -EINVAL;
 
-  cmd_send->hdr.cmd = CROSS_DOMAIN_CMD_SEND;
-  cmd_send->hdr.cmd_size =
-      sizeof(struct CrossDomainSendReceive) + send.data_size;
+  // The host treats the opaque payload as a byte stream to the compositor
+  // socket and fds attached to a send may arrive ahead of the message that
+  // references them, so back-to-back sends can be merged into a single
+  // command as long as the payload and identifier limits hold.  Flush the
+  // pending command first when this one doesn't fit.
+  if (send_pending_ &&
+      (cmd_send->opaque_data_size + send.data_size > max_send_size() ||
+       cmd_send->num_identifiers + send.num_fds >
+           CROSS_DOMAIN_MAX_IDENTIFIERS)) {
+    ret = flush();
+    if (ret < 0)
+      return ret;
+  }
+
+  if (!send_pending_) {
+    memset(cmd_send, 0, sizeof(struct CrossDomainSendReceive));
+    cmd_send->hdr.cmd = CROSS_DOMAIN_CMD_SEND;
+    send_pending_ = true;
+  }
+
+  void* send_data = &send_buffer_[sizeof(struct CrossDomainSendReceive) +
+                                  cmd_send->opaque_data_size];
 
   memcpy(send_data, send.data, send.data_size);
-  cmd_send->opaque_data_size = send.data_size;
+  cmd_send->opaque_data_size += send.data_size;
 
-  for (uint32_t i = 0; i < CROSS_DOMAIN_MAX_IDENTIFIERS; i++) {
-    if (i >= send.num_fds)
-      break;
+  for (uint32_t i = 0; i < send.num_fds; i++) {
+    uint32_t identifier_index = cmd_send->num_identifiers;
 
-    ret = fd_analysis(send.fds[i], cmd_send->identifiers[i],
-                      cmd_send->identifier_types[i]);
+    ret = fd_analysis(send.fds[i], cmd_send->identifiers[identifier_index],
+                      cmd_send->identifier_types[identifier_index]);
     if (ret)
       return ret;
 
     cmd_send->num_identifiers++;
   }
 
+  return 0;
+}
+
+int32_t VirtGpuChannel::flush() {
+  int32_t ret;
+  struct CrossDomainSendReceive* cmd_send =
+      (struct CrossDomainSendReceive*)send_buffer_;
+
+  if (!send_pending_)
+    return 0;
+
+  cmd_send->hdr.cmd_size =
+      sizeof(struct CrossDomainSendReceive) + cmd_send->opaque_data_size;
+  send_pending_ = false;
+
+  // After the downgrade, an oversized batch can still show up once: a
+  // message validated against the old limit while in flight through send()
+  // is appended after the inner flush that downgraded.  Fragment it up
+  // front rather than letting the legacy host reject it for good.
+  if (!large_sends_ && cmd_send->opaque_data_size > LEGACY_SEND_SIZE)
+    return flush_fragmented(cmd_send);
+
   ret = submit_cmd((uint32_t*)cmd_send, cmd_send->hdr.cmd_size,
                    CROSS_DOMAIN_RING_NONE, false);
-  if (ret < 0)
+  if (ret < 0) {
+    // A host that only accepts page-sized commands rejects the first
+    // oversized batch; fall back to fragmenting it (and all future ones).
+    if (large_sends_ && cmd_send->opaque_data_size > LEGACY_SEND_SIZE) {
+      large_sends_ = false;
+      return flush_fragmented(cmd_send);
+    }
     return ret;
+  }
+
+  return 0;
+}
+
+int32_t VirtGpuChannel::flush_fragmented(
+    struct CrossDomainSendReceive* cmd_send) {
+  int32_t ret;
+  uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
+  struct CrossDomainSendReceive* cmd_chunk =
+      (struct CrossDomainSendReceive*)cmd_buffer;
+  const uint8_t* data =
+      (uint8_t*)cmd_send + sizeof(struct CrossDomainSendReceive);
+  size_t remaining = cmd_send->opaque_data_size;
+  bool first = true;
+
+  // The host treats the opaque payload as a byte stream to the compositor
+  // socket and fds may arrive ahead of the message that references them, so
+  // splitting the batch into page-sized commands with the identifiers on the
+  // first one is equivalent.
+  while (remaining > 0 || first) {
+    size_t chunk = remaining < LEGACY_SEND_SIZE ? remaining : LEGACY_SEND_SIZE;
+
+    memset(cmd_chunk, 0, sizeof(struct CrossDomainSendReceive));
+    cmd_chunk->hdr.cmd = CROSS_DOMAIN_CMD_SEND;
+    cmd_chunk->hdr.cmd_size = sizeof(struct CrossDomainSendReceive) + chunk;
+    cmd_chunk->opaque_data_size = chunk;
+
+    if (first) {
+      cmd_chunk->num_identifiers = cmd_send->num_identifiers;
+      for (uint32_t i = 0; i < cmd_send->num_identifiers; i++) {
+        cmd_chunk->identifiers[i] = cmd_send->identifiers[i];
+        cmd_chunk->identifier_types[i] = cmd_send->identifier_types[i];
+        cmd_chunk->identifier_sizes[i] = cmd_send->identifier_sizes[i];
+      }
+    }
+
+    memcpy(&cmd_buffer[sizeof(struct CrossDomainSendReceive)], data, chunk);
+
+    ret = submit_cmd((uint32_t*)cmd_chunk, cmd_chunk->hdr.cmd_size,
+                     CROSS_DOMAIN_RING_NONE, false);
+    if (ret < 0)
+      return ret;
+
+    data += chunk;
+    remaining -= chunk;
+    first = false;
+  }
 
   return 0;
 }
@@ -357,6 +462,12 @@ int32_t VirtGpuChannel::handle_channel_event(
     ret = handle_receive(event_type, receive, out_read_pipe);
     if (ret)
       return ret;
+
+    // The returned receive.data points into the ring, so polling resumes
+    // from receive_done() once the caller has forwarded it; polling now
+    // would let the host overwrite the data while it is still in flight.
+    poll_pending_ = true;
+    return 0;
   } else if (cmd_hdr->cmd == CROSS_DOMAIN_CMD_READ) {
     event_type = WaylandChannelEvent::Read;
     ret = handle_read();
@@ -374,6 +485,14 @@ int32_t VirtGpuChannel::handle_channel_event(
   return 0;
 }
 
+int32_t VirtGpuChannel::receive_done(void) {
+  if (!poll_pending_)
+    return 0;
+
+  poll_pending_ = false;
+  return channel_poll();
+}
+
 int32_t VirtGpuChannel::allocate(
     const struct WaylandBufferCreateInfo& create_info,
     struct WaylandBufferCreateOutput& create_output) {
@@ -398,20 +517,24 @@ int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
   uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
   ssize_t bytes_read;
   int ret;
-  size_t index;
 
   struct CrossDomainReadWrite* cmd_write =
       (struct CrossDomainReadWrite*)cmd_buffer;
 
   void* write_data = &cmd_buffer[sizeof(struct CrossDomainReadWrite)];
 
+  // A pending send may introduce the pipe this write refers to.
+  ret = flush();
+  if (ret < 0)
+    return ret;
+
   memset(cmd_write, 0, sizeof(struct CrossDomainReadWrite));
 
   cmd_write->hdr.cmd = CROSS_DOMAIN_CMD_WRITE;
   cmd_write->identifier = 0xffffffff;
 
   ret = pipe_lookup(CROSS_DOMAIN_ID_TYPE_WRITE_PIPE, cmd_write->identifier,
-                    read_fd, index);
+                    read_fd);
   if (ret < 0)
     return -EINVAL;
 
@@ -443,8 +566,7 @@ int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
 
   if (hang_up) {
     close(read_fd);
-    std::swap(pipe_cache_[index], pipe_cache_.back());
-    pipe_cache_.pop_back();
+    pipe_erase(cmd_write->identifier);
   }
 
   return 0;
@@ -460,6 +582,7 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
 
   exec.command = (uint64_t)&cmd[0];
   exec.size = size;
+  exec.fence_fd = -1;
   if (ring_idx != CROSS_DOMAIN_RING_NONE) {
     exec.flags = VIRTGPU_EXECBUF_RING_IDX;
     exec.ring_idx = ring_idx;
@@ -467,6 +590,12 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
     exec.num_bo_handles = 1;
   }
 
+  // Export a fence so completion can be awaited in poll(2) rather than by
+  // spinning on DRM_IOCTL_VIRTGPU_WAIT, which returns EAGAIN while the
+  // host is still processing.
+  if (wait)
+    exec.flags |= VIRTGPU_EXECBUF_FENCE_FD_OUT;
+
   ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
   if (ret < 0) {
     fprintf(stderr, "DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n",
@@ -474,23 +603,41 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
     return -EINVAL;
   }
 
-  // This is the most traditional way to wait for virtgpu to be finished.  We
-  // submit a list of handles to the GPU, and wait for the GPU to be done
-  // processing them.  In our case, the handle is the shared ring buffer between
-  // the guest proxy (Sommelier) and host compositor proxy (cross domain context
-  // type in crosvm).  More sophistication will be needed in the future if the
-  // virtgpu approach has any hope of success.
   if (wait) {
-    ret = -EAGAIN;
-    while (ret == -EAGAIN) {
-      wait_3d.handle = ring_handle_;
-      ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_WAIT, &wait_3d);
-    }
-  }
+    if (exec.fence_fd >= 0) {
+      struct pollfd fence_poll = {0};
+
+      fence_poll.fd = exec.fence_fd;
+      fence_poll.events = POLLIN;
+      do {
+        ret = poll(&fence_poll, 1, -1);
+      } while (ret < 0 && errno == EINTR);
+      close(exec.fence_fd);
+
+      if (ret < 0) {
+        fprintf(stderr, "fence poll failed with %s\n", strerror(errno));
+        return -errno;
+      }
+      ret = 0;
+    } else {
+      // Fallback for kernels without out-fence support.  This is the most
+      // traditional way to wait for virtgpu to be finished.  We submit a
+      // list of handles to the GPU, and wait for the GPU to be done
+      // processing them.  In our case, the handle is the shared ring buffer
+      // between the guest proxy (Sommelier) and host compositor proxy
+      // (cross domain context type in crosvm).
+      ret = -EAGAIN;
+      while (ret == -EAGAIN) {
+        wait_3d.handle = ring_handle_;
+        ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_WAIT, &wait_3d);
+      }
 
-  if (ret < 0) {
-    fprintf(stderr, "DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-    return ret;
+      if (ret < 0) {
+        fprintf(stderr, "DRM_IOCTL_VIRTGPU_WAIT failed with %s\n",
+                strerror(errno));
+        return ret;
+      }
+    }
   }
 
   return 0;
@@ -503,16 +650,24 @@ int32_t VirtGpuChannel::image_query(const struct WaylandBufferCreateInfo& input,
   uint32_t* addr = (uint32_t*)ring_addr_;
   struct CrossDomainGetImageRequirements cmd_get_reqs = {{0}};
   struct BufferDescription new_desc = {{0}};
+  struct ImageKey key = {input.width, input.height, input.drm_format};
 
   // Sommelier is single threaded, so no need for locking.
-  for (const auto& desc : description_cache_) {
-    if (desc.input.width == input.width && desc.input.height == input.height &&
-        desc.input.drm_format == input.drm_format) {
-      memcpy(&output, &desc.output, sizeof(struct WaylandBufferCreateOutput));
-      blob_id = (uint64_t)desc.blob_id;
-      return 0;
-    }
-  }
+  auto index_entry = description_index_.find(key);
+  if (index_entry != description_index_.end()) {
+    // Move the description to the front so it survives LRU eviction.
+    description_cache_.splice(description_cache_.begin(), description_cache_,
+                              index_entry->second);
+    const struct BufferDescription& desc = index_entry->second->second;
+    memcpy(&output, &desc.output, sizeof(struct WaylandBufferCreateOutput));
+    blob_id = (uint64_t)desc.blob_id;
+    return 0;
+  }
+
+  // Keep command ordering on the host conservative.
+  ret = flush();
+  if (ret < 0)
+    return ret;
 
   cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
   cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
@@ -549,7 +704,17 @@ int32_t VirtGpuChannel::image_query(const struct WaylandBufferCreateInfo& input,
   output.host_size = new_desc.output.host_size;
   blob_id = (uint64_t)new_desc.blob_id;
 
-  description_cache_.push_back(new_desc);
+  // Evict the least recently used description to stay within bounds.  An
+  // evicted entry holds no kernel resources -- the gem handle backing a blob
+  // is closed as soon as its dma-buf fd is exported in create_host_blob() --
+  // so dropping it only costs a future image query round trip.
+  if (description_cache_.size() >= MAX_IMAGE_CACHE_ENTRIES) {
+    description_index_.erase(description_cache_.back().first);
+    description_cache_.pop_back();
+  }
+
+  description_cache_.emplace_front(key, new_desc);
+  description_index_[key] = description_cache_.begin();
   return 0;
 }
 
@@ -662,12 +827,12 @@ int32_t VirtGpuChannel::fd_analysis(int fd,
     if (ret)
       return ret;
 
-    for (const auto& pipe_desc : pipe_cache_) {
-      if (pipe_desc.inode == inode) {
-        identifier = pipe_desc.identifier;
-        identifier_type = pipe_desc.identifier_type;
-        return 0;
-      }
+    auto inode_entry = pipe_inode_index_.find(inode);
+    if (inode_entry != pipe_inode_index_.end()) {
+      const PipeDescription& pipe_desc = pipe_cache_[inode_entry->second];
+      identifier = pipe_desc.identifier;
+      identifier_type = pipe_desc.identifier_type;
+      return 0;
     }
 
     return -EINVAL;
@@ -708,7 +873,10 @@ int32_t VirtGpuChannel::create_pipe_internal(int& out_pipe_fd,
   pipe_desc.write_fd = fds[1];
   pipe_desc.identifier = identifier;
   pipe_desc.identifier_type = identifier_type;
-  pipe_cache_.push_back(pipe_desc);
+  pipe_cache_[identifier] = pipe_desc;
+  pipe_inode_index_[pipe_desc.inode] = identifier;
+  pipe_fd_index_[fds[0]] = identifier;
+  pipe_fd_index_[fds[1]] = identifier;
 
   if (return_read_pipe)
     out_pipe_fd = fds[0];
@@ -739,13 +907,12 @@ int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
       receive.num_fds++;
 
       if (cmd_receive->identifier_types[i] == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
-        size_t index;
         int ret = 0;
         if (out_read_pipe >= 0)
           return -EINVAL;
 
         ret = pipe_lookup(cmd_receive->identifier_types[i],
-                          cmd_receive->identifiers[i], out_read_pipe, index);
+                          cmd_receive->identifiers[i], out_read_pipe);
         if (ret < 0)
           return -EINVAL;
 
@@ -757,12 +924,9 @@ int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
   }
 
   if (cmd_receive->opaque_data_size > 0) {
-    receive.data =
-        reinterpret_cast<uint8_t*>(calloc(1, cmd_receive->opaque_data_size));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, cmd_receive->opaque_data_size);
+    // Handed to the caller in place; the ring is not re-armed until the
+    // caller reports the data consumed via receive_done().
+    receive.data = recv_data;
   }
 
   receive.data_size = cmd_receive->opaque_data_size;
@@ -773,7 +937,6 @@ int32_t VirtGpuChannel::handle_read() {
   int write_fd = -1;
   int ret = 0;
   ssize_t bytes_written;
-  size_t index;
   struct CrossDomainReadWrite* cmd_read =
       (struct CrossDomainReadWrite*)ring_addr_;
 
@@ -781,7 +944,7 @@ int32_t VirtGpuChannel::handle_read() {
       (uint8_t*)ring_addr_ + sizeof(struct CrossDomainReadWrite);
 
   ret = pipe_lookup(CROSS_DOMAIN_ID_TYPE_READ_PIPE, cmd_read->identifier,
-                    write_fd, index);
+                    write_fd);
   if (ret < 0)
     return -EINVAL;
 
@@ -794,8 +957,7 @@ int32_t VirtGpuChannel::handle_read() {
 
   if (cmd_read->hang_up) {
     close(write_fd);
-    std::swap(pipe_cache_[index], pipe_cache_.back());
-    pipe_cache_.pop_back();
+    pipe_erase(cmd_read->identifier);
   }
 
   return 0;
@@ -803,37 +965,47 @@ int32_t VirtGpuChannel::handle_read() {
 
 int32_t VirtGpuChannel::pipe_lookup(uint32_t identifier_type,
                                     uint32_t& identifier,
-                                    int& fd,
-                                    size_t& index) {
-  index = 0;
-  for (const auto& pipe_desc : pipe_cache_) {
-    if (pipe_desc.identifier == identifier) {
-      // The host and guest are proxying the read operation, need to write to
-      // internally owned file descriptor.
-      if (identifier_type == CROSS_DOMAIN_ID_TYPE_READ_PIPE) {
-        fd = pipe_desc.write_fd;
-        return 0;
-      }
-
-      // The host and guest are proxying the write operation, need to read from
-      // internally owned file descriptor.
-      if (identifier_type == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
-        fd = pipe_desc.read_fd;
-        return 0;
-      }
+                                    int& fd) {
+  auto cache_entry = pipe_cache_.find(identifier);
+  if (cache_entry != pipe_cache_.end()) {
+    const PipeDescription& pipe_desc = cache_entry->second;
+
+    // The host and guest are proxying the read operation, need to write to
+    // internally owned file descriptor.
+    if (identifier_type == CROSS_DOMAIN_ID_TYPE_READ_PIPE) {
+      fd = pipe_desc.write_fd;
+      return 0;
     }
 
-    if (fd == pipe_desc.read_fd || fd == pipe_desc.write_fd) {
-      identifier = pipe_desc.identifier;
+    // The host and guest are proxying the write operation, need to read from
+    // internally owned file descriptor.
+    if (identifier_type == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
+      fd = pipe_desc.read_fd;
       return 0;
     }
+  }
 
-    index++;
+  auto fd_entry = pipe_fd_index_.find(fd);
+  if (fd_entry != pipe_fd_index_.end()) {
+    identifier = fd_entry->second;
+    return 0;
   }
 
   return -EINVAL;
 }
 
+void VirtGpuChannel::pipe_erase(uint32_t identifier) {
+  auto cache_entry = pipe_cache_.find(identifier);
+  if (cache_entry == pipe_cache_.end())
+    return;
+
+  const PipeDescription& pipe_desc = cache_entry->second;
+  pipe_inode_index_.erase(pipe_desc.inode);
+  pipe_fd_index_.erase(pipe_desc.read_fd);
+  pipe_fd_index_.erase(pipe_desc.write_fd);
+  pipe_cache_.erase(cache_entry);
+}
+
 size_t VirtGpuChannel::max_send_size(void) {
-  return MAX_SEND_SIZE;
+  return large_sends_ ? MAX_SEND_SIZE : LEGACY_SEND_SIZE;
 }
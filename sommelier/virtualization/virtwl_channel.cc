@@ -17,7 +17,8 @@
 #include "wayland_channel.h"       // NOLINT(build/include_directory)
 
 #define VIRTWL_DEVICE "/dev/wl0"
-#define MAX_SEND_SIZE (DEFAULT_BUFFER_SIZE - sizeof(struct virtwl_ioctl_txn))
+#define MAX_SEND_SIZE (MAX_BUFFER_SIZE - sizeof(struct virtwl_ioctl_txn))
+#define LEGACY_SEND_SIZE (DEFAULT_BUFFER_SIZE - sizeof(struct virtwl_ioctl_txn))
 
 VirtWaylandChannel::~VirtWaylandChannel() {
   if (virtwl_ >= 0)
@@ -95,15 +96,17 @@ int32_t VirtWaylandChannel::create_pipe(int& out_pipe_fd) {
 
 int32_t VirtWaylandChannel::send(const struct WaylandSendReceive& send) {
   int ret;
-  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
 
-  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)send_txn_;
   void* send_data = &txn->data;
 
   if (send.data_size > max_send_size())
     return -EINVAL;
 
-  memcpy(send_data, send.data, send.data_size);
+  // Callers that staged the payload in send_buffer() already wrote it at
+  // the right place within the transaction.
+  if (send.data != send_data)
+    memcpy(send_data, send.data, send.data_size);
 
   for (uint32_t i = 0; i < WAYLAND_MAX_FDs; i++) {
     if (i < send.num_fds) {
@@ -115,8 +118,54 @@ int32_t VirtWaylandChannel::send(const struct WaylandSendReceive& send) {
 
   txn->len = send.data_size;
   ret = ioctl(send.channel_fd, VIRTWL_IOCTL_SEND, txn);
-  if (ret)
+  if (ret) {
+    // A kernel that only accepts page-sized transactions rejects the first
+    // oversized send; fall back to fragmenting it (and all future ones).
+    if (large_sends_ && send.data_size > LEGACY_SEND_SIZE &&
+        (errno == EINVAL || errno == E2BIG || errno == EMSGSIZE)) {
+      large_sends_ = false;
+      return send_fragmented(send);
+    }
     return -errno;
+  }
+
+  return 0;
+}
+
+int32_t VirtWaylandChannel::send_fragmented(
+    const struct WaylandSendReceive& send) {
+  int ret;
+  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
+  const uint8_t* data = send.data;
+  size_t remaining = send.data_size;
+  bool first = true;
+
+  // The channel is a byte stream to the host compositor and fds may arrive
+  // ahead of the message that references them, so splitting the payload into
+  // page-sized transactions with the fds on the first one is equivalent.
+  while (remaining > 0 || first) {
+    size_t chunk = remaining < LEGACY_SEND_SIZE ? remaining : LEGACY_SEND_SIZE;
+
+    memcpy(&txn->data, data, chunk);
+
+    for (uint32_t i = 0; i < WAYLAND_MAX_FDs; i++) {
+      if (first && i < send.num_fds) {
+        txn->fds[i] = send.fds[i];
+      } else {
+        txn->fds[i] = -1;
+      }
+    }
+
+    txn->len = chunk;
+    ret = ioctl(send.channel_fd, VIRTWL_IOCTL_SEND, txn);
+    if (ret)
+      return -errno;
+
+    data += chunk;
+    remaining -= chunk;
+    first = false;
+  }
 
   return 0;
 }
@@ -126,10 +175,9 @@ int32_t VirtWaylandChannel::handle_channel_event(
     struct WaylandSendReceive& receive,
     int& out_read_pipe) {
   int ret;
-  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
 
-  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)recv_txn_;
+  size_t max_recv_size = sizeof(recv_txn_) - sizeof(struct virtwl_ioctl_txn);
   void* recv_data = &txn->data;
 
   txn->len = max_recv_size;
@@ -146,13 +194,8 @@ int32_t VirtWaylandChannel::handle_channel_event(
     }
   }
 
-  if (txn->len > 0) {
-    receive.data = reinterpret_cast<uint8_t*>(calloc(1, txn->len));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, txn->len);
-  }
+  if (txn->len > 0)
+    receive.data = reinterpret_cast<uint8_t*>(recv_data);
 
   receive.data_size = txn->len;
   event_type = WaylandChannelEvent::Receive;
@@ -221,5 +264,10 @@ int32_t VirtWaylandChannel::handle_pipe(int read_fd,
 }
 
 size_t VirtWaylandChannel::max_send_size(void) {
-  return MAX_SEND_SIZE;
+  return large_sends_ ? MAX_SEND_SIZE : LEGACY_SEND_SIZE;
+}
+
+uint8_t* VirtWaylandChannel::send_buffer(void) {
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)send_txn_;
+  return reinterpret_cast<uint8_t*>(&txn->data);
 }
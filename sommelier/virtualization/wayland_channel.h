@@ -4,9 +4,14 @@
 #ifndef VM_TOOLS_SOMMELIER_VIRTUALIZATION_WAYLAND_CHANNEL_H_
 #define VM_TOOLS_SOMMELIER_VIRTUALIZATION_WAYLAND_CHANNEL_H_
 
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
 #include <sys/mman.h>
-#include <vector>
+#include <unordered_map>
+#include <utility>
 
 /*
  * Copied from `VIRTWL_SEND_MAX_ALLOCS`.  It was originally set this way
@@ -17,6 +22,15 @@
 // Default buffer size based on the size of a typical page.
 #define DEFAULT_BUFFER_SIZE 4096
 
+/*
+ * Preferred size of a channel transaction.  Multi-page transactions let a
+ * large burst -- a keymap transfer, a mime-type heavy data offer, a frame
+ * touching many surfaces -- cross the channel in one guest exit instead of
+ * being fragmented into page-sized sends.  Kept well under 64KB because the
+ * cross-domain header carries a 16-bit cmd_size.
+ */
+#define MAX_BUFFER_SIZE (8 * DEFAULT_BUFFER_SIZE)
+
 struct WaylandSendReceive {
   int channel_fd;
 
@@ -94,6 +108,14 @@ class WaylandChannel {
   // Returns -errno on failure.
   virtual int32_t create_context(int& out_channel_fd) = 0;
 
+  // Prepares this channel instance for allocation-only use, when an instance
+  // is dedicated to bulk traffic alongside the one carrying the protocol
+  // stream.  Implementations that can allocate on a bare device fd need no
+  // extra setup; the default is a no-op.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t create_allocation_context() { return 0; }
+
   // Creates a new clipboard pipe for Wayland input.  Note this interface can't
   // wrap a call to "pipe", and is named based on VIRTWL_IOCTL_NEW_PIPE.  A new
   // interface may be designed in the future.
@@ -113,6 +135,12 @@ class WaylandChannel {
   // in `send.data`.
   virtual int32_t send(const struct WaylandSendReceive& send) = 0;
 
+  // Submits any sends buffered by the implementation to the host.  send()
+  // may coalesce small messages to reduce per-command submission overhead;
+  // callers must flush once the current batch of outbound data has been
+  // handed over.  Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t flush() { return 0; }
+
   // Handles a poll event on the channel file descriptor.
   //
   // Returns 0 on success.  Returns -errno on failure.  On success, the type of
@@ -128,8 +156,10 @@ class WaylandChannel {
   // function must be called the case of `out_read_pipe` event.
   //
   // In both above cases, if the returned `receive.data_size` is than greater
-  // zero, then the caller takes ownership of `receive.data` and must free(..)
-  // the memory when appropriate.
+  // zero, then `receive.data` points into channel owned storage that stays
+  // valid until receive_done() is called.  The caller must not free(..) it,
+  // and must call receive_done() once the data has been forwarded, before
+  // polling the channel again.
   //
   // If `event_type` is WaylandChannelEvent::Read, then both `out_read_pipe` and
   // `receive` are meaningless. The implementation handles the event internally.
@@ -158,13 +188,31 @@ class WaylandChannel {
   virtual int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) = 0;
 
   // Returns the maximum size of opaque data that the channel is able to handle
-  // in the `send` function.  Must be less than or equal to DEFAULT_BUFFER_SIZE.
+  // in the `send` function.  Must be less than or equal to MAX_BUFFER_SIZE.
+  // The value may shrink after a send, if the implementation discovers the
+  // host or kernel only accepts page-sized transactions; callers should query
+  // it before staging each message rather than caching it.
   virtual size_t max_send_size(void) = 0;
+
+  // Returns a channel owned staging area of `max_send_size` bytes, or NULL if
+  // the implementation has no use for one.  A caller that reads outbound data
+  // directly into this buffer and passes it as `send.data` lets the channel
+  // skip an extra copy into its transaction structure.
+  virtual uint8_t* send_buffer(void) { return nullptr; }
+
+  // Must be called once the caller has finished forwarding the `receive.data`
+  // returned by handle_channel_event.  Implementations that hand out pointers
+  // into host shared storage re-arm the host here, so the data cannot be
+  // overwritten while it is still in flight.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t receive_done(void) { return 0; }
 };
 
 class VirtWaylandChannel : public WaylandChannel {
  public:
-  VirtWaylandChannel() : virtwl_{-1}, supports_dmabuf_(false) {}
+  VirtWaylandChannel()
+      : virtwl_{-1}, supports_dmabuf_(false), large_sends_(true) {}
   ~VirtWaylandChannel();
 
   int32_t init() override;
@@ -182,11 +230,33 @@ class VirtWaylandChannel : public WaylandChannel {
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size(void) override;
+  uint8_t* send_buffer(void) override;
 
  private:
+  // Splits an oversized send into page-sized transactions, with the fds
+  // attached to the first one.
+  int32_t send_fragmented(const struct WaylandSendReceive& send);
+
   // virtwl device file descriptor
   int32_t virtwl_;
   bool supports_dmabuf_;
+
+  /*
+   * Whether multi-page sends are believed to work.  Optimistically true;
+   * cleared the first time the kernel rejects an oversized transaction, after
+   * which max_send_size() reports the single-page legacy limit.
+   */
+  bool large_sends_;
+
+  /*
+   * Transaction arenas for the send and receive ioctls.  virtwl requires the
+   * txn header and inline data to be contiguous, so the data area of
+   * `send_txn_` is exposed via send_buffer() and callers that stage outbound
+   * bytes there get a zero copy VIRTWL_IOCTL_SEND.  `recv_txn_` backs the
+   * `receive.data` returned by handle_channel_event.
+   */
+  uint8_t send_txn_[MAX_BUFFER_SIZE];
+  uint8_t recv_txn_[MAX_BUFFER_SIZE];
 };
 
 class VirtGpuChannel : public WaylandChannel {
@@ -196,14 +266,19 @@ class VirtGpuChannel : public WaylandChannel {
         ring_addr_{MAP_FAILED},
         ring_handle_{0},
         supports_dmabuf_(false),
-        descriptor_id_{1} {}
+        descriptor_id_{1},
+        send_pending_{false},
+        large_sends_{true},
+        poll_pending_{false} {}
   ~VirtGpuChannel();
 
   int32_t init() override;
   bool supports_dmabuf() override;
   int32_t create_context(int& out_channel_fd) override;
+  int32_t create_allocation_context() override;
   int32_t create_pipe(int& out_pipe_fd) override;
   int32_t send(const struct WaylandSendReceive& send) override;
+  int32_t flush() override;
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override;
@@ -214,6 +289,7 @@ class VirtGpuChannel : public WaylandChannel {
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size(void) override;
+  int32_t receive_done(void) override;
 
  private:
   /*
@@ -238,6 +314,31 @@ class VirtGpuChannel : public WaylandChannel {
     uint32_t identifier;
   };
 
+  /*
+   * Key for the image description cache.  Two allocations share a description
+   * when their geometry and format match, so lookups hash on those fields
+   * rather than scanning every cached description.
+   */
+  struct ImageKey {
+    uint32_t width;
+    uint32_t height;
+    uint32_t drm_format;
+
+    bool operator==(const ImageKey& other) const {
+      return width == other.width && height == other.height &&
+             drm_format == other.drm_format;
+    }
+  };
+
+  struct ImageKeyHash {
+    size_t operator()(const ImageKey& key) const {
+      size_t hash = key.width;
+      hash = hash * 31 + key.height;
+      hash = hash * 31 + key.drm_format;
+      return hash;
+    }
+  };
+
   int32_t image_query(const struct WaylandBufferCreateInfo& input,
                       struct WaylandBufferCreateOutput& output,
                       uint64_t& blob_id);
@@ -269,8 +370,9 @@ class VirtGpuChannel : public WaylandChannel {
 
   int32_t pipe_lookup(uint32_t identifier_type,
                       uint32_t& identifier,
-                      int& fd,
-                      size_t& index);
+                      int& fd);
+
+  void pipe_erase(uint32_t identifier);
 
   int32_t virtgpu_;
   void* ring_addr_;
@@ -279,8 +381,120 @@ class VirtGpuChannel : public WaylandChannel {
   // Matches the crosvm-side descriptor_id, must be an odd number.
   uint32_t descriptor_id_;
 
-  std::vector<BufferDescription> description_cache_;
-  std::vector<PipeDescription> pipe_cache_;
+  /*
+   * Image descriptions in LRU order (most recently used first), with an
+   * index for O(1) lookup.  The cache is bounded -- image_query() evicts the
+   * least recently used description once MAX_IMAGE_CACHE_ENTRIES is reached,
+   * so a long-lived session with many distinct buffer sizes can't grow it
+   * without limit.
+   */
+  std::list<std::pair<ImageKey, BufferDescription>> description_cache_;
+  std::unordered_map<ImageKey,
+                     std::list<std::pair<ImageKey, BufferDescription>>::
+                         iterator,
+                     ImageKeyHash>
+      description_index_;
+
+  /*
+   * Live pipes indexed by host identifier, with secondary indexes for the
+   * two other lookups send() and handle_pipe() perform: by pipe inode (for
+   * fds handed to us by the client) and by our own fd for either end.
+   */
+  std::unordered_map<uint32_t, PipeDescription> pipe_cache_;
+  std::unordered_map<uint32_t, uint32_t> pipe_inode_index_;
+  std::unordered_map<int, uint32_t> pipe_fd_index_;
+
+  // Splits a pending multi-page batch into single-page CROSS_DOMAIN_CMD_SEND
+  // commands, with the identifiers attached to the first one.
+  int32_t flush_fragmented(struct CrossDomainSendReceive* cmd_send);
+
+  /*
+   * Coalesced CROSS_DOMAIN_CMD_SEND under construction.  Small outbound
+   * messages are appended here and submitted in one execbuffer by flush(),
+   * so a burst of Wayland requests costs one doorbell instead of one per
+   * message.  Commands that must stay ordered with respect to sends flush
+   * it first.
+   */
+  uint8_t send_buffer_[MAX_BUFFER_SIZE];
+  bool send_pending_;
+
+  /*
+   * Whether multi-page sends are believed to work.  Optimistically true;
+   * cleared the first time the host rejects an oversized command, after
+   * which max_send_size() reports the single-page legacy limit and flushes
+   * fragment accordingly.
+   */
+  bool large_sends_;
+
+  /*
+   * Whether a consumed CROSS_DOMAIN_CMD_RECEIVE still holds the ring.  The
+   * `receive.data` handed to the caller points straight into the shared
+   * ring, so re-arming host polling waits until receive_done().
+   */
+  bool poll_pending_;
+};
+
+// Runs WaylandChannel::allocate() calls on a helper thread, so callers on
+// the event loop can overlap the blocking virtio round trip with other frame
+// work.  Completions are reported through an eventfd intended to be added to
+// the wl_event_loop; when it becomes readable, call dispatch() to run the
+// completion callbacks on the caller's thread.
+//
+// WaylandChannel implementations are single-threaded, so the helper thread
+// is only safe when |channel| is dedicated to this allocator.  A channel
+// shared with the event loop's protocol traffic must be entered from the
+// event loop thread alone: in that configuration allocations run
+// synchronously in the caller, with asynchronous completions still
+// delivered through dispatch() so the calling convention doesn't change.
+class ChannelAllocator {
+ public:
+  typedef void (*CompletionFunc)(
+      int rv, struct WaylandBufferCreateOutput* create_output, void* data);
+
+  // |dedicated| declares that |channel| is used by this allocator alone;
+  // only then do allocations run on the helper thread.
+  ChannelAllocator(WaylandChannel* channel, bool dedicated);
+
+  // Pollable completion fd; readable when at least one asynchronous
+  // allocation has completed.
+  int completion_fd() { return completion_fd_; }
+
+  // Queues an allocation.  |callback| runs from dispatch() with the
+  // allocation result and the filled create output.
+  void allocate(const struct WaylandBufferCreateInfo& create_info,
+                CompletionFunc callback,
+                void* data);
+
+  // Performs an allocation, blocking until it completes.  Same contract as
+  // WaylandChannel::allocate().
+  int32_t allocate_sync(const struct WaylandBufferCreateInfo& create_info,
+                        struct WaylandBufferCreateOutput& create_output);
+
+  // Drains completed asynchronous allocations, invoking their callbacks.
+  // Must be called from the thread that owns the event loop.
+  void dispatch();
+
+ private:
+  struct Request {
+    struct WaylandBufferCreateInfo create_info;
+    struct WaylandBufferCreateOutput create_output;
+    int32_t rv;
+    // NULL for synchronous requests, which are signalled through |done|.
+    CompletionFunc callback;
+    void* data;
+    bool done;
+  };
+
+  void worker();
+
+  WaylandChannel* channel_;
+  bool dedicated_;
+  int completion_fd_;
+  std::mutex mutex_;
+  std::condition_variable pending_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Request*> pending_;
+  std::deque<Request*> completed_;
 };
 
 int open_virtgpu(char** drm_device);